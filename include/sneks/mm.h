@@ -17,6 +17,23 @@
 /* memory attributes for Sysmem::alter_flags */
 #define SMATTR_PIN 1	/* disallows replacement once mapped */
 
+/* labels of the memory pressure protocol between Sysmem and vm's balloon
+ * thread. the thread introduces itself with a BALLOON_HELLO call to Sysmem,
+ * and then serves these from Sysmem alone:
+ *   - BALLOON_WANT, u=1 (number of frames): reply is BALLOON_OFFER, u=1 with
+ *     the fpage of a free frame that vm can spare, or L4_Nilpage for none.
+ *   - BALLOON_TAKE, u=0: reply is a GrantItem of the last offered frame, or
+ *     empty once the offer has lapsed; vm withdraws offers not taken promptly.
+ *   - BALLOON_RETURN, t=2: GrantItem of a frame vm has loaned out, sent at
+ *     its own address. reply is empty.
+ * vm's page faults in the middle of these are served in-band.
+ */
+#define BALLOON_HELLO 0xba10
+#define BALLOON_WANT 0xba11
+#define BALLOON_OFFER 0xba12
+#define BALLOON_TAKE 0xba13
+#define BALLOON_RETURN 0xba14
+
 /* usage:
  *
  * int size_log2;
@@ -153,6 +153,17 @@ extern struct rb_node *__rb_prev(struct rb_node *);
 extern struct rb_node *__rb_first(struct rb_root *);
 extern struct rb_node *__rb_last(struct rb_root *);
 
+/* augmented rbtrees: @func recomputes a node's per-subtree data from its
+ * children's. call __rb_augment_insert() after __rb_insert_color(), and
+ * bracket __rb_erase() between __rb_augment_erase_begin() and _end().
+ */
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+extern void __rb_augment_insert(struct rb_node *node, rb_augment_f func,
+	void *data);
+extern struct rb_node *__rb_augment_erase_begin(struct rb_node *node);
+extern void __rb_augment_erase_end(struct rb_node *node, rb_augment_f func,
+	void *data);
+
 /* Fast replacement of a single node without remove/rebalance/add/rebalance */
 extern void __rb_replace_node(struct rb_node *victim, struct rb_node *new, 
 			    struct rb_root *root);
@@ -192,6 +203,9 @@ static inline void __rb_link_node(struct rb_node * node, struct rb_node * parent
 #define rb_first __rb_first
 #define rb_last __rb_last
 #define rb_replace_node __rb_replace_node
+#define rb_augment_insert __rb_augment_insert
+#define rb_augment_erase_begin __rb_augment_erase_begin
+#define rb_augment_erase_end __rb_augment_erase_end
 #define rb_link_node __rb_link_node
 
 #endif
@@ -15,8 +15,32 @@
 #define MAP_FAILED (void *)-1
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
+#define MAP_POPULATE 0x8000
+
+/* sneks extension: MAP_FAULTAROUND(n) in mmap(2) flags sets the number of
+ * neighbouring pages resolved per fault in the mapping to 2**n, overriding
+ * vm's system-wide default. MAP_FAULTAROUND(0) maps only the faulting page.
+ */
+#define MAP_FAULTAROUND_SHIFT 24
+#define MAP_FAULTAROUND_MASK 0xf
+#define MAP_FAULTAROUND(log2) \
+	((((log2) + 1) & MAP_FAULTAROUND_MASK) << MAP_FAULTAROUND_SHIFT)
+
+#define MADV_NORMAL		0
+#define MADV_RANDOM		1
+#define MADV_SEQUENTIAL	2
+#define MADV_WILLNEED	3
+#define MADV_DONTNEED	4
+#define MADV_MERGEABLE	12
+
+#define MREMAP_MAYMOVE	1
+#define MREMAP_FIXED	2
 
 extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 extern int munmap(void *addr, size_t length);
+extern int mprotect(void *addr, size_t length, int prot);
+extern int madvise(void *addr, size_t length, int advice);
+extern int mincore(void *addr, size_t length, unsigned char *vec);
+extern void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ... /* void *new_address */);
 
 #endif
@@ -998,11 +998,15 @@ static L4_ThreadId_t start_vm(uintptr_t sip_mem)
 	qsort(phys, n_phys, sizeof phys[0], &cmp_fpage);
 
 	/* introduction to vm. this lets vm determine its memory model and
-	 * initialize its heap etc. so that it can receive physical memory.
+	 * initialize its heap etc. so that it can receive physical memory. it
+	 * also carries the salt for vm's page cache hashing.
 	 */
-	L4_LoadMR(0, (L4_MsgTag_t){ .X.label = 0xefff, .X.u = 2 }.raw);
+	L4_Word_t salt[4];
+	generate_u(salt, sizeof salt);
+	L4_LoadMR(0, (L4_MsgTag_t){ .X.label = 0xefff, .X.u = 6 }.raw);
 	L4_LoadMR(1, total / PAGE_SIZE);
 	L4_LoadMR(2, FP_HIGH(phys[n_phys - 1]));
+	L4_LoadMRs(3, ARRAY_SIZE(salt), salt);
 	L4_MsgTag_t tag = L4_Call(mem_tid);
 	if(L4_IpcFailed(tag)) goto initfail;
 
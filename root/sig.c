@@ -60,9 +60,14 @@ static void sig_deliver(struct process *p, int sig, bool self)
 			__func__, sig);
 		return;
 	}
-	L4_ThreadId_t space = p->task.threads.item[0];
+	L4_ThreadId_t space = p->task.threads.item[0], pager;
+	int n = __vm_pager(vm_tid, &pager.raw, ra_ptr2id(ra_process, p));
+	if(n != 0) {
+		printf("uapi:%s: VM::pager failed, n=%d\n", __func__, n);
+		abort();	/* FIXME: do something else! */
+	}
 	L4_Word_t res = L4_ThreadControl(p->sighelper_tid, space,
-		L4_Myself(), vm_tid, p->sighelper_utcb);
+		L4_Myself(), pager, p->sighelper_utcb);
 	if(res != 1) {
 		printf("uapi:%s: ThreadControl failed, ec=%lu\n",
 			__func__, L4_ErrorCode());
@@ -71,7 +76,7 @@ static void sig_deliver(struct process *p, int sig, bool self)
 
 	L4_Word_t ip = p->sigpage_addr + PAGE_SIZE - sizeof sigpage_tail_code,
 		sp = (ip - 64) & ~63, rc;
-	int n = __vm_breath_of_life(vm_tid, &rc, p->sighelper_tid.raw, sp, ip);
+	n = __vm_breath_of_life(pager, &rc, p->sighelper_tid.raw, sp, ip);
 	if(n != 0) {
 		printf("uapi:%s: VM::breath_of_life failed, n=%d\n", __func__, n);
 		abort();	/* FIXME: unfuckinate! */
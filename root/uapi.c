@@ -1098,10 +1098,16 @@ static int upload_startup_stack(uintptr_t *sp_p,
 	memcpy(body + argsiz + envsiz, auxbuf, ++auxsiz);
 	assert(argsiz + envsiz + auxsiz == body_len);
 
-	n = __vm_upload_page(vm_tid, ra_ptr2id(ra_process, p),
-		*sp_p - n_pages * PAGE_SIZE, image, n_pages * PAGE_SIZE,
-		PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED);
+	/* in as few transfers as the string buffer allows. */
+	const size_t seg = SNEKS_IO_IOSEG_MAX;
+	n = 0;
+	for(size_t off = 0; off < n_pages * PAGE_SIZE && n == 0; off += seg) {
+		size_t len = min(seg, n_pages * PAGE_SIZE - off);
+		n = __vm_upload_pages(vm_tid, ra_ptr2id(ra_process, p),
+			*sp_p - n_pages * PAGE_SIZE + off, image + off, len,
+			PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED);
+	}
 	if(n > 0) n = -EIO;
 	*sp_p -= body_space + meta_space;
 
@@ -1122,14 +1128,21 @@ static int launch_process(struct process *p,
 
 	int n = make_space(first_tid, p->task.kip_area, p->task.utcb_area);
 	if(n < 0) return n;
-	L4_Word_t res = L4_ThreadControl(first_tid, first_tid, L4_Myself(), vm_tid, utcb_loc);
+	L4_ThreadId_t pager;
+	n = __vm_pager(vm_tid, &pager.raw, ra_ptr2id(ra_process, p));
+	if(n != 0) {
+		printf("uapi:%s: VM::pager() failed, n=%d\n", __func__, n);
+		abort();	/* FIXME: cleanup */
+	}
+	L4_Word_t res = L4_ThreadControl(first_tid, first_tid, L4_Myself(), pager, utcb_loc);
 	if(res != 1) {
 		printf("uapi:%s: ThreadControl failed, ec=%lu\n", __func__, L4_ErrorCode());
 		abort();	/* FIXME: cleanup and return error of some kind */
 	}
 
+	/* (the new thread takes its breath of life from its pager only.) */
 	L4_Word_t status;
-	n = __vm_breath_of_life(vm_tid, &status, first_tid.raw, argpos, img->start);
+	n = __vm_breath_of_life(pager, &status, first_tid.raw, argpos, img->start);
 	if(n < 0) {
 		printf("uapi:%s: VM::breath_of_life() failed, n=%d\n", __func__, n);
 		abort();	/* FIXME: cleanup */
@@ -1584,15 +1597,22 @@ static int uapi_fork(L4_Word_t *tid_raw_p, L4_Word_t sp, L4_Word_t ip)
 		printf("can't make space in fork?\n");
 		abort();
 	}
+	L4_ThreadId_t pager;
+	n = __vm_pager(vm_tid, &pager.raw, newpid);
+	if(n != 0) {
+		/* FIXME: cleanup */
+		printf("%s: VM::pager failed, n=%d\n", __func__, n);
+		abort();
+	}
 	L4_Word_t res = L4_ThreadControl(start_tid, start_tid, L4_Myself(),
-		vm_tid, utcb_loc);
+		pager, utcb_loc);
 	if(res != 1) {
 		/* FIXME: cleanup */
 		printf("%s: ThreadControl failed, ec=%lu\n", __func__,
 			L4_ErrorCode());
 		abort();
 	}
-	n = __vm_breath_of_life(vm_tid, &res, start_tid.raw, sp, ip);
+	n = __vm_breath_of_life(pager, &res, start_tid.raw, sp, ip);
 	if(n != 0 || res != 0) {
 		/* FIXME: cleanup */
 		printf("%s: VM::breath_of_life failed, n=%d, res=%lu\n", __func__,
@@ -28,6 +28,7 @@
 #include <ccan/minmax/minmax.h>
 #include <ccan/hash/hash.h>
 #include <ccan/darray/darray.h>
+#include <ccan/list/list.h>
 
 #include <l4/types.h>
 #include <l4/ipc.h>
@@ -59,15 +60,26 @@
 #define CALLER_PID pidof_NP(muidl_get_sender())
 
 /* cached decompressed block. addresses are relative to start of image, and
- * indicate where the compressed data starts.
- *
- * TODO: add list link for replacement.
+ * indicate where the compressed data starts. lives on meta_lru or data_lru
+ * depending on @is_meta, most recently used first. @data points either to
+ * @buf, or straight into a memory-resident image for uncompressed blocks.
  */
 struct blk {
 	uint64_t block;
 	unsigned length;
 	uint64_t next_block;
-	uint8_t data[];	/* [length] */
+	struct list_node link;
+	unsigned epoch;	/* cache_epoch at last use */
+	bool is_meta;
+	const uint8_t *data;	/* [length] */
+	uint8_t buf[];
+};
+
+/* where a block's stored bytes are, and what they turn into. */
+struct blkhdr {
+	size_t start;	/* of stored data, past the metadata length word */
+	int size, bufmax;
+	bool compressed;
 };
 
 /* contained within a per-fs inode info structure. */
@@ -82,8 +94,9 @@ struct inode {
 	};
 };
 
-/* directory entry. indexed in dentry_index_hash by dir_ino and index,
- * dentry_name_hash by dir_ino and name, and dentry_ino_hash by ino. when
+/* directory entry. indexed in dentry_index_hash by dir_ino and index (unless
+ * it's DENTRY_NO_INDEX), dentry_name_hash by dir_ino and name, and
+ * dentry_ino_hash by ino. when
  * .type == DT_OTHERFS, there is a <struct otherfs> in otherfs_hash
  * corresponding to .ino referencing another filesystem and a directory handle
  * therein (or 0 for root, as for subfilesystems).
@@ -94,6 +107,8 @@ struct inode {
  * replaced; these are either the fall-out inode for the root directory, or a
  * fall-in inode for subordinate filesystems.
  */
+#define DENTRY_NO_INDEX UINT32_MAX	/* found by lookup() through a dir_index */
+
 struct dentry {
 	ino_t ino, dir_ino;
 	uint32_t index;
@@ -134,9 +149,38 @@ struct inode_ext
 	 */
 	uint64_t rest_start;
 	int offset;
+	union {
+		/* regular files: index of data blocks, built on first read. NULL
+		 * until then. released with the inode.
+		 */
+		struct blkidx *blocks;	/* [file_blocks()] */
+		/* directories of either format. */
+		struct {
+			uint32_t start_block, file_size, parent_inode;
+			int offset, i_count;
+			/* LDIR dir_index, loaded on first lookup(). NULL until then. */
+			struct diridx *index;	/* [i_count] */
+			char *index_names;
+		} dir;
+	};
 	struct inode fs_inode;
 };
 
+/* one entry of an extended directory's dir_index: the first name in a
+ * metadata block of the listing, where @pos is that block's byte offset
+ * into the listing. @name is an offset into ->dir.index_names.
+ */
+struct diridx {
+	uint32_t pos, start_block, name;
+};
+
+/* one data block of a regular file. @offset is relative to the inode's
+ * start_block; @lenword is the on-disk length word, 0 for sparse blocks.
+ */
+struct blkidx {
+	uint32_t offset, lenword;
+};
+
 /* an entry in /dev/.device-nodes, representing a synthetic device node
  * because mksquashfs isn't as good as mkcramfs used to be.
  */
@@ -173,6 +217,7 @@ static char sfs_type_table[] = {
 	[SQUASHFS_CHRDEV_TYPE] = DT_CHR,
 	[SQUASHFS_FIFO_TYPE] = DT_FIFO,
 	[SQUASHFS_SOCKET_TYPE] = DT_SOCK,
+	[SQUASHFS_LDIR_TYPE] = DT_DIR,
 };
 
 static L4_ThreadId_t dev_tid, rootfs_tid;
@@ -202,6 +247,25 @@ static struct htable blk_cache = HTABLE_INITIALIZER(blk_cache, &rehash_blk, NULL
 	symlink_loop_hash = HTABLE_INITIALIZER(symlink_loop_hash, &rehash_inode, NULL),
 	otherfs_hash = HTABLE_INITIALIZER(otherfs_hash, &rehash_otherfs, NULL);
 
+/* block cache replacement. entries used during the current request carry
+ * the current epoch and are never evicted, since callers keep struct blk
+ * pointers around in locals (e.g. read_metadata()'s hint) until they return.
+ * so the budget may be overshot for the duration of one request.
+ */
+static struct list_head meta_lru = LIST_HEAD_INIT(meta_lru),
+	data_lru = LIST_HEAD_INIT(data_lru);
+static size_t cache_budget = 2 * 1024 * 1024, meta_bytes = 0, data_bytes = 0;
+static unsigned cache_epoch = 0;
+static unsigned long cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+
+/* the counters are logged every this many misses, and at shutdown. */
+#define CACHE_REPORT_MISSES 1024
+
+/* locations of the metadata blocks of the fragment table, or NULL when the
+ * image has no fragments.
+ */
+static uint64_t *frag_index = NULL;	/* [SQUASHFS_FRAGMENT_INDEXES(fragments)] */
+
 /* ~0u for "not yet seen" */
 static unsigned *ino_to_blkoffset = NULL;	/* [fs_super->inodes + 1] */
 static ino_t root_ino;
@@ -278,73 +342,179 @@ static inline struct inode_ext *squashfs_i(struct inode *n) {
 	return container_of(n, struct inode_ext, fs_inode);
 }
 
-/* read block at @pos in the filesystem image. @length is as to cache_get(),
- * @output must have enough space for the kind of block being read. return
- * value is the number of bytes decompressed. *@next_block_p will be filled in
- * with the position of the next compressed block.
+/* find the block at @pos in the filesystem image. @length is as to
+ * cache_get(). *@next_block_p will be filled in with the position of the next
+ * compressed block.
  */
-static int read_block(void *output, uint64_t *next_block_p, size_t pos, int length)
+static void read_block_header(struct blkhdr *h, uint64_t *next_block_p, size_t pos, int length)
 {
-	fseek(fs_file, pos, SEEK_SET);
-	int n, sz, bufmax, compressed;
 	if(length == 0) {
 		/* metadata block read. decode the information word up front. */
-		uint16_t lenraw; n = fread(&lenraw, 1, 2, fs_file);
-		if(n != 2) { log_crit("can't read length word"); abort(); }
+		uint16_t lenraw;
+		if(fs_src.map_start != NULL && pos + 2 <= fs_src.length) {
+			memcpy(&lenraw, fs_src.map_start + pos, 2);
+		} else {
+			fseek(fs_file, pos, SEEK_SET);
+			int n = fread(&lenraw, 1, 2, fs_file);
+			if(n != 2) { log_crit("can't read length word"); abort(); }
+		}
 		int lenword = LE16_TO_CPU(lenraw);
-		sz = SQUASHFS_COMPRESSED_SIZE(lenword);
-		bufmax = SQUASHFS_METADATA_SIZE;
-		compressed = SQUASHFS_COMPRESSED(lenword);
+		h->start = pos + 2;
+		h->size = SQUASHFS_COMPRESSED_SIZE(lenword);
+		h->bufmax = SQUASHFS_METADATA_SIZE;
+		h->compressed = SQUASHFS_COMPRESSED(lenword);
 	} else {
 		/* ordinary data, length supplied externally (possibly in a different
 		 * format).
 		 */
-		sz = SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
-		compressed = SQUASHFS_COMPRESSED_BLOCK(length);
-		bufmax = fs_super->block_size;
-	}
-	if(next_block_p != NULL) *next_block_p = ftell(fs_file) + sz;
-	if(compressed) {
-		assert(fs_super->compression == LZ4_COMPRESSION);
-		/* TODO: decompress straight from memory-mapped input */
-		char *compbuf = malloc(sz);
-		if(compbuf == NULL) { log_crit("malloc sz=%d failed", sz); abort(); }
-		n = fread(compbuf, 1, sz, fs_file);
-		if(n == sz) {
-			n = LZ4_decompress_safe_partial(compbuf, output, sz, bufmax, bufmax);
-			if(n < 0) { log_crit("LZ4 decompression failed, n=%d", n); abort(); }
-			sz = n;
+		h->start = pos;
+		h->size = SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
+		h->bufmax = fs_super->block_size;
+		h->compressed = SQUASHFS_COMPRESSED_BLOCK(length);
+	}
+	if(next_block_p != NULL) *next_block_p = h->start + h->size;
+	if(!h->compressed) h->size = min(h->size, h->bufmax);
+}
+
+/* memory-resident image contents at [@start, @start + @size), or NULL when
+ * the image isn't resident.
+ */
+static const uint8_t *image_at(size_t start, int size)
+{
+	if(fs_src.map_start == NULL) return NULL;
+	if(start + size > fs_src.length) { log_crit("can't read %d bytes", size); abort(); }
+	return (const uint8_t *)fs_src.map_start + start;
+}
+
+/* read the block described by @h into @output, which must have space for
+ * @h->bufmax bytes. return value is the number of bytes decompressed.
+ * decompresses straight out of a memory-resident image; otherwise compressed
+ * data is staged in a buffer that's kept around between calls.
+ */
+static int read_block(void *output, const struct blkhdr *h)
+{
+	static char *compbuf = NULL;
+	static int compbuf_size = 0;
+
+	int n, sz = h->size;
+	const char *src = (const char *)image_at(h->start, sz);
+	if(src == NULL) {
+		fseek(fs_file, h->start, SEEK_SET);
+		if(!h->compressed) {
+			n = fread(output, 1, sz, fs_file);
+			if(n < sz) { log_crit("can't read %d bytes", sz); abort(); }
+			return n;
 		}
-		free(compbuf);
-	} else {
-		sz = min(sz, bufmax);
-		n = fread(output, 1, sz, fs_file);
+		if(sz > compbuf_size) {
+			char *nb = realloc(compbuf, sz);
+			if(nb == NULL) { log_crit("realloc sz=%d failed", sz); abort(); }
+			compbuf = nb; compbuf_size = sz;
+		}
+		n = fread(compbuf, 1, sz, fs_file);
+		if(n < sz) { log_crit("can't read %d bytes", sz); abort(); }
+		src = compbuf;
+	} else if(!h->compressed) {
+		memcpy(output, src, sz);
+		return sz;
 	}
-	if(n < sz) { log_crit("can't read %d bytes", sz); abort(); }
+	assert(fs_super->compression == LZ4_COMPRESSION);
+	n = LZ4_decompress_safe_partial(src, output, sz, h->bufmax, h->bufmax);
+	if(n < 0) { log_crit("LZ4 decompression failed, n=%d", n); abort(); }
 	return n;
 }
 
-/* @length is 0 for metadata blocks and the compressed length otherwise. */
+static inline size_t blk_size(const struct blk *b) {
+	return sizeof *b + (b->data == b->buf ? b->length : 0);
+}
+
+/* pick the least recently used block that isn't in use by the current
+ * request, or NULL. metadata gets priority over data until it takes up more
+ * than three quarters of the budget, so that streaming through a large file
+ * doesn't push out the inode and directory tables.
+ */
+static struct blk *cache_victim(void)
+{
+	struct blk *m = list_tail(&meta_lru, struct blk, link),
+		*d = list_tail(&data_lru, struct blk, link);
+	if(m != NULL && m->epoch == cache_epoch) m = NULL;
+	if(d != NULL && d->epoch == cache_epoch) d = NULL;
+	if(m != NULL && (d == NULL || meta_bytes > cache_budget / 4 * 3)) return m;
+	else return d;
+}
+
+static void cache_trim(void)
+{
+	struct blk *b;
+	while(meta_bytes + data_bytes > cache_budget && (b = cache_victim(), b != NULL)) {
+		htable_del(&blk_cache, int64_hash(b->block), b);
+		list_del_from(b->is_meta ? &meta_lru : &data_lru, &b->link);
+		*(b->is_meta ? &meta_bytes : &data_bytes) -= blk_size(b);
+		free(b);
+		cache_evictions++;
+	}
+}
+
+static void cache_report(void) {
+	log_info("block cache: hits=%lu misses=%lu evictions=%lu meta=%zu data=%zu budget=%zu",
+		cache_hits, cache_misses, cache_evictions,
+		meta_bytes, data_bytes, cache_budget);
+}
+
+/* start a new cache epoch. called at the top of each request handler that
+ * may use cache_get(), releasing the previous request's blocks for
+ * replacement.
+ */
+static void cache_begin(void) {
+	cache_epoch++;
+	cache_trim();
+}
+
+/* @length is 0 for metadata blocks and the compressed length otherwise. the
+ * return value stays valid until the next cache_begin().
+ */
 static struct blk *cache_get(uint64_t block, int length)
 {
 	size_t hash = int64_hash(block);
 	struct blk *b = htable_get(&blk_cache, hash, &cmp_blk_addr, &block);
-	if(b != NULL) return b;
+	if(b != NULL) {
+		cache_hits++;
+		b->epoch = cache_epoch;
+		struct list_head *lru = b->is_meta ? &meta_lru : &data_lru;
+		list_del_from(lru, &b->link);
+		list_add(lru, &b->link);
+		return b;
+	}
 
-	size_t max_size = length == 0 ? SQUASHFS_METADATA_SIZE
-		: fs_super->block_size;
-	b = calloc(sizeof *b + max_size, sizeof(uint8_t));
-	if(b == NULL) return NULL;
+	if(++cache_misses % CACHE_REPORT_MISSES == 0) cache_report();
+	struct blkhdr h;
+	uint64_t next_block;
+	read_block_header(&h, &next_block, block, length);
+	const uint8_t *direct = h.compressed ? NULL : image_at(h.start, h.size);
+	if(direct != NULL) {
+		/* uncompressed in a resident image; refer to it in place. */
+		if(b = malloc(sizeof *b), b == NULL) return NULL;
+		b->length = h.size;
+		b->data = direct;
+	} else {
+		if(b = malloc(sizeof *b + h.bufmax), b == NULL) return NULL;
+		b->length = read_block(b->buf, &h);
+		struct blk *nb = realloc(b, sizeof *b + b->length);
+		if(nb != NULL) b = nb;	/* otherwise, waste a bit of memory. */
+		b->data = b->buf;
+	}
 	b->block = block;
-	b->length = read_block(b->data, &b->next_block, block, length);
-	struct blk *nb = realloc(b, sizeof *b + b->length);
-	if(nb != NULL) b = nb;	/* otherwise, waste a bit of memory. */
+	b->next_block = next_block;
+	b->epoch = cache_epoch;
+	b->is_meta = length == 0;
 
 	bool ok = htable_add(&blk_cache, hash, b);
 	if(!ok) {
 		free(b);
-		b = NULL;
+		return NULL;
 	}
+	list_add(b->is_meta ? &meta_lru : &data_lru, &b->link);
+	*(b->is_meta ? &meta_bytes : &data_bytes) += blk_size(b);
+	cache_trim();
 
 	return b;
 }
@@ -387,6 +557,7 @@ static int inode_size(int type)
 		[SQUASHFS_DIR_TYPE] = sizeof(struct squashfs_dir_inode),
 		[SQUASHFS_REG_TYPE] = sizeof(struct squashfs_reg_inode),
 		[SQUASHFS_SYMLINK_TYPE] = sizeof(struct squashfs_symlink_inode),
+		[SQUASHFS_LDIR_TYPE] = sizeof(struct squashfs_ldir_inode),
 	};
 
 	return type < 0 || type >= ARRAY_SIZE(sizes) ? 0 : sizes[type];
@@ -400,6 +571,7 @@ static struct inode *read_inode(unsigned blkoffs)
 	struct inode_ext *nod_ext = malloc(sizeof *nod_ext);
 	if(nod_ext == NULL) return NULL;	/* TODO: pop ENOMEM */
 	struct inode *nod = &nod_ext->fs_inode;
+	nod_ext->blocks = NULL;
 
 	uint64_t block = fs_super->inode_table_start + SQUASHFS_INODE_BLK(blkoffs);
 	int offset = SQUASHFS_INODE_OFFSET(blkoffs);
@@ -422,9 +594,26 @@ static struct inode *read_inode(unsigned blkoffs)
 	/* then per-type dynamic parts */
 	switch(base->inode_type) {
 		default: break;
-		case SQUASHFS_DIR_TYPE:
+		case SQUASHFS_DIR_TYPE: {
+			const struct squashfs_dir_inode *dir = &squashfs_i(nod)->X.dir;
 			nod->dir.max_index = INT_MAX;
+			nod_ext->dir = (typeof(nod_ext->dir)){
+				.start_block = dir->start_block, .offset = dir->offset,
+				.file_size = dir->file_size, .parent_inode = dir->parent_inode,
+			};
 			break;
+		}
+		case SQUASHFS_LDIR_TYPE: {
+			/* the dir_index follows at rest_start. */
+			const struct squashfs_ldir_inode *ldir = &squashfs_i(nod)->X.ldir;
+			nod->dir.max_index = INT_MAX;
+			nod_ext->dir = (typeof(nod_ext->dir)){
+				.start_block = ldir->start_block, .offset = ldir->offset,
+				.file_size = ldir->file_size, .parent_inode = ldir->parent_inode,
+				.i_count = ldir->i_count,
+			};
+			break;
+		}
 		case SQUASHFS_SYMLINK_TYPE: {
 			size_t link_size = squashfs_i(nod)->X.symlink.symlink_size;
 			void *re = realloc(nod_ext, sizeof *nod_ext + link_size + 1);
@@ -453,6 +642,24 @@ Eio:
 }
 
 
+static inline bool is_dir_type(int type) {
+	return type == SQUASHFS_DIR_TYPE || type == SQUASHFS_LDIR_TYPE;
+}
+
+static void free_inode(struct inode *nod)
+{
+	struct inode_ext *ext = squashfs_i(nod);
+	switch(ext->X.base.inode_type) {
+		case SQUASHFS_REG_TYPE: free(ext->blocks); break;
+		case SQUASHFS_LDIR_TYPE:
+			free(ext->dir.index);
+			free(ext->dir.index_names);
+			break;
+	}
+	free(ext);
+}
+
+
 /* fetch @ino from cache, or read it from the filesystem, or fail. */
 static struct inode *get_inode(ino_t ino)
 {
@@ -471,7 +678,7 @@ static struct inode *get_inode(ino_t ino)
 		nod->ino = ino;
 		bool ok = htable_add(&inode_cache, hash, nod);
 		if(!ok) {
-			free(container_of(nod, struct inode_ext, fs_inode));
+			free_inode(nod);
 			return NULL;	/* TODO: ENOMEM */
 		}
 	}
@@ -498,19 +705,35 @@ static struct inode *dev_inode(struct dev *d)
 	return nod;
 }
 
-static void rewind_directory(iof_t *file,
-	const struct squashfs_dir_inode *dir)
+static void rewind_directory(iof_t *file)
 {
-	/* TODO: handle LDIRs as well? (that dir_index stuff.) */
-	assert(dir->inode_type == SQUASHFS_DIR_TYPE);
+	const struct inode_ext *dir = squashfs_i(file->i);
+	assert(is_dir_type(dir->X.base.inode_type));
 
 	file->dir.cur_index = -1;
 	file->dir.bytes_read = 0;
 	file->dir.hdr.count = 0;
 	file->dir.cur_hdr = 1;
 	file->dir.last_fetch = 0;
-	file->dir.block = fs_super->directory_table_start + dir->start_block;
-	file->dir.offset = dir->offset;
+	file->dir.block = fs_super->directory_table_start + dir->dir.start_block;
+	file->dir.offset = dir->dir.offset;
+}
+
+
+/* remember where the inode of @dent, under @hdr, is. */
+static void stash_blkoffset(
+	const struct squashfs_dir_header *hdr, const struct squashfs_dir_entry *dent)
+{
+	ino_t ino = hdr->inode_number + dent->inode_number;
+	if(ino > fs_super->inodes) {
+		log_crit("invalid ino=%u (max=%u)", ino, fs_super->inodes);
+		abort();
+	} else if(ino_to_blkoffset[ino] == ~0u) {
+		ino_to_blkoffset[ino] = SQUASHFS_MKINODE(hdr->start_block, dent->offset);
+	}
+	assert(ino_to_blkoffset[ino] != ~0u);
+	assert(ino_to_blkoffset[ino] == SQUASHFS_MKINODE(
+		hdr->start_block, dent->offset));
 }
 
 
@@ -529,7 +752,7 @@ static struct dentry *read_dentry(iof_t *file,
 		*out = (struct dentry){
 			.dir_ino = file->i->ino, .type = SNEKS_DIRECTORY_DT_DIR,
 			.ino = index == 0 ? file->i->ino
-				: squashfs_i(file->i)->X.dir.parent_inode,
+				: squashfs_i(file->i)->dir.parent_inode,
 			.name_len = index + 1,
 			.index = index,
 		};
@@ -553,13 +776,10 @@ static struct dentry *read_dentry(iof_t *file,
 		return NULL; /* previously found EOD */
 	}
 
-	struct squashfs_dir_inode *dir = &squashfs_i(file->i)->X.dir;
-	/* TODO: handle LDIRs as well. (that dir_index stuff.) */
-	assert(dir->inode_type == SQUASHFS_DIR_TYPE);
-
+	const typeof(squashfs_i(file->i)->dir) *dir = &squashfs_i(file->i)->dir;
 	if(index <= file->dir.cur_index) {
 		/* redo from start */
-		rewind_directory(file, dir);
+		rewind_directory(file);
 	}
 
 	struct squashfs_dir_entry *dent = alloca(sizeof *dent
@@ -586,17 +806,7 @@ static struct dentry *read_dentry(iof_t *file,
 		file->dir.bytes_read += n;
 
 		/* stash the blkoffset now that we've seen it. */
-		ino_t ino = file->dir.hdr.inode_number + dent->inode_number;
-		if(ino > fs_super->inodes) {
-			log_crit("invalid ino=%u (max=%u)", ino, fs_super->inodes);
-			abort();
-		} else if(ino_to_blkoffset[ino] == ~0u) {
-			ino_to_blkoffset[ino] = SQUASHFS_MKINODE(
-				file->dir.hdr.start_block, dent->offset);
-		}
-		assert(ino_to_blkoffset[ino] != ~0u);
-		assert(ino_to_blkoffset[ino] == SQUASHFS_MKINODE(
-			file->dir.hdr.start_block, dent->offset));
+		stash_blkoffset(&file->dir.hdr, dent);
 
 		name_len = dent->size + 1;
 		if(name_len > SQUASHFS_NAME_LEN) goto Eio;
@@ -659,7 +869,9 @@ static struct dentry *find_dentry(ino_t dir_ino, const char *name)
 }
 
 static void remove_dentry(struct dentry *dent) {
-	htable_del(&dentry_index_hash, rehash_dentry_by_index(dent, NULL), dent);
+	if(dent->index != DENTRY_NO_INDEX) {
+		htable_del(&dentry_index_hash, rehash_dentry_by_index(dent, NULL), dent);
+	}
 	htable_del(&dentry_name_hash, rehash_dentry_by_dir_ino_and_name(dent, NULL), dent);
 	if(dent->index >= 2) htable_del(&dentry_ino_hash, rehash_dentry_by_ino(dent, NULL), dent);
 }
@@ -667,7 +879,8 @@ static void remove_dentry(struct dentry *dent) {
 static bool add_dentry(struct dentry *dent)
 {
 	assert(find_dentry(dent->dir_ino, dent->name) == NULL);
-	bool ok = htable_add(&dentry_index_hash, rehash_dentry_by_index(dent, NULL), dent);
+	bool ok = dent->index == DENTRY_NO_INDEX
+		|| htable_add(&dentry_index_hash, rehash_dentry_by_index(dent, NULL), dent);
 	ok = ok && htable_add(&dentry_name_hash, rehash_dentry_by_dir_ino_and_name(dent, NULL), dent);
 	if(ok && dent->index >= 2) {
 		/* only add non-synthetic directories so that get_path doesn't get
@@ -693,13 +906,159 @@ static struct dentry *get_dentry(iof_t *file, struct blk **blk_p, int index, int
 		if(cand->dir_ino == key.dir_ino && cand->index == key.index) return cand;
 	}
 	struct dentry *dent = read_dentry(file, blk_p, index, err_p);
-	if(dent != NULL && !add_dentry(dent)) {
+	if(dent == NULL) return NULL;
+	struct dentry *old = find_dentry(dent->dir_ino, dent->name);
+	if(old != NULL) {
+		/* found earlier by lookup() without its position; fill it in. */
+		assert(old->index == DENTRY_NO_INDEX);
+		old->index = dent->index;
+		free(dent);
+		if(!htable_add(&dentry_index_hash, rehash_dentry_by_index(old, NULL), old)) {
+			old->index = DENTRY_NO_INDEX;
+			*err_p = -ENOMEM;
+			return NULL;
+		}
+		return old;
+	}
+	if(!add_dentry(dent)) {
 		free(dent); dent = NULL;
 		*err_p = -ENOMEM;
 	}
 	return dent;
 }
 
+/* read an extended directory's dir_index into ->dir.index. returns 0 or
+ * negative errno.
+ */
+static int load_dir_index(struct inode_ext *ext)
+{
+	assert(ext->dir.index == NULL);
+	int count = ext->dir.i_count;
+	struct diridx *idx = malloc(count * sizeof *idx);
+	char *names = NULL;
+	size_t names_len = 0;
+	if(idx == NULL) return -ENOMEM;
+
+	uint64_t block = ext->rest_start;
+	int offset = ext->offset, n;
+	struct blk *blk = NULL;
+	for(int i=0; i < count; i++) {
+		struct squashfs_dir_index ent;
+		n = read_metadata(&ent, &blk, &block, &offset, sizeof ent);
+		if(n != sizeof ent) goto Eio;
+		int len = LE32_TO_CPU(ent.size) + 1;
+		if(len > SQUASHFS_NAME_LEN) goto Eio;
+		char *nn = realloc(names, names_len + len + 1);
+		if(nn == NULL) { n = -ENOMEM; goto fail; }
+		names = nn;
+		n = read_metadata(&names[names_len], &blk, &block, &offset, len);
+		if(n != len) goto Eio;
+		names[names_len + len] = '\0';
+		idx[i] = (struct diridx){
+			.pos = LE32_TO_CPU(ent.index),
+			.start_block = LE32_TO_CPU(ent.start_block),
+			.name = names_len,
+		};
+		names_len += len + 1;
+	}
+
+	ext->dir.index = idx;
+	ext->dir.index_names = names;
+	return 0;
+
+Eio: if(n >= 0) n = -EIO;
+fail:
+	free(idx);
+	free(names);
+	return n;
+}
+
+/* lookup() in an extended directory. binary searches the dir_index for the
+ * metadata block where @name would be, and scans the listing from there on
+ * without going through get_dentry(). the entry found is added without its
+ * position, and the ones skipped over aren't added at all.
+ */
+static ssize_t lookup_indexed(int *type, struct inode_ext *ext, const char *name)
+{
+	if(ext->dir.index == NULL) {
+		int n = load_dir_index(ext);
+		if(n < 0) return n;
+	}
+
+	/* find the last index entry whose name is not after @name. */
+	int low = 0, high = ext->dir.i_count - 1, found = -1;
+	while(low <= high) {
+		int mid = (low + high) / 2;
+		if(strcmp(&ext->dir.index_names[ext->dir.index[mid].name], name) <= 0) {
+			found = mid;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	/* @pos tracks bytes into the listing, which starts 3 bytes in to make
+	 * room for "." and "..".
+	 */
+	uint64_t block = fs_super->directory_table_start;
+	int offset = ext->dir.offset;
+	uint32_t pos;
+	if(found < 0) {
+		block += ext->dir.start_block;
+		pos = 3;
+	} else {
+		const struct diridx *ix = &ext->dir.index[found];
+		block += ix->start_block;
+		offset = (offset + ix->pos) % SQUASHFS_METADATA_SIZE;
+		pos = ix->pos + 3;
+	}
+
+	struct squashfs_dir_entry *dent = alloca(sizeof *dent
+		+ SQUASHFS_NAME_LEN + 1);
+	struct squashfs_dir_header hdr;
+	struct blk *blk = NULL;
+	while(pos < ext->dir.file_size) {
+		int n = read_metadata(&hdr, &blk, &block, &offset, sizeof hdr);
+		if(n < sizeof hdr) return n < 0 ? n : -EIO;
+		pos += n;
+		for(int i=0; i <= hdr.count; i++) {
+			n = read_metadata(dent, &blk, &block, &offset, sizeof *dent);
+			if(n < sizeof *dent) return n < 0 ? n : -EIO;
+			int name_len = dent->size + 1;
+			if(name_len > SQUASHFS_NAME_LEN) return -EIO;
+			n = read_metadata(dent->name, &blk, &block, &offset, name_len);
+			if(n < name_len) return n < 0 ? n : -EIO;
+			pos += sizeof *dent + name_len;
+			dent->name[name_len] = '\0';
+			stash_blkoffset(&hdr, dent);
+
+			int cmp = strcmp(name, dent->name);
+			if(cmp < 0) return -ENOENT;	/* listing is in strcmp() order */
+			else if(cmp > 0) continue;
+
+			struct dentry *out = malloc(sizeof *out + name_len + 1);
+			if(out == NULL) return -ENOMEM;
+			*out = (struct dentry){
+				.dir_ino = ext->fs_inode.ino,
+				.ino = hdr.inode_number + dent->inode_number,
+				.type = dent->type >= ARRAY_SIZE(sfs_type_table) ? SNEKS_DIRECTORY_DT_UNKNOWN
+					: sfs_type_table[dent->type],
+				.name_len = name_len,
+				.index = DENTRY_NO_INDEX,
+			};
+			memcpy(out->name, dent->name, name_len + 1);
+			if(!add_dentry(out)) {
+				free(out);
+				return -ENOMEM;
+			}
+			*type = out->type;
+			return out->ino;
+		}
+	}
+
+	return -ENOENT;
+}
+
 static ssize_t lookup(int *type, ino_t dir_ino, const char *name)
 {
 	assert(type != NULL);
@@ -714,9 +1073,15 @@ static ssize_t lookup(int *type, ino_t dir_ino, const char *name)
 	struct inode *nod = get_inode(dir_ino);
 	if(nod == NULL) return -EIO;	/* TODO: proper status return */
 
-	struct squashfs_dir_inode *dir = &squashfs_i(nod)->X.dir;
+	struct inode_ext *ext = squashfs_i(nod);
+	if(ext->X.base.inode_type == SQUASHFS_LDIR_TYPE && ext->dir.i_count > 0
+		&& !streq(name, ".") && !streq(name, ".."))
+	{
+		return lookup_indexed(type, ext, name);
+	}
+
 	iof_t fake = { .i = nod, .pos = 0, .refs = 1 };
-	rewind_directory(&fake, dir);
+	rewind_directory(&fake);
 	struct blk *blk = NULL;
 	int dix = 0, n = 0;
 	while(dent = get_dentry(&fake, &blk, dix++, &n), dent != NULL) {
@@ -964,6 +1329,7 @@ static int squashfs_resolve(
 {
 	L4_ThreadId_t actual = L4_ActualSender();
 	sync_confirm();
+	cache_begin();
 	while(unlikely(need_subfs_sync)) sync_subfs();
 	pid_t caller_pid = CALLER_PID;
 
@@ -1144,6 +1510,7 @@ static int squashfs_get_path_fragment(
 	int fd)
 {
 	sync_confirm();
+	cache_begin();
 
 	pid_t caller = CALLER_PID;
 	ino_t ino;
@@ -1211,6 +1578,7 @@ end:
 static int squashfs_get_path(char *path, int fd, const char *suffix)
 {
 	sync_confirm();
+	cache_begin();
 
 	L4_Word_t server = 0xdeadbeef;
 	int n = squashfs_get_path_fragment(path, &(unsigned){ 0 }, &server,
@@ -1255,6 +1623,7 @@ static void fill_statbuf(struct sneks_path_statbuf *st, const struct inode_ext *
 static int squashfs_stat_object(unsigned object, L4_Word_t cookie, struct sneks_path_statbuf *st)
 {
 	sync_confirm();
+	cache_begin();
 	/* TODO: same as in squashfs_open() about validating cookies */
 	if(!validate_cookie(cookie, &device_cookie_key, L4_SystemClock(), object, CALLER_PID)) return -EINVAL;
 	struct inode *nod = get_inode(object);
@@ -1266,6 +1635,7 @@ static int squashfs_stat_object(unsigned object, L4_Word_t cookie, struct sneks_
 static int squashfs_stat_handle(int handle, struct sneks_path_statbuf *st)
 {
 	sync_confirm();
+	cache_begin();
 	iof_t *file = io_get_file(CALLER_PID, handle);
 	if(file == NULL) return -EBADF;
 	fill_statbuf(st, squashfs_i(file->i));
@@ -1275,6 +1645,7 @@ static int squashfs_stat_handle(int handle, struct sneks_path_statbuf *st)
 static int squashfs_open(int *handle_p, unsigned object, L4_Word_t cookie, int flags)
 {
 	sync_confirm();
+	cache_begin();
 	pid_t caller_pid = CALLER_PID;
 	/* TODO: see comment above gen_cookie() call in squashfs_resolve(). */
 	if(!validate_cookie(cookie, &device_cookie_key, L4_SystemClock(), object, caller_pid)) return -EINVAL;
@@ -1285,10 +1656,10 @@ static int squashfs_open(int *handle_p, unsigned object, L4_Word_t cookie, int f
 		case SQUASHFS_REG_TYPE:
 			if(flags & O_DIRECTORY) return -ENOTDIR;
 			/* FALL THRU */
-		case SQUASHFS_DIR_TYPE:
+		case SQUASHFS_DIR_TYPE: case SQUASHFS_LDIR_TYPE:
 			if(f = iof_new(0), f == NULL) return -ENOMEM;
 			*f = (iof_t){ .i = nod, .pos = 0, .refs = 1 };
-			if(typ == SQUASHFS_DIR_TYPE) rewind_directory(f, &squashfs_i(nod)->X.dir);
+			if(is_dir_type(typ)) rewind_directory(f);
 			if(n = io_add_fd(caller_pid, f, flags & O_CLOEXEC ? IOD_CLOEXEC : 0), n < 0) {
 				iof_undo_new(f);
 				return n;
@@ -1315,6 +1686,7 @@ static int squashfs_open(int *handle_p, unsigned object, L4_Word_t cookie, int f
 static int squashfs_seek(int handle, off_t *offset_p, int whence)
 {
 	sync_confirm();
+	cache_begin();
 
 	iof_t *file = io_get_file(CALLER_PID, handle);
 	if(file == NULL) return -EBADF;
@@ -1362,37 +1734,63 @@ static void rollback_open(L4_Word_t x, iof_t *f) {
 	iof_undo_new(f);
 }
 
-/* seek into block @target. so 0 for the first, etc. returns address of the
- * data block in question or negative errno. *@block and *@offset should start
- * at either the previous seek position, or a regular file's metadata start
- * and offset, and leave off after the next chunk of metadata.
+/* number of entries in a regular file's block list. */
+static int file_blocks(const struct squashfs_reg_inode *reg)
+{
+	if(reg->fragment != SQUASHFS_INVALID_FRAG) {
+		return reg->file_size >> fs_block_size_log2;
+	} else {
+		return ((uint64_t)reg->file_size + fs_super->block_size - 1) >> fs_block_size_log2;
+	}
+}
+
+/* look fragment @frag up in the fragment table. returns 0 or negative errno. */
+static int get_fragment(struct squashfs_fragment_entry *ent, uint32_t frag)
+{
+	if(frag_index == NULL || frag >= fs_super->fragments) {
+		log_err("fragment %u out of range", frag);
+		return -EIO;
+	}
+	uint64_t block = LE64_TO_CPU(frag_index[SQUASHFS_FRAGMENT_INDEX(frag)]);
+	int offset = SQUASHFS_FRAGMENT_INDEX_OFFSET(frag);
+	int n = read_metadata(ent, NULL, &block, &offset, sizeof *ent);
+	if(n != sizeof *ent) return n < 0 ? n : -EIO;
+	ent->start_block = LE64_TO_CPU(ent->start_block);
+	ent->size = LE32_TO_CPU(ent->size);
+	return 0;
+}
+
+/* read a regular file's block list into ->blocks, summing up the compressed
+ * lengths for each block's offset. returns 0 or negative errno.
  */
-static int64_t seek_block_list(uint64_t *block, int *offset, int target)
+static int build_block_index(struct inode_ext *ext)
 {
-	target++;
-	int64_t res = 0;
-	uint32_t *lens = malloc(PAGE_SIZE);
-	if(lens == NULL) return -ENOMEM;
+	assert(ext->blocks == NULL);
+	int n_blocks = file_blocks(&ext->X.reg);
+	struct blkidx *idx = malloc(max(n_blocks, 1) * sizeof *idx);
+	if(idx == NULL) return -ENOMEM;
+
+	uint64_t block = ext->rest_start;
+	int offset = ext->offset;
+	uint32_t lens[256], pos = 0;
 	struct blk *metablk = NULL;
-	while(target > 0) {
-		int blocks = min_t(int, target, PAGE_SIZE / 4);
-		int n = read_metadata(lens, &metablk, block, offset, blocks * 4);
-		if(n != blocks * 4) {
+	for(int i = 0; i < n_blocks;) {
+		int chunk = min_t(int, n_blocks - i, ARRAY_SIZE(lens));
+		int n = read_metadata(lens, &metablk, &block, &offset, chunk * 4);
+		if(n != chunk * 4) {
 			log_err("can't read metadata, n=%d", n);
-			if(n > 0) n = -EIO;
-			res = n;
-			goto end;
+			free(idx);
+			return n < 0 ? n : -EIO;
 		}
-		for(int i=0; i < blocks; i++) {
-			uint32_t word = LE32_TO_CPU(lens[i]);
-			res += SQUASHFS_COMPRESSED_SIZE_BLOCK(word);
+		for(int j=0; j < chunk; j++, i++) {
+			idx[i].lenword = LE32_TO_CPU(lens[j]);
+			idx[i].offset = pos;
+			pos += SQUASHFS_COMPRESSED_SIZE_BLOCK(idx[i].lenword);
 		}
-		target -= blocks;
 	}
 
-end:
-	free(lens);
-	return res;
+	ext->blocks = idx;
+	return 0;
 }
 
 
@@ -1400,48 +1798,58 @@ static ssize_t read_from_inode(
 	struct inode *nod, void *data_buf, size_t length, size_t read_pos)
 {
 	unsigned type = squashfs_i(nod)->X.base.inode_type;
-	if(type == SQUASHFS_DIR_TYPE) return -EISDIR;
+	if(is_dir_type(type)) return -EISDIR;
 	if(type != SQUASHFS_REG_TYPE) return -EBADF;
 
-	struct squashfs_reg_inode *reg = &squashfs_i(nod)->X.reg;
-	if(unlikely(reg->fragment != SQUASHFS_INVALID_FRAG)) {
-		/* TODO: handle fragments, one day */
-		log_err("no fragment support");
-		return -EIO;
-	}
-
+	struct inode_ext *ext = squashfs_i(nod);
+	struct squashfs_reg_inode *reg = &ext->X.reg;
+	if(read_pos >= reg->file_size) return 0;
 	uint32_t done = 0, pos = read_pos,
 		bytes = min_t(uint32_t, length, reg->file_size - pos);
-	if(bytes == 0) return 0;
-
-	uint64_t block = squashfs_i(nod)->rest_start;
-	int offset = squashfs_i(nod)->offset,
-		seek = pos >> fs_block_size_log2;
-	int64_t data_block = 0;
-	if(seek > 1) {
-		data_block = seek_block_list(&block, &offset, seek - 1);
-		if(data_block < 0) return data_block;
-		seek = 0;
+	if(ext->blocks == NULL) {
+		int n = build_block_index(ext);
+		if(n < 0) return n;
 	}
-	data_block += reg->start_block;
 
+	const uint32_t mask = fs_super->block_size - 1;
+	const int n_blocks = file_blocks(reg);
 	while(done < bytes) {
-		uint32_t lenword;
-		int n = read_metadata(&lenword, NULL, &block, &offset, sizeof lenword);
-		if(n < 0) return n;
-		lenword = LE32_TO_CPU(lenword);
-		if(lenword == 0) continue;
-
-		if(seek-- <= 0) {
-			struct blk *b = cache_get(data_block, lenword);
-			if(b == NULL) return -ENOMEM;	/* or translate an errptr */
-			int seg = min_t(int, bytes - done, b->length);
-			memcpy(data_buf + done,
-				&b->data[pos & ((1 << fs_block_size_log2) - 1)], seg);
+		int nth = pos >> fs_block_size_log2, boff = pos & mask,
+			seg = min_t(uint32_t, bytes - done, fs_super->block_size - boff);
+		if(nth == n_blocks) {
+			/* the tail end, packed into a fragment block with others. */
+			assert(reg->fragment != SQUASHFS_INVALID_FRAG);
+			struct squashfs_fragment_entry ent;
+			int n = get_fragment(&ent, reg->fragment);
+			if(n < 0) return done > 0 ? done : n;
+			struct blk *b = cache_get(ent.start_block, ent.size);
+			if(b == NULL) return -ENOMEM;
+			if(reg->offset + boff + seg > b->length) {
+				log_err("short fragment %u", reg->fragment);
+				return done > 0 ? done : -EIO;
+			}
+			memcpy(data_buf + done, &b->data[reg->offset + boff], seg);
 			done += seg;
 			pos += seg;
+			continue;
+		}
+
+		const struct blkidx *ix = &ext->blocks[nth];
+		if(ix->lenword == 0) {
+			/* sparse block */
+			memset(data_buf + done, '\0', seg);
+		} else {
+			struct blk *b = cache_get(reg->start_block + ix->offset, ix->lenword);
+			if(b == NULL) return -ENOMEM;	/* or translate an errptr */
+			if(b->length <= boff) {
+				log_err("short data block at %u", reg->start_block + ix->offset);
+				return done > 0 ? done : -EIO;
+			}
+			seg = min_t(int, seg, b->length - boff);
+			memcpy(data_buf + done, &b->data[boff], seg);
 		}
-		data_block += SQUASHFS_COMPRESSED_SIZE_BLOCK(lenword);
+		done += seg;
+		pos += seg;
 	}
 
 	return done;
@@ -1459,6 +1867,7 @@ static int squashfs_io_read(iof_t *file,
 	uint8_t *data_buf, unsigned count, off_t offset)
 {
 	if(count == 0) return 0;
+	cache_begin();
 	return read_from_inode(file->i, data_buf, count,
 		offset < 0 ? file->pos : offset);
 }
@@ -1479,12 +1888,13 @@ static void confirm_seekdir(L4_Word_t newpos, iof_t *file) {
 static int squashfs_seekdir(int dirfd, off_t *position_ptr)
 {
 	sync_confirm();
+	cache_begin();
 	if(*position_ptr < 0) return -EINVAL;
 
 	iof_t *file = io_get_file(CALLER_PID, dirfd);
 	if(file == NULL) return -EBADF;
 	/* (what a mouthful!) */
-	if(squashfs_i(file->i)->X.base.inode_type != SQUASHFS_DIR_TYPE) {
+	if(!is_dir_type(squashfs_i(file->i)->X.base.inode_type)) {
 		return -EBADF;
 	}
 
@@ -1495,8 +1905,7 @@ static int squashfs_seekdir(int dirfd, off_t *position_ptr)
 
 
 static void rollback_getdents(L4_Word_t last_pos, iof_t *file) {
-	assert(squashfs_i(file->i)->X.base.inode_type == SQUASHFS_DIR_TYPE);
-	rewind_directory(file, &squashfs_i(file->i)->X.dir);
+	rewind_directory(file);
 	file->pos = last_pos;
 }
 
@@ -1505,10 +1914,11 @@ static int squashfs_getdents(int dirfd, off_t *offset_ptr, off_t *endpos_ptr,
 	uint8_t *data_buf, unsigned *data_len_p)
 {
 	sync_confirm();
+	cache_begin();
 
 	iof_t *file = io_get_file(CALLER_PID, dirfd);
 	if(file == NULL) return -EBADF;
-	if(squashfs_i(file->i)->X.base.inode_type != SQUASHFS_DIR_TYPE) {
+	if(!is_dir_type(squashfs_i(file->i)->X.base.inode_type)) {
 		return -EBADF;
 	}
 
@@ -1550,6 +1960,7 @@ static int squashfs_readlink(char *data, int *data_len,
 	unsigned object, L4_Word_t cookie)
 {
 	sync_confirm();
+	cache_begin();
 
 	/* TODO: same as in squashfs_open() about cookie validation */
 	if(!validate_cookie(cookie, &device_cookie_key, L4_SystemClock(),
@@ -1580,7 +1991,20 @@ static int squashfs_shutdown(void)
 		free(oth);
 	}
 	iof_t *f = io_get_file(-1, 0);
-	if(f != NULL) return -EBUSY; else { io_quit(0); return 0; }
+	if(f != NULL) return -EBUSY;
+	cache_report();
+	io_quit(0);
+	return 0;
+}
+
+static int squashfs_identify(unsigned *ino_p, unsigned *gen_p, int fd)
+{
+	sync_confirm();
+	iof_t *file = io_get_file(CALLER_PID, fd);
+	if(file == NULL) return -EBADF;
+	*ino_p = file->i->ino;
+	*gen_p = 0;	/* read-only, so inode numbers are never reused */
+	return 0;
 }
 
 static int squashfs_ipc_loop(int argc, char *argv[])
@@ -1601,6 +2025,7 @@ static int squashfs_ipc_loop(int argc, char *argv[])
 		.readlink = &squashfs_readlink,
 		/* Sneks::Filesystem */
 		.shutdown = &squashfs_shutdown,
+		.identify = &squashfs_identify,
 	};
 	FILL_SNEKS_IO(&vtab);
 
@@ -1631,6 +2056,12 @@ static int mount_squashfs(FILE *f)
 		return -EINVAL;
 	}
 	fs_file = f;
+	if(!SQUASHFS_NO_FRAGMENTS(fs_super->flags) && fs_super->fragments > 0) {
+		size_t sz = SQUASHFS_FRAGMENT_INDEXES(fs_super->fragments) * sizeof *frag_index;
+		if(frag_index = malloc(sz), frag_index == NULL) return -ENOMEM;
+		fseek(f, fs_super->fragment_table_start, SEEK_SET);
+		if(fread(frag_index, 1, sz, f) < sz) return -EIO;
+	}
 	if(ino_to_blkoffset = malloc((fs_super->inodes + 1) * sizeof *ino_to_blkoffset), ino_to_blkoffset == NULL) return -ENOMEM;
 	for(int i=0; i <= fs_super->inodes; i++) ino_to_blkoffset[i] = ~0u;
 	struct inode *nod = read_inode(fs_super->root_inode); if(nod == NULL) return -EIO;
@@ -1820,6 +2251,19 @@ static char *set_uint(const char *optarg, void *param) {
 	return NULL;
 }
 
+/* byte count with an optional k/M suffix. */
+static char *set_cache_budget(const char *optarg, void *param)
+{
+	char *end;
+	size_t val = strtoul(optarg, &end, 0);
+	switch(*end) {
+		case 'k': case 'K': val <<= 10; break;
+		case 'm': case 'M': val <<= 20; break;
+	}
+	*(size_t *)param = val;
+	return NULL;
+}
+
 static char *decode_l64a_16u8(const char *optarg, void *destptr)
 {
 	uint8_t *dest = destptr;
@@ -1857,9 +2301,14 @@ int main(int argc, char *argv[])
 {
 	opt_register_table(opts, NULL);
 	if(!opt_parse(&argc, argv, &ignore_opt_error)) return EXIT_FAILURE;
-	/* TODO: in libfs, split arg_data at commas and parse =-separated KVP. */
+	/* TODO: move this into libfs once there is one. */
 	L4_ThreadId_t boot_tid = L4_nilthread;
-	if(strstarts(arg_data, "boot-initrd=")) set_tid(arg_data + 12, &boot_tid);
+	for(char *kvp = arg_data != NULL ? strdupa(arg_data) : NULL, *sep; kvp != NULL; kvp = sep) {
+		if(sep = strchr(kvp, ','), sep != NULL) *(sep++) = '\0';
+		if(strstarts(kvp, "boot-initrd=")) set_tid(kvp + 12, &boot_tid);
+		else if(strstarts(kvp, "cache=")) set_cache_budget(kvp + 6, &cache_budget);
+		else if(kvp[0] != '\0') log_info("unknown mount option `%s'", kvp);
+	}
 	int n, devs = !!(~arg_mntflags & MS_NODEV);
 	if(!L4_IsNilThread(boot_tid)) {
 		n = boot_initrd_protocol(boot_tid);
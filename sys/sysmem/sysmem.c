@@ -39,16 +39,31 @@
 #define C_MAGIC 0x740b1d8a
 #define PROXY_ABEND_LABEL 0xbaa6
 
-#define LF_SWAP 1	/* p_addr{12..31} designates a c_page. */
+/* p_addr{12..31} designates a c_span, and p_addr{2..11} an object in it. */
+#define LF_SWAP 1
+/* page of one repeated word. p_addr{2..11} index fills[], {12..31} are 0. */
+#define LF_FILL 2
+#define LF_OBJ(p_addr) (((p_addr) & PAGE_MASK) >> 2)
+
+#define N_FILLS 16
 
 #define PF_INCOMPRESSIBLE 1	/* skipped by replacement until written */
+#define PF_LOANED 2	/* borrowed from vm; given back once free */
+
+/* free memory over which frames borrowed from vm are given back. */
+#define LOAN_HIGH_WM 128
 
 #define P_ADDRESS(pp) ((pp)->addr_flags & ~PAGE_MASK)
 
-/* can't usefully store compressed pages larger than a size that'd leave less
- * space over than what the minimum compressed result would use.
+/* compressed pages are stored in spans of up to MAX_SPAN_FRAMES frames, each
+ * span holding objects of a single size class packed end to end across its
+ * frames. size classes are 1 << CLASS_BITS bytes apart.
  */
-#define MAX_COMPRESSED_SIZE (PAGE_SIZE - sizeof(struct c_hdr) - 26)
+#define MAX_SPAN_FRAMES 4
+#define CLASS_BITS 5
+#define N_CLASSES (PAGE_SIZE >> CLASS_BITS)
+#define SPAN_HDR_SIZE ((sizeof(struct c_span) + sizeof(struct c_obj) - 1) \
+	& ~(sizeof(struct c_obj) - 1))
 
 
 
@@ -85,14 +100,43 @@ struct l_page
 };
 
 
-/* storage header for pages containing compressed memory. */
-struct c_hdr
+/* storage header for spans of compressed memory, at the start of the first
+ * frame. the span's frames are owned by it and not on any list.
+ */
+struct c_span
 {
 	uint32_t magic;	/* C_MAGIC */
-	struct p_page *phys;
-	struct list_node buddy_link;
-	uint16_t a_len, b_len;	/* compressed content length */
-	struct l_page *a, *b;
+	uint8_t class, n_frames;
+	uint16_t n_used, free_head;	/* free_head == n_objs when full */
+	struct list_node link;	/* in c_class.spans[span_fullness()] */
+	struct p_page *frames[MAX_SPAN_FRAMES];
+};
+
+
+/* header of each object in a span. free ones have owner == NULL and are
+ * chained through next_free. the compressed data follows immediately and may
+ * cross into the span's next frame.
+ */
+struct c_obj
+{
+	struct l_page *owner;
+	uint16_t len;	/* compressed content length */
+	uint16_t next_free;
+};
+
+
+/* spans of a class are kept by how full they are. new objects go into
+ * the fuller ones first so that sparse spans may drain, and compaction moves
+ * objects out of sparse spans to release their frames.
+ */
+enum { CS_SPARSE = 0, CS_PARTIAL, CS_FULL, N_FULLNESS };
+
+struct c_class
+{
+	uint16_t size, n_objs;	/* n_objs == 0 when not worth storing */
+	uint8_t n_frames;
+	unsigned n_spans, n_used;
+	struct list_head spans[N_FULLNESS];
 };
 
 
@@ -137,6 +181,14 @@ static unsigned num_free_pages = 0;
 
 static bool repl_enable = false;
 
+/* vm's balloon thread once it's said BALLOON_HELLO, whether an exchange with
+ * it is underway, whether get_free_page() would've liked to borrow from it,
+ * and the number of frames borrowed from it.
+ */
+static L4_ThreadId_t balloon_tid;
+static bool in_balloon = false, borrow_wanted = false;
+static unsigned num_loaned_pages = 0;
+
 static struct alloc_head systask_alloc_head = ALLOC_HEAD(struct systask),
 	p_page_alloc_head = ALLOC_HEAD(struct p_page),
 	l_page_alloc_head = ALLOC_HEAD(struct l_page);
@@ -162,6 +214,9 @@ static struct sneks_posix_info posix_info;
 
 
 static struct p_page *get_free_page(void);
+static bool balloon_ready(void);
+static int borrow_pages(int want);
+static void add_free_page(struct p_page *pg);
 
 
 /* runtime basics. */
@@ -420,7 +475,291 @@ static void recycle(struct alloc_head *head, void *ptr)
  */
 
 static char lz4_state[LZ4_STREAMSIZE] __attribute__((aligned(8))); /* hueg */
-static struct list_head buddy_list = LIST_HEAD_INIT(buddy_list);
+static struct c_class c_classes[N_CLASSES];
+
+/* distinct fill words of same-filled pages, referenced by LF_FILL l_pages.
+ * usually just zero and a poison pattern or two.
+ */
+static struct {
+	L4_Word_t value;
+	unsigned refs;
+} fills[N_FILLS];
+
+
+/* returns true and sets *@fill_p when the page at @addr is a single repeated
+ * word. differences are accumulated over a cache line's worth of words at a
+ * time so that the inner loop has no branches.
+ */
+static bool page_is_filled(const void *addr, L4_Word_t *fill_p)
+{
+	const L4_Word_t *w = addr, fill = w[0];
+	for(int i=0; i < PAGE_SIZE / sizeof *w; i += 16) {
+		L4_Word_t diff = 0;
+		for(int j=0; j < 16; j++) diff |= w[i + j] ^ fill;
+		if(diff != 0) return false;
+	}
+	*fill_p = fill;
+	return true;
+}
+
+
+static void fill_page(void *addr, L4_Word_t fill)
+{
+	if(fill == 0) memset(addr, 0, PAGE_SIZE);
+	else {
+		L4_Word_t *w = addr;
+		for(int i=0; i < PAGE_SIZE / sizeof *w; i++) w[i] = fill;
+	}
+}
+
+
+/* returns a referenced index in fills[] for @value, or -1 when they're all
+ * taken by other values.
+ */
+static int get_fill(L4_Word_t value)
+{
+	int ix = -1;
+	for(int i=0; i < N_FILLS; i++) {
+		if(fills[i].refs > 0 && fills[i].value == value) {
+			ix = i;
+			break;
+		} else if(fills[i].refs == 0 && ix < 0) {
+			ix = i;
+		}
+	}
+	if(ix >= 0) {
+		fills[ix].value = value;
+		fills[ix].refs++;
+	}
+	return ix;
+}
+
+
+static void put_fill(int ix) {
+	assert(ix >= 0 && ix < N_FILLS && fills[ix].refs > 0);
+	fills[ix].refs--;
+}
+
+
+/* picks for each class the span length that wastes the least per frame,
+ * leaving out classes where no span would hold more objects than it has
+ * frames since storing those saves nothing.
+ */
+static void init_classes(void)
+{
+	for(int c=0; c < N_CLASSES; c++) {
+		struct c_class *cc = &c_classes[c];
+		cc->size = (c + 1) << CLASS_BITS;
+		cc->n_objs = 0;
+		int best_waste = 0;
+		for(int k=1; k <= MAX_SPAN_FRAMES; k++) {
+			int n = (k * PAGE_SIZE - SPAN_HDR_SIZE) / cc->size,
+				waste = k * PAGE_SIZE - n * cc->size;
+			if(n <= k) continue;
+			if(cc->n_objs == 0 || waste * cc->n_frames < best_waste * k) {
+				cc->n_objs = n;
+				cc->n_frames = k;
+				best_waste = waste;
+			}
+		}
+		assert(cc->n_objs <= PAGE_MASK >> 2);
+		for(int i=0; i < N_FULLNESS; i++) list_head_init(&cc->spans[i]);
+	}
+}
+
+
+static inline int obj_class(int len) {
+	return (sizeof(struct c_obj) + len - 1) >> CLASS_BITS;
+}
+
+
+static inline struct c_span *span_of(L4_Word_t p_addr) {
+	struct c_span *s = (struct c_span *)(p_addr & ~PAGE_MASK);
+	assert(s->magic == C_MAGIC);
+	return s;
+}
+
+
+/* address of byte @off within the span. */
+static inline void *span_addr(struct c_span *s, int off) {
+	assert(off >> PAGE_BITS < s->n_frames);
+	return (void *)P_ADDRESS(s->frames[off >> PAGE_BITS]) + (off & PAGE_MASK);
+}
+
+
+static inline int obj_offset(const struct c_span *s, int ix) {
+	return SPAN_HDR_SIZE + ix * c_classes[s->class].size;
+}
+
+
+/* object headers never cross frames since they're aligned to their size. */
+static inline struct c_obj *span_obj(struct c_span *s, int ix) {
+	return span_addr(s, obj_offset(s, ix));
+}
+
+
+static void span_copy(struct c_span *s, int off, void *buf, int len, bool in)
+{
+	while(len > 0) {
+		int seg = min_t(int, len, PAGE_SIZE - (off & PAGE_MASK));
+		if(in) memcpy(span_addr(s, off), buf, seg);
+		else memcpy(buf, span_addr(s, off), seg);
+		off += seg; buf += seg; len -= seg;
+	}
+}
+
+
+static inline int span_fullness(const struct c_span *s) {
+	const struct c_class *cc = &c_classes[s->class];
+	if(s->n_used == cc->n_objs) return CS_FULL;
+	else if(s->n_used * 4 <= cc->n_objs) return CS_SPARSE;
+	else return CS_PARTIAL;
+}
+
+
+/* for compressed storage, which mustn't recurse into replacement. */
+static struct p_page *take_free_page(void)
+{
+	struct p_page *p = list_pop(&free_page_list, struct p_page, link);
+	if(p == NULL) panic("no free pages in take_free_page()!");
+	num_free_pages--;
+	return p;
+}
+
+
+static struct c_span *new_span(int c)
+{
+	struct c_class *cc = &c_classes[c];
+	struct p_page *frames[MAX_SPAN_FRAMES];
+	for(int i=0; i < cc->n_frames; i++) frames[i] = take_free_page();
+	struct c_span *s = (struct c_span *)P_ADDRESS(frames[0]);
+	*s = (struct c_span){
+		.magic = C_MAGIC, .class = c, .n_frames = cc->n_frames,
+	};
+	memcpy(s->frames, frames, cc->n_frames * sizeof *frames);
+	for(int i=0; i < cc->n_objs; i++) {
+		*span_obj(s, i) = (struct c_obj){ .next_free = i + 1 };
+	}
+	list_add(&cc->spans[CS_SPARSE], &s->link);
+	cc->n_spans++;
+	return s;
+}
+
+
+/* caller removes @s from its class' lists. */
+static void release_span(struct c_span *s)
+{
+	c_classes[s->class].n_spans--;
+	s->magic = 0;
+	for(int i=0; i < s->n_frames; i++) {
+		assert(s->frames[i]->owner == NULL);
+		list_add(&free_page_list, &s->frames[i]->link);
+	}
+	num_free_pages += s->n_frames;
+}
+
+
+/* stores @len bytes of compressed data for @owner. returns the l_page.p_addr
+ * designating it.
+ */
+static L4_Word_t store_obj(struct l_page *owner, const void *data, int len)
+{
+	int c = obj_class(len);
+	struct c_class *cc = &c_classes[c];
+	assert(c < N_CLASSES && cc->n_objs > 0);
+	struct c_span *s = list_top(&cc->spans[CS_PARTIAL], struct c_span, link);
+	if(s == NULL) s = list_top(&cc->spans[CS_SPARSE], struct c_span, link);
+	if(s == NULL) s = new_span(c);
+
+	int old = span_fullness(s), ix = s->free_head;
+	assert(ix < cc->n_objs);
+	struct c_obj *o = span_obj(s, ix);
+	assert(o->owner == NULL);
+	s->free_head = o->next_free;
+	*o = (struct c_obj){ .owner = owner, .len = len };
+	span_copy(s, obj_offset(s, ix) + sizeof *o, (void *)data, len, true);
+	s->n_used++;
+	cc->n_used++;
+	if(span_fullness(s) != old) {
+		list_del_from(&cc->spans[old], &s->link);
+		list_add(&cc->spans[span_fullness(s)], &s->link);
+	}
+
+	return (L4_Word_t)s | ix << 2 | LF_SWAP;
+}
+
+
+static struct c_obj *load_obj_hdr(L4_Word_t p_addr) {
+	struct c_obj *o = span_obj(span_of(p_addr), LF_OBJ(p_addr));
+	assert(o->owner != NULL);
+	return o;
+}
+
+
+static void load_obj(L4_Word_t p_addr, void *buf)
+{
+	struct c_span *s = span_of(p_addr);
+	int ix = LF_OBJ(p_addr);
+	span_copy(s, obj_offset(s, ix) + sizeof(struct c_obj), buf,
+		span_obj(s, ix)->len, false);
+}
+
+
+static void free_obj(L4_Word_t p_addr)
+{
+	struct c_span *s = span_of(p_addr);
+	struct c_class *cc = &c_classes[s->class];
+	int old = span_fullness(s), ix = LF_OBJ(p_addr);
+	struct c_obj *o = span_obj(s, ix);
+	assert(o->owner != NULL);
+	*o = (struct c_obj){ .next_free = s->free_head };
+	s->free_head = ix;
+	s->n_used--;
+	cc->n_used--;
+	if(s->n_used == 0) {
+		list_del_from(&cc->spans[old], &s->link);
+		release_span(s);
+	} else if(span_fullness(s) != old) {
+		list_del_from(&cc->spans[old], &s->link);
+		list_add(&cc->spans[span_fullness(s)], &s->link);
+	}
+}
+
+
+/* moves the objects of the class' sparsest span into its other spans when
+ * they have room for all of them, and releases the emptied span. returns the
+ * number of frames released.
+ */
+static int compact_class(int c)
+{
+	static char buf[PAGE_SIZE];
+	struct c_class *cc = &c_classes[c];
+	struct c_span *src = NULL, *cur;
+	list_for_each(&cc->spans[CS_SPARSE], cur, link) {
+		if(src == NULL || cur->n_used < src->n_used) src = cur;
+	}
+	if(src == NULL || cc->n_spans < 2) return 0;
+	int room = (cc->n_spans - 1) * cc->n_objs - (cc->n_used - src->n_used);
+	if(room < src->n_used) return 0;
+
+	list_del_from(&cc->spans[CS_SPARSE], &src->link);
+	cc->n_used -= src->n_used;
+	for(int ix=0; ix < cc->n_objs && src->n_used > 0; ix++) {
+		struct c_obj *o = span_obj(src, ix);
+		if(o->owner == NULL) continue;
+		struct l_page *lp = o->owner;
+		int len = o->len;
+		span_copy(src, obj_offset(src, ix) + sizeof *o, buf, len, false);
+		int n_spans = cc->n_spans;
+		lp->p_addr = store_obj(lp, buf, len);
+		assert(cc->n_spans == n_spans);
+		src->n_used--;
+	}
+	int n_frames = src->n_frames;
+	release_span(src);
+	return n_frames;
+}
+
 
 static bool replace_active_page(struct p_page *p)
 {
@@ -429,63 +768,31 @@ static bool replace_active_page(struct p_page *p)
 	L4_UnmapFpage(fp);
 
 	assert(p->owner != NULL);
+	/* same-filled pages need no storage besides their fill word. */
+	L4_Word_t fill;
+	int fill_ix = page_is_filled((void *)P_ADDRESS(p), &fill)
+		? get_fill(fill) : -1;
 	char outbuf[LZ4_COMPRESSBOUND(PAGE_SIZE)];
-	int c_size = LZ4_compress_fast_extState(lz4_state,
-		(void *)P_ADDRESS(p), outbuf, PAGE_SIZE, sizeof outbuf, 1);
-	if(c_size >= MAX_COMPRESSED_SIZE) return false;
-	if(c_size == 0) {
-		printf("c_size=0??\n");
-		abort();
-	}
-
-	/* find the closest matching buddy, i.e. one that causes the least waste
-	 * compared to storing the replaced page in itself.
-	 * TODO: optimize this to not be a silly brute force loop.
-	 */
-	struct c_hdr *best = NULL, *cand;
-	int waste = PAGE_SIZE - sizeof(struct c_hdr) - c_size;
-	list_for_each(&buddy_list, cand, buddy_link) {
-		assert(cand->magic == C_MAGIC);
-		int left = PAGE_SIZE - sizeof(struct c_hdr)
-			- (cand->a != NULL ? cand->a_len : cand->b_len);
-		if(left < c_size) continue;
-		if(left - c_size < waste) {
-			waste = left - c_size;
-			best = cand;
+	int c_size = 0;
+	if(fill_ix < 0) {
+		c_size = LZ4_compress_fast_extState(lz4_state,
+			(void *)P_ADDRESS(p), outbuf, PAGE_SIZE, sizeof outbuf, 1);
+		if(c_size == 0) {
+			printf("c_size=0??\n");
+			abort();
 		}
+		int c = obj_class(c_size);
+		if(c >= N_CLASSES || c_classes[c].n_objs == 0) return false;
 	}
 
+	/* release @p first so that a new span may reuse it. */
+	struct l_page *lp = p->owner;
 	list_del_from(&active_page_list, &p->link);
-	if(best == NULL) {
-		best = (void *)P_ADDRESS(p);
-		*best = (struct c_hdr){
-			.magic = C_MAGIC, .phys = p,
-			.a_len = c_size, .a = p->owner,
-		};
-		memcpy(&best[1], outbuf, c_size);
-		list_add(&buddy_list, &best->buddy_link);
-		p->owner->p_addr |= LF_SWAP;
-		p->owner = NULL;
-	} else {
-		list_del_from(&buddy_list, &best->buddy_link);
-		void *addr;
-		if(best->a == NULL) {
-			addr = &best[1];
-			best->a = p->owner;
-			best->a_len = c_size;
-		} else {
-			addr = (void *)best + PAGE_SIZE - c_size;
-			assert(addr >= (void *)&best[1]);
-			best->b = p->owner;
-			best->b_len = c_size;
-		}
-		memcpy(addr, outbuf, c_size);
-
-		p->owner->p_addr = ((L4_Word_t)best & ~PAGE_MASK) | LF_SWAP;
-		p->owner = NULL;
-		list_add(&free_page_list, &p->link);
-		num_free_pages++;
-	}
+	p->owner = NULL;
+	list_add(&free_page_list, &p->link);
+	num_free_pages++;
+	if(fill_ix >= 0) lp->p_addr = fill_ix << 2 | LF_FILL;
+	else lp->p_addr = store_obj(lp, outbuf, c_size);
 
 	return true;
 }
@@ -563,17 +870,29 @@ static int replace_pages(bool *looped_p)
 
 static struct p_page *get_free_page(void)
 {
-	struct p_page *p = list_pop(&free_page_list, struct p_page, link);
-	if(p == NULL) panic("no free pages in get_free_page()!");
-	num_free_pages--;
+	struct p_page *p = take_free_page();
 	p->age = 1;
 
 	/* static low and high watermarks. sixteen is likely a bit on the high
-	 * side; replacement shouldn't allocate any memory on its own.
+	 * side; replacement allocates at most a span's worth of frames at once.
 	 */
 	if(repl_enable && num_free_pages < 16) {
+		/* frames of sparse spans come back cheaper than compressing more,
+		 * and vm's spare frames cheaper still. those can't be asked for
+		 * while a fault is half-served, since the balloon thread's own faults
+		 * come here in-band; so they're borrowed after the reply in
+		 * impl_handle_fault(), and until then replacement only keeps up the
+		 * low watermark.
+		 */
+		for(int c=0; c < N_CLASSES && num_free_pages < 48; c++) {
+			while(num_free_pages < 48 && compact_class(c) > 0) {
+				/* again */
+			}
+		}
+		if(num_free_pages < 48) borrow_wanted = true;
+		const unsigned high = L4_IsNilThread(balloon_tid) ? 48 : 16;
 		int loops = 0, loop_freed = 0;
-		while(num_free_pages < 48) {
+		while(num_free_pages < high) {
 			bool looped;
 			int n_freed = replace_pages(&looped);
 			loop_freed += n_freed;
@@ -589,9 +908,7 @@ static struct p_page *get_free_page(void)
 #endif
 		}
 		if(num_free_pages < 16) {
-			/* BOOM!
-			 * TODO: have a protocol w/ vm to get more memory.
-			 */
+			/* BOOM! and vm had nothing to spare either. */
 			panic("couldn't replace memory in get_free_page()!");
 		}
 	}
@@ -602,37 +919,24 @@ static struct p_page *get_free_page(void)
 
 static struct p_page *decompress(struct l_page *lp)
 {
-	struct c_hdr *ch = (struct c_hdr *)(lp->p_addr & ~PAGE_MASK);
-	assert(ch->magic == C_MAGIC);
-	void *data;
-	int len;
-	bool done;
-	if(ch->a == lp) {
-		data = &ch[1];
-		len = ch->a_len;
-		ch->a = NULL;
-		done = ch->b == NULL;
-	} else {
-		assert(ch->b == lp);
-		data = (void *)ch + PAGE_SIZE - ch->b_len;
-		len = ch->b_len;
-		ch->b = NULL;
-		done = ch->a == NULL;
-	}
-	struct p_page *phys;
-	int n;
-	if(!done) {
-		phys = get_free_page();
-		list_add(&buddy_list, &ch->buddy_link);
-		n = LZ4_decompress_safe(data, (void *)P_ADDRESS(phys), len, PAGE_SIZE);
-	} else {
-		/* expand into the same page via a buffer. */
-		list_del_from(&buddy_list, &ch->buddy_link);
-		phys = ch->phys;
-		char buf[len];
-		memcpy(buf, data, len);
-		n = LZ4_decompress_safe(buf, (void *)P_ADDRESS(phys), len, PAGE_SIZE);
+	if(lp->p_addr & LF_FILL) {
+		int ix = LF_OBJ(lp->p_addr);
+		L4_Word_t fill = fills[ix].value;
+		put_fill(ix);
+		struct p_page *phys = get_free_page();
+		fill_page((void *)P_ADDRESS(phys), fill);
+		return phys;
 	}
+
+	/* copy out and release the object before allocating, since that may
+	 * compact spans.
+	 */
+	int len = load_obj_hdr(lp->p_addr)->len;
+	char buf[len];
+	load_obj(lp->p_addr, buf);
+	free_obj(lp->p_addr);
+	struct p_page *phys = get_free_page();
+	int n = LZ4_decompress_safe(buf, (void *)P_ADDRESS(phys), len, PAGE_SIZE);
 	if(n != PAGE_SIZE) {
 		printf("%s: n=%d\n", __func__, n);
 		panic("invalid decompressed length!");
@@ -714,7 +1018,7 @@ static bool handle_pf(
 		lp->p_addr = P_ADDRESS(phys);
 		phys->owner = lp;
 		list_add_tail(&active_page_list, &phys->link);
-	} else if(lp->p_addr & LF_SWAP) {
+	} else if(lp->p_addr & (LF_SWAP | LF_FILL)) {
 		/* unswap */
 		struct p_page *phys = decompress(lp);
 		lp->p_addr = P_ADDRESS(phys);
@@ -736,8 +1040,17 @@ static bool handle_pf(
 static void impl_handle_fault(
 	L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *page_ptr)
 {
-	if(!handle_pf(page_ptr, muidl_get_sender(), faddr, fip)) {
+	L4_ThreadId_t sender = muidl_get_sender();
+	if(!handle_pf(page_ptr, sender, faddr, fip)) {
+		muidl_raise_no_reply();
+	} else if(borrow_wanted && balloon_ready()) {
+		/* reply by hand so that the fault is done with before borrowing. */
+		L4_LoadMR(0, (L4_MsgTag_t){ .X.t = 2 }.raw);
+		L4_LoadMRs(1, 2, page_ptr->raw);
+		L4_Reply(sender);
 		muidl_raise_no_reply();
+		borrow_wanted = false;
+		if(num_free_pages < 48) borrow_pages(48 - num_free_pages);
 	}
 }
 
@@ -767,6 +1080,127 @@ static bool interim_fault(L4_MsgTag_t tag, L4_ThreadId_t peer)
 }
 
 
+/* memory pressure protocol with vm's balloon thread; see <sneks/mm.h>. the
+ * thread can't be asked for anything while it's waiting on us, hence the
+ * sender check.
+ */
+static bool balloon_ready(void) {
+	return !in_balloon && !L4_IsNilThread(balloon_tid)
+		&& !L4_SameThreads(muidl_get_sender(), balloon_tid);
+}
+
+
+static L4_MsgTag_t balloon_call(void)
+{
+	L4_MsgTag_t tag = L4_Call_Timeouts(balloon_tid,
+		L4_TimePeriod(5 * 1000), L4_TimePeriod(5 * 1000));
+	while(interim_fault(tag, balloon_tid)) {
+		tag = L4_Call_Timeouts(balloon_tid, L4_ZeroTime,
+			L4_TimePeriod(5 * 1000));
+	}
+	return tag;
+}
+
+
+/* asks vm for up to @want frames one at a time. returns how many arrived. */
+static int borrow_pages(int want)
+{
+	if(!balloon_ready()) return 0;
+	in_balloon = true;
+	int got = 0;
+	while(got < want) {
+		L4_Accept(L4_UntypedWordsAcceptor);
+		L4_LoadMR(0, (L4_MsgTag_t){ .X.label = BALLOON_WANT, .X.u = 1 }.raw);
+		L4_LoadMR(1, want - got);
+		L4_MsgTag_t tag = balloon_call();
+		if(L4_IpcFailed(tag) || L4_Label(tag) != BALLOON_OFFER
+			|| L4_UntypedWords(tag) != 1)
+		{
+			break;
+		}
+		L4_Fpage_t fp;
+		L4_StoreMR(1, &fp.raw);
+		if(L4_IsNilFpage(fp)) break;
+		assert(L4_SizeLog2(fp) == PAGE_BITS);
+
+		L4_Accept(L4_MapGrantItems(fp));
+		L4_LoadMR(0, (L4_MsgTag_t){ .X.label = BALLOON_TAKE }.raw);
+		tag = balloon_call();
+		L4_Accept(L4_UntypedWordsAcceptor);
+		if(L4_IpcFailed(tag) || L4_TypedWords(tag) != 2) {
+			printf("sysmem: %s: no grant for offered frame, ec=%lu\n",
+				__func__, L4_IpcFailed(tag) ? L4_ErrorCode() : 0);
+			break;
+		}
+		struct p_page *pg = alloc_struct(p_page);
+		pg->owner = NULL;
+		pg->addr_flags = L4_Address(fp) | PF_LOANED;
+		add_free_page(pg);
+		num_loaned_pages++;
+		got++;
+	}
+	in_balloon = false;
+#ifdef DEBUG_ME_HARDER
+	if(got > 0) printf("sysmem: borrowed %d frames from vm\n", got);
+#endif
+	return got;
+}
+
+
+static struct p_page *find_loaned_page(void)
+{
+	struct p_page *pg;
+	list_for_each(&free_page_list, pg, link) {
+		if(pg->addr_flags & PF_LOANED) return pg;
+	}
+	return NULL;
+}
+
+
+/* grants up to @want free borrowed frames back to vm. returns how many went.
+ * the free list is searched from the top each time since in-band faults may
+ * take pages off it.
+ */
+static int return_pages(int want)
+{
+	if(!balloon_ready()) return 0;
+	in_balloon = true;
+	int n = 0;
+	while(n < want) {
+		struct p_page *pg = find_loaned_page();
+		if(pg == NULL) break;
+
+		L4_Fpage_t fp = L4_FpageLog2(P_ADDRESS(pg), PAGE_BITS);
+		L4_Set_Rights(&fp, L4_FullyAccessible);
+		L4_GrantItem_t gi = L4_GrantItem(fp, P_ADDRESS(pg));
+		L4_LoadMR(0, (L4_MsgTag_t){
+			.X.label = BALLOON_RETURN, .X.u = 1, .X.t = 2 }.raw);
+		L4_LoadMR(1, P_ADDRESS(pg));
+		L4_LoadMRs(2, 2, gi.raw);
+		L4_MsgTag_t tag = balloon_call();
+		if(L4_IpcFailed(tag) && (L4_ErrorCode() & 1) == 0) break;	/* not sent */
+
+		list_del_from(&free_page_list, &pg->link);
+		num_free_pages--;
+		num_loaned_pages--;
+		recycle_struct(p_page, pg);
+		n++;
+		if(L4_IpcFailed(tag)) break;
+	}
+	in_balloon = false;
+	return n;
+}
+
+
+/* gives borrowed frames back once there's plenty free. */
+static void balance_loans(void)
+{
+	if(num_loaned_pages > 0 && num_free_pages > LOAN_HIGH_WM) {
+		return_pages(num_free_pages - LOAN_HIGH_WM);
+	}
+}
+
+
 #if !1
 static void abend_helper_thread(void)
 {
@@ -871,27 +1305,10 @@ static void remove_l_page(
 	L4_Fpage_t *fp, int *n_fp)
 {
 	if(lp->p_addr & LF_SWAP) {
-		struct c_hdr *ch = (struct c_hdr *)(lp->p_addr & ~PAGE_MASK);
-		assert(ch->magic == C_MAGIC);
-		bool done;
-		if(ch->a == lp) {
-			done = ch->b == NULL;
-			ch->a = NULL;
-		} else {
-			assert(ch->b == lp);
-			done = ch->a == NULL;
-			ch->b = NULL;
-		}
-		if(done) {
-			/* implies membership in buddy list */
-			list_del_from(&buddy_list, &ch->buddy_link);
-			assert(ch->phys->owner == NULL);
-			list_add(&free_page_list, &ch->phys->link);
-			num_free_pages++;
-		} else {
-			/* otherwise, it should go in there. */
-			list_add(&buddy_list, &ch->buddy_link);
-		}
+		assert(load_obj_hdr(lp->p_addr)->owner == lp);
+		free_obj(lp->p_addr);
+	} else if(lp->p_addr & LF_FILL) {
+		put_fill(LF_OBJ(lp->p_addr));
 	} else {
 		struct p_page *phys = get_active_page(lp->p_addr & ~PAGE_MASK);
 		if(phys != NULL) {
@@ -925,6 +1342,7 @@ static void impl_rm_task(int32_t pid)
 
 	rb_erase(&t->rb, &systask_tree);
 	recycle_struct(systask, t);
+	balance_loans();
 }
 
 
@@ -1050,7 +1468,9 @@ static uint16_t impl_send_virt(
 		if(dstp != NULL) remove_l_page(dest, dstp, fp, &n_fp);
 
 		/* move it over and unmap the physical memory. */
-		unmap_page(lp->p_addr & ~PAGE_MASK, fp, &n_fp);
+		if((lp->p_addr & (LF_SWAP | LF_FILL)) == 0) {
+			unmap_page(lp->p_addr & ~PAGE_MASK, fp, &n_fp);
+		}
 		rb_erase(&lp->rb, &src->mem);
 		lp->l_addr = dest_addr;
 		put_lpage(dest, lp);
@@ -1099,6 +1519,7 @@ static void impl_brk(L4_Word_t new_brk)
 			cur = container_of_or_null(next, struct l_page, rb);
 		}
 		if(n_fp > 0) L4_UnmapFpages(n_fp, fp);
+		balance_loans();
 	}
 
 	task->brk = new_brk;
@@ -1217,6 +1638,33 @@ static int impl_alter_flags(
 }
 
 
+static int32_t impl_shrink(int32_t n_pages)
+{
+	if(!balloon_ready() || n_pages <= 0) return 0;
+	int want = min_t(int, n_pages, num_loaned_pages), n_free = 0;
+	for(int c=0; c < N_CLASSES; c++) {
+		while(compact_class(c) > 0) {
+			/* again */
+		}
+	}
+	/* replace systask memory for at most one pass of the clock until
+	 * enough of the borrowed frames are free.
+	 */
+	bool looped = false;
+	while(!looped && !list_empty(&active_page_list)) {
+		struct p_page *pg;
+		n_free = 0;
+		list_for_each(&free_page_list, pg, link) {
+			if(pg->addr_flags & PF_LOANED) n_free++;
+		}
+		if(n_free >= want) break;
+		replace_pages(&looped);
+	}
+
+	return return_pages(want);
+}
+
+
 static int impl_lookup(L4_Word_t *info_tid) {
 	*info_tid = L4_MyGlobalId().raw;
 	return 0;
@@ -1367,6 +1815,7 @@ int main(void)
 	the_kip = L4_GetKernelInterface();
 	s0_tid = L4_GlobalId(the_kip->ThreadInfo.X.UserBase, 1);
 	add_first_mem();
+	init_classes();
 	int n = sneks_setup_console_stdio();
 	if(n != 0) {
 		L4_KDB_PrintString("can't setup console stdio in sysmem!");
@@ -1395,6 +1844,7 @@ int main(void)
 		.get_shape = &impl_get_shape,
 		.set_kernel_areas = &impl_set_kernel_areas,
 		.alter_flags = &impl_alter_flags,
+		.shrink = &impl_shrink,
 	};
 
 	for(;;) {
@@ -1414,6 +1864,15 @@ int main(void)
 				handle_iopf(sender, tag, iofp, eip);
 				continue;
 			}
+			/* vm's balloon thread. first come, first served. */
+			if(L4_Label(tag) == BALLOON_HELLO && L4_IsNilThread(balloon_tid)
+				&& pidof_NP(sender) >= SNEKS_MIN_SYSID)
+			{
+				balloon_tid = sender;
+				L4_LoadMR(0, 0);
+				L4_Reply(sender);
+				continue;
+			}
 			L4_Word_t mrs[64]; L4_StoreMRs(1, tag.X.u + tag.X.t, mrs);
 			if(L4_ThreadNo(sender) < L4_ThreadNo(L4_Myself())
 				&& L4_Label(tag) == 0xbaaf)
@@ -4,6 +4,8 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <ccan/array_size/array_size.h>
 #include <sneks/test.h>
@@ -43,6 +45,91 @@ START_TEST(fill_constant)
 END_TEST
 
 
+/* same-filled pages, bytewise and by a word that varies between pages, which
+ * sysmem may store as just their fill word. reads them back afterward.
+ */
+START_TEST(fill_readback)
+{
+	static unsigned scales[] = { LARGE_SIZE, HUGE_SIZE };
+	plan_tests(ARRAY_SIZE(scales) + 1);
+
+	for(int i=0; i < ARRAY_SIZE(scales); i++) {
+		uint8_t *ptr = malloc(scales[i]);
+		memset(ptr, 1, scales[i]);
+		size_t n_bad = 0;
+		for(size_t j=0; j < scales[i]; j++) {
+			if(ptr[j] != 1) n_bad++;
+		}
+		if(!ok(n_bad == 0, "read back %u bytes", scales[i])) {
+			diag("n_bad=%zu", n_bad);
+		}
+		free(ptr);
+	}
+
+	const size_t page = 4096, n_words = page / sizeof(uint32_t),
+		n_pages = HUGE_SIZE / page;
+	uint32_t *ptr = malloc(HUGE_SIZE);
+	for(size_t i=0; i < n_pages; i++) {
+		uint32_t word = 0x9e3779b9u * (i % 37 + 1);
+		for(size_t j=0; j < n_words; j++) ptr[i * n_words + j] = word;
+	}
+	size_t n_bad = 0;
+	for(size_t i=0; i < n_pages; i++) {
+		uint32_t word = 0x9e3779b9u * (i % 37 + 1);
+		bool bad = false;
+		for(size_t j=0; j < n_words; j++) bad |= ptr[i * n_words + j] != word;
+		if(bad) n_bad++;
+	}
+	if(!ok(n_bad == 0, "word-filled pages intact")) diag("n_bad=%zu", n_bad);
+	free(ptr);
+}
+END_TEST
+
+
+/* pages that are random up to a varying length and zero after it, so that
+ * they compress into many different sizes. checks them all afterward.
+ */
+START_TEST(fill_mixed)
+{
+	plan_tests(1);
+
+	const size_t page = 4096, n_pages = HUGE_SIZE / page;
+	uint8_t *ptr = malloc(HUGE_SIZE);
+	uint32_t seed = 0x1234abcd;
+	for(size_t i=0; i < n_pages; i++) {
+		uint8_t *p = ptr + i * page;
+		size_t len = (i * 97) % page;
+		for(size_t j=0; j < len; j++) {
+			seed = seed * 1103515245 + 12345;
+			p[j] = seed >> 24;
+		}
+		memset(p + len, 0, page - len);
+	}
+
+	seed = 0x1234abcd;
+	size_t n_bad = 0;
+	for(size_t i=0; i < n_pages; i++) {
+		const uint8_t *p = ptr + i * page;
+		size_t len = (i * 97) % page;
+		bool bad = false;
+		for(size_t j=0; j < page; j++) {
+			uint8_t want = 0;
+			if(j < len) {
+				seed = seed * 1103515245 + 12345;
+				want = seed >> 24;
+			}
+			bad |= p[j] != want;
+		}
+		if(bad) n_bad++;
+	}
+	if(!ok(n_bad == 0, "contents intact")) diag("n_bad=%zu", n_bad);
+	free(ptr);
+}
+END_TEST
+
+
 SYSTEST("mem:big", plain_alloc);
 SYSTEST("mem:big", fill_constant);
+SYSTEST("mem:big", fill_readback);
+SYSTEST("mem:big", fill_mixed);
 /* TODO: add one that stores a repeating sequence of 0..255 */
@@ -42,7 +42,8 @@ ipcfail:
 }
 
 
-COLD L4_Fpage_t *init_protocol(int *n_phys_p, L4_ThreadId_t *peer_tid_p)
+COLD L4_Fpage_t *init_protocol(int *n_phys_p, L4_ThreadId_t *peer_tid_p,
+	uint32_t salt[static 4])
 {
 	L4_ThreadId_t sender;
 	L4_Accept(L4_UntypedWordsAcceptor);
@@ -56,6 +57,11 @@ COLD L4_Fpage_t *init_protocol(int *n_phys_p, L4_ThreadId_t *peer_tid_p)
 	L4_Word_t total_pages = 0, max_phys = 0;
 	L4_StoreMR(1, &total_pages);
 	L4_StoreMR(2, &max_phys);
+	for(int i=0; i < 4; i++) {
+		L4_Word_t w;
+		L4_StoreMR(3 + i, &w);
+		salt[i] = w;
+	}
 	printf("vm: total_pages=%lu, max_phys=%#lx\n", total_pages, max_phys);
 	/* TODO: use vmaux to deal with total_pages too large to fit a 1G dlmalloc
 	 * heap below the microkernel reservation.
@@ -1,11 +1,15 @@
 /* systemspace POSIX-like virtual memory server.
  *
- * note that this is currently a single-threaded implementation, with some
- * lf/wf primitives mixed into the design even when they're not being used.
- * the idea is that once mung gets MP and muidl becomes multithreaded,
- * reworking vm to behave regardless of concurrency will be that much of a
- * smaller job, and that using epochs before MP should expose problems with
- * collection speed, usage issues, etc.
+ * requests are served by a pool of service threads, each of which is the
+ * pager of the address spaces whose PID it's handed by VM::pager. most of
+ * vm's data structures are under the one big vm_lock, which is held for the
+ * duration of each request; the exception is the fault fast path in
+ * remap_fault(), which restores mappings of resident pages under just the
+ * faulting space's lock. page cache lists and free page lists are nbsl and
+ * protected by epochs as before, so that those may be taken out from under
+ * vm_lock piecemeal later on. the page cache fill thread only does file IO
+ * into pages it's handed and doesn't touch vm's data structures; the
+ * same-page merging thread, when enabled, takes vm_lock like a service thread.
  */
 
 #define VMIMPL_IMPL_SOURCE
@@ -24,6 +28,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <threads.h>
+#include <stdnoreturn.h>
 #include <sys/mman.h>
 #include <ccan/likely/likely.h>
 #include <ccan/compiler/compiler.h>
@@ -32,9 +38,11 @@
 #include <ccan/container_of/container_of.h>
 #include <ccan/darray/darray.h>
 #include <ccan/bitmap/bitmap.h>
+#include <ccan/opt/opt.h>
 
 #include <l4/types.h>
 #include <l4/ipc.h>
+#include <l4/thread.h>
 #include <l4/space.h>
 #include <l4/kip.h>
 
@@ -42,6 +50,7 @@
 #include <ukernel/memdesc.h>
 #include <sneks/mm.h>
 #include <sneks/bitops.h>
+#include <sneks/lz4.h>
 #include <sneks/rbtree.h>
 #include <sneks/process.h>
 #include <sneks/hash.h>
@@ -49,6 +58,8 @@
 #include <sneks/sanity.h>
 #include <sneks/systask.h>
 #include <sneks/sys/info-defs.h>
+#include <sneks/sys/filesystem-defs.h>
+#include <sneks/sys/sysmem-defs.h>
 #include <sneks/api/proc-defs.h>
 #include <sneks/api/file-defs.h>
 #include <sneks/api/io-defs.h>
@@ -61,6 +72,11 @@
 #include "vm-impl-defs.h"
 
 
+/* from lib/dlmalloc.c, which has no header of its own. */
+extern void **independent_calloc(size_t n_elems, size_t elem_size,
+	void **chunks);
+
+
 #ifndef TRACE_FAULTS
 #define TRACE_FAULT(...)
 #else
@@ -74,16 +90,25 @@ typedef darray(struct pl *) plbuf;
 
 
 /* flags etc. in vp->vaddr's low 12 bits:
- *   - VPM_RIGHTS covers L4.X2 access bits in the low 3. see VPF_COW.
- *   - VPF_SHARED: contents in the page cache.
- *   - VPF_ANON: contents not backed by a file.
- *   - VPF_COW write faults to this page are processed copy-on-write.
- *     exclusive with L4_Writable.
+ *   - VPM_RIGHTS (bits 2..0) covers L4.X2 access bits. see VPF_COW.
+ *   - VPF_SHARED (bit 3): contents in the page cache.
+ *   - VPF_ANON (bit 4): contents not backed by a file.
+ *   - VPF_COW (bit 5): write faults to this page are processed copy-on-write when
+ *     its mapping permits writing. exclusive with L4_Writable. kept while the
+ *     page is read-only, since the frame may still be shared.
+ *   - VPF_LARGE (bit 6): covers LARGE_SIZE bytes of private anonymous memory in a
+ *     physically contiguous frame starting at ->status. exclusive with the
+ *     other flags besides VPF_ANON.
+ *   - VPF_MERGED (bit 7): private anonymous page that shares its frame with
+ *     an identical one by way of merge_frame(). cleared in pf_cow().
+ * bits 11..8 are not used and should be left clear.
  */
 #define VPM_RIGHTS 0x7
 #define VPF_SHARED 0x8
 #define VPF_ANON 0x10
 #define VPF_COW 0x20
+#define VPF_LARGE 0x40
+#define VPF_MERGED 0x80
 
 
 /* bitfield accessors. */
@@ -91,6 +116,16 @@ typedef darray(struct pl *) plbuf;
 #define VP_IS_SHARED(vp) !!((vp)->vaddr & VPF_SHARED)
 #define VP_IS_ANON(vp) !!((vp)->vaddr & VPF_ANON)
 #define VP_IS_COW(vp) !!((vp)->vaddr & VPF_COW)
+#define VP_IS_LARGE(vp) !!((vp)->vaddr & VPF_LARGE)
+
+/* vp->status of pages in compressed swap: frame number and which half of it
+ * the data is in. see <struct swap_hdr>.
+ */
+#define VPS_SWAP 0x80000000
+#define SWAP_STATUS(frame, half) (VPS_SWAP | (uint32_t)(frame) << 1 | (half))
+#define SWAP_FRAME(st) (((st) & ~VPS_SWAP) >> 1)
+#define SWAP_HALF(st) ((st) & 1)
+#define VP_IS_SWAPPED(vp) !!((vp)->status & VPS_SWAP)
 
 /* access of <struct pl>'s fsid_ino . */
 #define PL_FSID(pl) ((pl)->fsid_ino >> 48)
@@ -100,6 +135,24 @@ typedef darray(struct pl *) plbuf;
 
 #define IS_ANON_MMAP(mm) (((mm)->flags & MAP_ANONYMOUS) && ((mm)->flags & MAP_SHARED))
 
+#define PL_FILLING 2	/* pl->status of page cache placeholders */
+#define PL_RETURNED 3	/* pl->status of loans given back; see reclaim_loans() */
+#define PL_LARGE 0x40	/* first page of a large frame; see VPF_LARGE */
+#define PL_DIRTY 0x80	/* written thru a shared map, can't be evicted */
+#define PL_AGE_SHIFT 8
+#define PL_MAX_AGE 7
+#define PL_STATE(st) ((st) & 0x3f)
+#define PL_AGE(st) ((st) >> PL_AGE_SHIFT)
+#define PL_LIVE_AGE(age) (1 | (age) << PL_AGE_SHIFT)
+
+/* large pages. these are used for private anonymous memory where an aligned
+ * block of this size lies entirely within one lazy_mmap.
+ */
+#define LARGE_BITS 22
+#define LARGE_SIZE (1ul << LARGE_BITS)
+#define LARGE_MASK (LARGE_SIZE - 1)
+#define LARGE_PAGES (1 << (LARGE_BITS - PAGE_BITS))
+
 
 struct vp;
 
@@ -126,6 +179,14 @@ struct pl {
 	 * removed from its list by iterator, so it's useful to batch up several
 	 * of them (such as in munmap_space()) and remove them in a single O(n)
 	 * go.
+	 *
+	 * in the page cache, PL_FILLING designates a placeholder whose contents
+	 * are still being read in; see <struct pc_fill>. live page cache links
+	 * also carry PL_DIRTY and the page's replacement age; see
+	 * reclaim_pages().
+	 *
+	 * PL_LARGE marks the first page of a large frame, the rest of which have
+	 * no link of their own.
 	 */
 	_Atomic uint32_t status;
 
@@ -145,27 +206,41 @@ struct pl {
 };
 
 
-/* virtual memory page. (there is no <struct vl>.)
+/* virtual memory page. (there is no <struct vl>.) these live in the
+ * per-space page table, see <struct vp_leaf>, and stay put while in use.
  *
- * for now, ->status designates the physical page number used for this vpage.
- * its high bit should always be clear. there will be other formats for
- * swapspace slots, references to pagecache items, and so on. this arrangement
- * allows for as many as 2^31 physical pages in vm, or 8 TiB worth. if
- * ->status is 0, anonymous memory has not yet been attached to this page by
- *  the fault handler.
+ * ->status designates the physical page number used for this vpage when its
+ * high bit is clear. this arrangement allows for as many as 2^31 physical
+ * pages in vm, or 8 TiB worth. if ->status is 0, anonymous memory has not yet
+ * been attached to this page by the fault handler. with the high bit set the
+ * page's contents are in compressed swap instead; see VPS_SWAP.
  *
- * flags are assigned in ->vaddr's low 12 bits as follows:
- *   - 2..0 are a mask of L4_Readable, L4_Writable, and L4_eXecutable,
- *     designating the access granted to the associated address space.
- *   - bit 3 indicates copy-on-write sharing.
- *   - bits 11..4 are not used and should be left clear.
+ * flags are assigned in ->vaddr's low 12 bits; see VPM_RIGHTS and the VPF_*
+ * bits.
  */
 struct vp {
 	uintptr_t vaddr;	/* vaddr in 31..12, flags in 11..0 */
 	uint32_t status;	/* complex format, see comment. */
 	uint8_t age;		/* TODO: move into subfield of pl->status */
+	uint16_t pid;		/* of the vm_space this is in */
+};
+
+
+/* page table leaf. covers one LARGE_SIZE block of address space with a
+ * <struct vp> for each page therein, where those with ->vaddr == 0 are unused.
+ * a large page occupies the first and leaves the rest unused. leaves are
+ * released once their last vp is.
+ */
+struct vp_leaf {
+	union {
+		unsigned n_live;			/* in vm_space.vpt */
+		struct vp_leaf *next;	/* in free_leaves */
+	};
+	struct vp pages[LARGE_PAGES];
 };
 
+#define VPT_SIZE (1 << (32 - LARGE_BITS))
+
 
 /* address space. PID implied. valid when ->kip_area.raw != 0. uninitialized
  * when L4_IsNilFpage(->utcb_area).
@@ -173,14 +248,37 @@ struct vp {
 struct vm_space
 {
 	L4_Fpage_t kip_area, utcb_area, sysinfo_area;
-	struct htable pages;	/* <struct vp *> with hash_vp_by_vaddr() */
+	struct vp_leaf **vpt;	/* VPT_SIZE leaves by addr >> LARGE_BITS */
 	struct rb_root maps;	/* lazy_mmap per range of addr and length */
 	struct lazy_mmap *last_mmap;
-	struct rb_root as_free;	/* as_free per non-overlapping ->fp */
+	struct rb_root as_free;	/* as_free by ->addr, all above mmap_bot */
 	uintptr_t brk;
-	L4_Word_t mmap_bot;		/* bottom of as_free range */
+	L4_Word_t mmap_bot;		/* last byte of fresh address space */
+	mtx_t lock;				/* see vm_lock */
+};
+
+
+/* file mapped by one or more lazy_mmaps, by filesystem and identity in
+ * file_table. each lazy_mmap over it holds a reference, as do fills in
+ * progress. ->fd is vm's own handle on the file, kept from the first mmap(2)
+ * of it and used for fills. it's closed once the last reference goes away,
+ * but the file's pages stay behind in the page cache under ->ino for the next
+ * mapping of the same file to find.
+ */
+struct mfile {
+	struct mfile *next;	/* in dead_files */
+	L4_ThreadId_t fs;
+	int fd, refs;
+	uint64_t ino;	/* FILE_IDENT() or HANDLE_IDENT() */
 };
 
+/* identity of a file for the page cache, as in PL_INO(). files on
+ * filesystems that don't implement Filesystem::identify get a number of their
+ * own instead, which is never reused.
+ */
+#define FILE_IDENT(ino, gen) ((uint64_t)((gen) & 0x7fff) << 32 | (uint32_t)(ino))
+#define HANDLE_IDENT(id) (1ull << 47 | (uint32_t)(id))
+
 
 /* set of mmap(2) parameters for lazy pagefault repair. `prot' gets translated
  * to the L4_Rights() mask to test fault access and stored in bits 16..18 of
@@ -195,12 +293,9 @@ struct lazy_mmap
 
 	/* for pagecache access.
 	 *
-	 * when backed by a file, the three reference a filesystem service, an
-	 * inode number, and a page offset within that file.
-	 * (TODO: actually "ino" is a file descriptor until the fs-vm-block IPC
-	 * chain stuff gets written. as such the descriptor isn't properly closed
-	 * when the map is removed, or duplicated when the map is divided such as
-	 * in munmap().)
+	 * when backed by a file, the three reference a filesystem service, the
+	 * file's identity per FILE_IDENT(), and a page offset within that file;
+	 * and ->file holds a reference to the file's <struct mfile>.
 	 *
 	 * when anonymous, ->fd_serv is VM's sysid, ->ino is zero for private maps
 	 * and an anonymous mapping ID when the map is shared. offset is nonzero
@@ -209,14 +304,65 @@ struct lazy_mmap
 	L4_ThreadId_t fd_serv;
 	uint64_t ino;
 	size_t offset;
+	struct mfile *file;	/* when file-backed, or NULL */
 	unsigned short tailsz; /* clear PAGE_SIZE-tailsz bytes at end of last page */
+	/* log2 of the fault-around window plus one, or 0 for the system-wide
+	 * default. see fault_around().
+	 */
+	unsigned char around;
+	/* MADV_NORMAL, MADV_RANDOM, or MADV_SEQUENTIAL from madvise(2). */
+	unsigned char advice;
+
+	/* sequential access detection for readahead, in pages from ->offset.
+	 * ->ra_prev is the last page fetched thru the page cache, ->ra_end is one
+	 * past the last page read ahead, and ->ra_size is the current readahead
+	 * window or 0 when access isn't sequential.
+	 */
+	uint32_t ra_prev, ra_end;
+	unsigned short ra_size;
+};
+
+
+/* a page fault. these are parked on <struct pc_fill> while the page it
+ * wants is being read in, and replayed once it's there.
+ */
+struct pf_wait {
+	struct pf_wait *next;
+	L4_ThreadId_t sender;
+	L4_Word_t faddr, fip;
+	int fault_rwx;
+	int sig;	/* to pop on the faulter after a replay, or 0 */
+};
+
+
+/* page cache fill in progress. fetch_cached_page() creates these on a miss
+ * on a file-backed page, along with a placeholder <struct pl> in pc_buckets,
+ * and queues them for fill_thread_fn() to do the IO on. that thread finishes
+ * them in finish_fill() and passes them to the service thread of each fault
+ * that was parked on the placeholder meanwhile, which replays it in
+ * complete_fill(); the last of those releases the fill.
+ */
+struct pc_fill {
+	struct pc_fill *next;	/* in fill_queue */
+	struct pl *link;		/* placeholder, status=PL_FILLING */
+	struct mfile *file;		/* holds a reference */
+	size_t offset;			/* in bytes */
+	int status;				/* bytes read, or negative errno */
+	int n_pagers;			/* service threads yet to complete_fill() */
+	struct pf_wait *waiters;
 };
 
 
-/* chunk of free address space in vm_space.as_free . */
+/* chunk of free address space in vm_space.as_free . these are left behind by
+ * munmap() between mmap_bot and the top of the address space, never overlap
+ * or touch one another, and the one adjacent to mmap_bot goes back into
+ * fresh address space instead. ->max_length is the greatest ->length in the
+ * subtree rooted here, for alloc_as().
+ */
 struct as_free {
 	struct rb_node rb;
-	L4_Fpage_t fp;
+	uintptr_t addr;
+	size_t length, max_length;
 };
 
 
@@ -239,13 +385,39 @@ struct as_free {
 #define RANGE_IN_FPAGE(fp, start, length) \
 	OVERLAP_EXCL(L4_Address((fp)), L4_Size((fp)), (start), (length))
 
+/* upper limit of fault-around window size. each map item takes two message
+ * registers in the fault reply.
+ */
+#define MAX_FAULT_AROUND_LOG2 4
+
+/* readahead window limits in pages. */
+#define MIN_READAHEAD 4
+#define MAX_READAHEAD 32
+
+/* label of fill_thread_fn()'s completion message. */
+#define FILL_DONE_LABEL 0x6670	/* "fp" */
+
 
 static size_t hash_vp_by_phys(const void *ptr, void *priv);
 static size_t hash_lazy_mmap_by_ino(const void *ptr, void *priv);
+static size_t hash_mfile(const void *ptr, void *priv);
 static void remove_vp(struct vp *vp, plbuf *plbuf);
 static void remove_active_pls(struct pl **pls, int n_pls);
 static struct lazy_mmap *find_lazy_mmap(struct vm_space *sp, uintptr_t addr);
+static struct lazy_mmap *first_lazy_mmap(
+	struct vm_space *sp, uintptr_t addr, size_t sz);
 static void free_page(struct pl *link0, plbuf *plbuf);
+static void free_large(struct pl *link0, plbuf *plbuf);
+static void erase_space(struct vm_space *sp);
+static size_t hash_fill_by_page(const void *ptr, void *priv);
+static size_t hash_pp_by_sum(const void *ptr, void *priv);
+static int start_fill(struct pl **cached_p,
+	struct nbsl_node *top, const struct lazy_mmap *mm, int bump);
+static unsigned finish_fill(struct pc_fill *fill);
+static void populate_range(struct vm_space *sp, const struct lazy_mmap *mm);
+static void merge_frame(uint32_t page_num, bool cold, plbuf *plbuf);
+static int prefault_page(struct vp **vp_p, struct vm_space *sp,
+	const struct lazy_mmap *mm, uintptr_t addr, bool zero);
 
 
 static size_t pp_first, pp_total;
@@ -259,6 +431,98 @@ static unsigned short anon_fsid;	/* pidof_NP(L4_MyGlobalId()) */
 static struct nbsl page_free_list = NBSL_LIST_INIT(page_free_list),
 	page_active_list = NBSL_LIST_INIT(page_active_list);
 
+/* length of page_free_list, and the watermarks at which page replacement
+ * starts and stops. see balance_free_pages().
+ */
+static _Atomic unsigned long n_free_pages = 0;
+static unsigned long free_low_wm, free_high_wm;
+
+/* page of zeroes that's mapped read-only for read faults on private anonymous
+ * memory, under copy-on-write where writable. it's on page_active_list without
+ * an owner, and its vps don't appear in share_table either, so those are
+ * recognized by ->status == zero_page instead. since it's mapped into nearly
+ * every space, it's only unmapped when a munmap() or brk() removes references
+ * to it; then the other spaces refault it thru their existing vps.
+ */
+static uint32_t zero_page;
+
+/* compressed swap. private anonymous pages that page replacement finds cold
+ * get compressed with LZ4 into frames on swap_frame_list, two to a frame in
+ * the manner of sysmem's buddy pages. each such frame starts with this header;
+ * the first half's data follows it and the second's ends at the end of the
+ * frame. frames with a free half are listed in swap_open by how many bytes
+ * they've got left, in bins of SWAP_BIN_SIZE; swap_open_mask has a bit set
+ * for each nonempty bin. see swap_out_page() and swap_in_page().
+ */
+struct swap_hdr {
+	uint16_t len[2];	/* compressed length of each half, 0 when free */
+	int16_t open_bin;	/* bin in swap_open */
+	int open_ix;		/* index in swap_open[open_bin], or -1 */
+};
+
+#define SWAP_BIN_SIZE (PAGE_SIZE / 64)
+#define N_SWAP_BINS (PAGE_SIZE / SWAP_BIN_SIZE)
+
+/* pages that compress worse than this stay resident. */
+#define MAX_SWAP_SIZE (PAGE_SIZE * 3 / 4)
+
+static struct nbsl swap_frame_list = NBSL_LIST_INIT(swap_frame_list);
+static darray(uint32_t) swap_open[N_SWAP_BINS];
+static uint64_t swap_open_mask = 0;
+static char lz4_state[LZ4_STREAMSIZE] __attribute__((aligned(8)));
+
+/* number of pages in compressed swap, and frames used for them. */
+static unsigned long n_swapped = 0, n_swap_frames = 0;
+
+static inline struct swap_hdr *swap_hdr_of(uint32_t status) {
+	return (struct swap_hdr *)((uintptr_t)SWAP_FRAME(status) << PAGE_BITS);
+}
+
+static inline void *swap_data(struct swap_hdr *h, int half) {
+	return half == 0 ? (void *)&h[1] : (void *)h + PAGE_SIZE - h->len[1];
+}
+
+/* same-page merging. with --merge-pages=n, merge_thrd wakes up every
+ * MERGE_INTERVAL_MS and has merge_pages() look at the next n physical frames.
+ * private anonymous pages whose contents hash the same as on the previous
+ * pass are taken to be cold, and those that're byte-identical to the zero
+ * page or to another such page are merged into it under copy-on-write.
+ * merge_sums has each frame's content hash as of its last visit, and
+ * merge_table has the frames that may be merged into by those hashes for the
+ * duration of one pass. both are under vm_lock. MADV_MERGEABLE has a range
+ * visited right away, taking its pages as cold; see merge_range().
+ */
+#define MERGE_INTERVAL_MS 100
+static int merge_batch = 0;
+static uint32_t *merge_sums = NULL;
+static struct htable merge_table = HTABLE_INITIALIZER(
+	merge_table, &hash_pp_by_sum, NULL);
+static thrd_t merge_thrd;
+
+/* frames released by merging, and merged pages that were since written. */
+static unsigned long n_merged = 0, n_unmerged = 0;
+
+/* frames lent to sysmem under its memory pressure, and how many there are.
+ * those that sysmem has since returned stay here as PL_RETURNED until
+ * reclaim_loans() gets to them under vm_lock. see balloon_thread_fn().
+ */
+static struct nbsl page_loan_list = NBSL_LIST_INIT(page_loan_list);
+static _Atomic unsigned long n_loaned_pages = 0, n_returned_pages = 0;
+static thrd_t balloon_thrd;
+
+/* the frame offered to sysmem with BALLOON_OFFER. it stays here until
+ * BALLOON_TAKE moves it to page_loan_list, or until it's gone untaken for
+ * BALLOON_OFFER_MS and goes back to page_free_list.
+ */
+#define BALLOON_OFFER_MS 200
+static struct nbsl page_offer_list = NBSL_LIST_INIT(page_offer_list);
+
+/* free large frames by their first page, and how many there are. these get
+ * broken up into page_free_list on demand; see break_large_frame().
+ */
+static struct nbsl large_free_list = NBSL_LIST_INIT(large_free_list);
+static _Atomic unsigned long n_large_free = 0;
+
 /* multiset of vp by physical address when that physical page has been
  * referenced from more than one vp. a physical page's primary reference
  * (pp->owner) is always omitted, and may be NULL if it was removed before all
@@ -273,27 +537,185 @@ static struct htable share_table = HTABLE_INITIALIZER(
 static struct htable anon_mmap_table = HTABLE_INITIALIZER(
 	anon_mmap_table, &hash_lazy_mmap_by_ino, NULL);
 
-/* pagecache. */
-static uint32_t pc_salt[4];	/* init-once salt for hash_cached_page() */
-static struct nbsl *pc_buckets = NULL;
+/* mapped files, and those whose last reference went away but that're yet to
+ * have their handles closed; see put_mfile().
+ */
+static struct htable file_table = HTABLE_INITIALIZER(
+	file_table, &hash_mfile, NULL);
+static struct mfile *_Atomic dead_files = NULL;
+
+/* pagecache. pc_buckets is doubled once there are more than PC_MAX_LOAD
+ * links per bucket. links move over from the previous array, pc_old, a few
+ * buckets at a time in push_cached_page() so that no one fault pays for the
+ * whole rehash; buckets of pc_old below pc_moved have been emptied into
+ * pc_buckets, and the rest are still looked up in place. under vm_lock.
+ */
+#define PC_MAX_LOAD 2
+#define PC_MOVE_BATCH 8
+static uint32_t pc_salt[4];	/* per-boot salt for hash_cached_page() */
+static struct nbsl *pc_buckets = NULL, *pc_old = NULL;
 static unsigned char n_pc_buckets_log2;
+static size_t pc_moved;
+static unsigned long n_cached_pages = 0;
 #define n_pc_buckets (1u << n_pc_buckets_log2)
+#define n_pc_old (n_pc_buckets >> 1)
+
+/* every page cache list, those in pc_old after pc_buckets. */
+#define n_pc_lists (n_pc_buckets + (pc_old != NULL ? n_pc_old : 0))
+static inline struct nbsl *pc_list(size_t i) {
+	return i < n_pc_buckets ? &pc_buckets[i] : &pc_old[i - n_pc_buckets];
+}
+
+/* page cache fills. fill_table has <struct pc_fill> by placeholder page
+ * number and is under vm_lock; fill_queue is those not yet taken up by
+ * fill_thrd, under fill_lock.
+ */
+static struct htable fill_table = HTABLE_INITIALIZER(
+	fill_table, &hash_fill_by_page, NULL);
+static struct pc_fill *fill_queue = NULL, **fill_queue_tail = &fill_queue;
+static mtx_t fill_lock;
+static cnd_t fill_cond;
+static thrd_t fill_thrd;
+
+/* serializes service threads' access to everything in vm besides nbsl lists
+ * and things under their own locks, including the heap. vm_space.lock
+ * protects that space's page table and is taken after vm_lock by changes to
+ * the space, and alone by the fault fast path; so whoever holds vm_lock may
+ * take any number of space locks in any order, since the fast path never
+ * waits while holding one. vps must be removed or have access taken away only
+ * under their space's lock, with the corresponding unmap coming either under
+ * the same lock or after, and fault replies are sent before locks are
+ * released; that way no mapping restored by the fast path outlives its vp.
+ */
+static mtx_t vm_lock;
+
+/* service threads, by pid % n_service_threads. [0] is the main thread. each
+ * is the pager of the processes it serves, so replies to their faults must
+ * come from it; see pager_of().
+ */
+#define MAX_SERVICE_THREADS 8
+static int n_service_threads = 0;	/* 0 for one per processor */
+static L4_ThreadId_t service_tids[MAX_SERVICE_THREADS];
 
 /* no-match for vm_space.last_mmap. */
 static struct lazy_mmap no_last_mmap = { };
 
+/* system-wide fault-around window size, set with --fault-around=n. */
+static int fault_around_log2 = 2;
 
-/* vaddr & ~PAGE_MASK into sp->pages. */
-static size_t hash_vp_by_vaddr(const void *ptr, void *priv) {
-	const struct vp *v = ptr;
-	return int_hash(v->vaddr & ~PAGE_MASK);
+/* released page table leaves, kept for reuse up to MAX_FREE_LEAVES. these are
+ * all-zero past ->next. leaves are released under their space's lock, which
+ * the fault fast path also holds while reading vps, so there's no need to
+ * wait for an epoch to pass before reuse.
+ */
+#define MAX_FREE_LEAVES 16
+static struct vp_leaf *free_leaves = NULL;
+static int n_free_leaves = 0;
+
+
+static struct vp_leaf *alloc_leaf(void)
+{
+	struct vp_leaf *leaf = free_leaves;
+	if(leaf != NULL) {
+		free_leaves = leaf->next;
+		n_free_leaves--;
+		leaf->n_live = 0;
+	} else {
+		leaf = calloc(1, sizeof *leaf);
+	}
+	return leaf;
+}
+
+
+static void free_leaf(struct vp_leaf *leaf)
+{
+	assert(leaf->n_live == 0);
+	if(n_free_leaves >= MAX_FREE_LEAVES) free(leaf);
+	else {
+		leaf->next = free_leaves;
+		free_leaves = leaf;
+		n_free_leaves++;
+	}
+}
+
+
+/* returns the vp covering @addr in @sp, or NULL. */
+static struct vp *vp_get(const struct vm_space *sp, uintptr_t addr)
+{
+	struct vp_leaf *leaf = sp->vpt[addr >> LARGE_BITS];
+	if(leaf == NULL) return NULL;
+	else if(VP_IS_LARGE(&leaf->pages[0])) return &leaf->pages[0];
+	else {
+		struct vp *vp = &leaf->pages[(addr >> PAGE_BITS) & (LARGE_PAGES - 1)];
+		return vp->vaddr != 0 ? vp : NULL;
+	}
+}
+
+
+/* returns the first vp in @sp at or above *@pos and below @end, and moves
+ * *@pos past it; or NULL when there are none left. the caller may remove the
+ * vp before the next call.
+ */
+static struct vp *vp_next(const struct vm_space *sp, uintptr_t *pos, uintptr_t end)
+{
+	while(*pos < end) {
+		uintptr_t next;
+		struct vp_leaf *leaf = sp->vpt[*pos >> LARGE_BITS];
+		if(leaf == NULL) next = (*pos | LARGE_MASK) + 1;
+		else {
+			struct vp *vp = &leaf->pages[(*pos >> PAGE_BITS) & (LARGE_PAGES - 1)];
+			next = VP_IS_LARGE(vp) ? *pos + LARGE_SIZE : *pos + PAGE_SIZE;
+			if(vp->vaddr != 0) {
+				*pos = next < *pos ? end : next;
+				return vp;
+			}
+		}
+		*pos = next < *pos ? end : next;
+	}
+	return NULL;
+}
+
+
+/* returns an unused vp for @addr in @sp, or NULL when out of memory. the
+ * caller fills it in, keeping ->vaddr and ->pid as they were.
+ */
+static struct vp *vp_new(struct vm_space *sp, uintptr_t addr)
+{
+	assert(addr != 0 && (addr & PAGE_MASK) == 0);
+	struct vp_leaf **leafp = &sp->vpt[addr >> LARGE_BITS];
+	if(*leafp == NULL && (*leafp = alloc_leaf()) == NULL) return NULL;
+	struct vp *vp = &(*leafp)->pages[(addr >> PAGE_BITS) & (LARGE_PAGES - 1)];
+	assert(vp->vaddr == 0);
+	(*leafp)->n_live++;
+	*vp = (struct vp){ .vaddr = addr, .pid = ra_ptr2id(vm_space_ra, sp) };
+	return vp;
+}
+
+
+/* vp_new() in reverse. */
+static void vp_del(struct vp *vp)
+{
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, vp->pid);
+	struct vp_leaf **leafp = &sp->vpt[vp->vaddr >> LARGE_BITS];
+	assert(vp >= (*leafp)->pages && vp < (*leafp)->pages + LARGE_PAGES);
+	*vp = (struct vp){ };
+	if(--(*leafp)->n_live == 0) {
+		free_leaf(*leafp);
+		*leafp = NULL;
+	}
+}
+
+
+/* takes vm_lock and then @sp's lock for a request that changes @sp. */
+static void lock_space(struct vm_space *sp) {
+	mtx_lock(&vm_lock);
+	mtx_lock(&sp->lock);
 }
 
-static bool cmp_vp_to_vaddr(const void *cand, void *key) {
-	const struct vp *v = cand;
-	L4_Word_t *k = key;
-	assert((*k & PAGE_MASK) == 0);
-	return (v->vaddr & ~PAGE_MASK) == *k;
+
+static void unlock_space(struct vm_space *sp) {
+	mtx_unlock(&sp->lock);
+	mtx_unlock(&vm_lock);
 }
 
 
@@ -314,6 +736,31 @@ static size_t hash_lazy_mmap_by_ino(const void *ptr, void *priv) {
 }
 
 
+/* by filesystem and identity in file_table. */
+static size_t hash_mfile(const void *ptr, void *priv) {
+	const struct mfile *f = ptr;
+	return int_hash(f->ino & 0xffffffff)
+		^ int_hash((f->ino >> 32) ^ pidof_NP(f->fs) << 16);
+}
+
+static bool cmp_mfile(const void *cand, void *key) {
+	const struct mfile *a = cand, *b = key;
+	return a->ino == b->ino && a->fs.raw == b->fs.raw;
+}
+
+
+/* by placeholder's page number in fill_table. */
+static size_t hash_fill_by_page(const void *ptr, void *priv) {
+	const struct pc_fill *fill = ptr;
+	return int_hash(fill->link->page_num);
+}
+
+static bool cmp_fill_to_page(const void *cand, void *key) {
+	const struct pc_fill *fill = cand;
+	return fill->link->page_num == *(uint32_t *)key;
+}
+
+
 /* FIXME: this should assert that the pp's link field points to @link. a
  * conditional version can return NULL if it doesn't (i.e. to spot when the
  * physical page's ownership was contested, and the caller lost.)
@@ -330,6 +777,12 @@ static struct pp *get_pp(uint32_t page_num) {
 }
 
 
+/* by content hash as of the last visit, in merge_table. */
+static size_t hash_pp_by_sum(const void *ptr, void *priv) {
+	return merge_sums[ra_ptr2id(pp_ra, ptr)];
+}
+
+
 /* counts the number of occurrences of @page_num in share_table, returning
  * true if it's at least @count and false otherwise. @hash is
  * int_hash(@page_num), likely computed elsewhere already.
@@ -400,6 +853,9 @@ static bool vp_invariants(INVCTX_ARG,
 	struct vp *virt, struct pp *phys, struct pl *link)
 {
 	inv_iff1(virt->status == 0, phys == NULL);
+	inv_imply1(VP_IS_LARGE(virt), VP_IS_ANON(virt) && !VP_IS_SHARED(virt)
+		&& !VP_IS_COW(virt));
+	inv_imply1(VP_IS_LARGE(virt), (virt->vaddr & ~PAGE_MASK & LARGE_MASK) == 0);
 
 	if(phys != NULL) {
 		/* @virt is resident. */
@@ -435,25 +891,86 @@ static bool all_space_invariants(INVCTX_ARG,
 		inv_push("sp=%d, brk=%#x", ra_ptr2id(vm_space_ra, sp), sp->brk);
 
 		/* (this all could be in a space_invariants(), one day.) */
-		struct htable_iter vpit;
-		for(const struct vp *vp = htable_first(&sp->pages, &vpit);
-			vp != NULL; vp = htable_next(&sp->pages, &vpit))
+		for(int i=0; i < VPT_SIZE; i++) {
+			const struct vp_leaf *leaf = sp->vpt[i];
+			if(leaf == NULL) continue;
+			inv_push("leaf %d: ->n_live=%u", i, leaf->n_live);
+			unsigned n_live = 0;
+			for(int j=0; j < LARGE_PAGES; j++) {
+				const struct vp *vp = &leaf->pages[j];
+				if(vp->vaddr == 0) continue;
+				n_live++;
+				inv_ok1((vp->vaddr & ~PAGE_MASK)
+					== ((uintptr_t)i << LARGE_BITS | (uintptr_t)j << PAGE_BITS));
+				inv_ok1(vp->pid == ra_ptr2id(vm_space_ra, sp));
+				inv_imply1(VP_IS_LARGE(vp), j == 0);
+			}
+			inv_ok1(n_live == leaf->n_live);
+			inv_imply1(VP_IS_LARGE(&leaf->pages[0]), n_live == 1);
+			inv_pop();
+		}
+		uintptr_t pos = 0;
+		for(const struct vp *vp = vp_next(sp, &pos, ~0ul);
+			vp != NULL; vp = vp_next(sp, &pos, ~0ul))
 		{
-			/* the vp should be present in all_vps. */
-			inv_ok(bsearch(&vp, all_vps, n_all_vps, sizeof(struct vp *),
-				&cmp_ptrs) != NULL, "vp present in all_vps");
+			/* the vp should be present in all_vps, unless it's one of the
+			 * untracked references to the zero page.
+			 */
+			inv_ok(vp->status == zero_page || VP_IS_SWAPPED(vp)
+				|| bsearch(&vp, all_vps, n_all_vps, sizeof(struct vp *),
+					&cmp_ptrs) != NULL, "vp present in all_vps");
+			inv_imply1(vp->status == zero_page,
+				VP_IS_ANON(vp) && ~VP_RIGHTS(vp) & L4_Writable);
+			/* swapped pages are private anonymous memory in a live half of
+			 * a swap frame.
+			 */
+			inv_imply1(VP_IS_SWAPPED(vp), VP_IS_ANON(vp) && !VP_IS_COW(vp)
+				&& !VP_IS_SHARED(vp) && !VP_IS_LARGE(vp));
+			inv_imply1(VP_IS_SWAPPED(vp),
+				swap_hdr_of(vp->status)->len[SWAP_HALF(vp->status)] > 0);
 
 			uintptr_t vaddr = vp->vaddr & ~PAGE_MASK;
 			inv_log("vaddr=%#x", vaddr);
 			/* should lay within a lazy_mmap. */
 			inv_ok(find_lazy_mmap(sp, vaddr) != NULL,
 				"vp->vaddr within lazy_mmap");
+			if(VP_IS_LARGE(vp)) {
+				/* ... entirely. */
+				const struct lazy_mmap *mm = find_lazy_mmap(sp, vaddr);
+				inv_ok1(mm->addr + mm->length - vaddr >= LARGE_SIZE);
+			}
 		}
 
 		RB_FOREACH(rb_iter, &sp->maps) {
 			struct lazy_mmap *mm = rb_entry(rb_iter, struct lazy_mmap, rb);
 			inv_push("lazy_mmap addr=%#x length=%#x", mm->addr, mm->length);
 			inv_ok1(mm->tailsz <= PAGE_SIZE);
+			inv_ok1(mm->file == NULL || mm->file->refs > 0);
+			inv_ok1(mm->file == NULL || mm->file->ino == mm->ino);
+			inv_pop();
+		}
+
+		/* free address space is above mmap_bot, coalesced, clear of lazy
+		 * mmaps, and augmented correctly.
+		 */
+		uintptr_t prev_end = sp->mmap_bot + 1;
+		RB_FOREACH(rb_iter, &sp->as_free) {
+			struct as_free *f = rb_entry(rb_iter, struct as_free, rb);
+			inv_push("as_free addr=%#x length=%#x", f->addr, f->length);
+			inv_ok1(f->length > 0 && ((f->addr | f->length) & PAGE_MASK) == 0);
+			inv_ok1(f->addr > prev_end);
+			inv_ok1(first_lazy_mmap(sp, f->addr, f->length) == NULL);
+			size_t max_length = f->length;
+			if(rb_iter->rb_left != NULL) {
+				max_length = max(max_length, rb_entry(rb_iter->rb_left,
+					struct as_free, rb)->max_length);
+			}
+			if(rb_iter->rb_right != NULL) {
+				max_length = max(max_length, rb_entry(rb_iter->rb_right,
+					struct as_free, rb)->max_length);
+			}
+			inv_ok1(f->max_length == max_length);
+			prev_end = f->addr + f->length;
 			inv_pop();
 		}
 
@@ -569,8 +1086,8 @@ static bool pc_invariants(INVCTX_ARG,
 	qsort(vps, n_all_vps, sizeof *vps, &cmp_vp_by_status);
 	inv_ok1(n_all_vps < 2 || vps[0]->status <= vps[1]->status);
 
-	for(int i=0; i < n_pc_buckets; i++) {
-		struct nbsl *list = &pc_buckets[i];
+	for(int i=0; i < n_pc_lists; i++) {
+		struct nbsl *list = pc_list(i);
 		struct nbsl_iter it;
 		for(struct nbsl_node *cur = nbsl_first(list, &it);
 			cur != NULL;
@@ -641,12 +1158,17 @@ static bool invariants(void)
 	 */
 	bitmap *phys_seen = bitmap_alloc0(pp_total);
 	darray(struct vp *) all_vps = darray_new();
-	for(int i=0; i < 2 + (pc_buckets != NULL ? n_pc_buckets : 0); i++) {
+	unsigned long n_frames_seen = 0;
+	for(int i=0; i < 6 + (pc_buckets != NULL ? n_pc_lists : 0); i++) {
 		struct nbsl *list;
 		switch(i) {
 			case 0: list = &page_free_list; break;
 			case 1: list = &page_active_list; break;
-			default: list = &pc_buckets[i - 2]; break;
+			case 2: list = &large_free_list; break;
+			case 3: list = &swap_frame_list; break;
+			case 4: list = &page_loan_list; break;
+			case 5: list = &page_offer_list; break;
+			default: list = pc_list(i - 6); break;
 		}
 		inv_push("list=%p (i=%d)", list, i);
 		struct nbsl_iter it;
@@ -661,15 +1183,35 @@ static bool invariants(void)
 			inv_ok1(phys->link == link);
 
 			inv_ok1(link->page_num >= pp_first);
+			bool large = atomic_load(&link->status) & PL_LARGE;
+			inv_iff1(list == &large_free_list, large && phys->owner == NULL);
+			inv_imply1(large, list == &large_free_list
+				|| list == &page_active_list);
+			inv_imply1(large, link->page_num % LARGE_PAGES == 0);
 			size_t pgix = link->page_num - pp_first;
-			inv_ok1(!bitmap_test_bit(phys_seen, pgix));
-			bitmap_set_bit(phys_seen, pgix);
+			for(int j=0; j < (large ? LARGE_PAGES : 1); j++) {
+				inv_ok1(!bitmap_test_bit(phys_seen, pgix + j));
+				inv_imply1(j > 0, get_pp(link->page_num + j)->link == NULL);
+				bitmap_set_bit(phys_seen, pgix + j);
+			}
 
 			/* physical page ownership. */
 			inv_imply1(list == &page_free_list, phys->owner == NULL);
+			inv_imply1(list == &swap_frame_list, phys->owner == NULL);
+			inv_imply1(list == &page_loan_list, phys->owner == NULL);
+			inv_imply1(list == &page_offer_list, phys->owner == NULL);
+			inv_imply1(PL_STATE(atomic_load(&link->status)) == PL_RETURNED,
+				list == &page_loan_list);
+			if(list == &swap_frame_list) n_frames_seen++;
+			inv_imply1(large && phys->owner != NULL,
+				VP_IS_LARGE(phys->owner));
 			size_t pnhash = int_hash(link->page_num);
 			inv_imply1(list == &page_active_list,
-				phys->owner != NULL || has_shares(pnhash, link->page_num, 1));
+				phys->owner != NULL || has_shares(pnhash, link->page_num, 1)
+					|| link->page_num == zero_page);
+			inv_imply1(link->page_num == zero_page,
+				list == &page_active_list && phys->owner == NULL
+					&& !has_shares(pnhash, link->page_num, 1));
 
 			/* checks on and collection of virtual memory pages, per phys
 			 * tracking.
@@ -693,6 +1235,7 @@ static bool invariants(void)
 	}
 	inv_ok(bitmap_full(phys_seen, pp_total),
 		"pp_total=%u pp seen", (unsigned)pp_total);
+	inv_ok1(n_frames_seen == n_swap_frames);
 
 	/* sort all_vps and check that each occurs just once. */
 	qsort(all_vps.item, all_vps.size, sizeof(void *), &cmp_ptrs);
@@ -736,6 +1279,22 @@ static void push_page(struct nbsl *list, struct pl *oldlink)
 	do {
 		top = nbsl_top(list);
 	} while(!nbsl_push(list, top, &nl->nn));
+	if(list == &page_free_list) {
+		atomic_fetch_add_explicit(&n_free_pages, 1, memory_order_relaxed);
+	}
+}
+
+
+/* as push_page(), but for the first page of a large frame. */
+static void push_large_page(struct nbsl *list, struct pl *oldlink)
+{
+	push_page(list, oldlink);
+	struct pl *nl = atomic_load_explicit(&pl2pp(oldlink)->link,
+		memory_order_relaxed);
+	atomic_store_explicit(&nl->status, 1 | PL_LARGE, memory_order_relaxed);
+	if(list == &large_free_list) {
+		atomic_fetch_add_explicit(&n_large_free, 1, memory_order_relaxed);
+	}
 }
 
 
@@ -756,23 +1315,84 @@ static size_t hash_lazy_mmap(const struct lazy_mmap *mm, int bump)
 }
 
 
-/* insert copy of @oldlink under @lookup_top, or find an existing link, but
- * either way stash it in *@cached_p.
+static struct nbsl *pc_bucket(size_t hash)
+{
+	if(pc_old != NULL && (hash & (n_pc_old - 1)) >= pc_moved) {
+		return &pc_old[hash & (n_pc_old - 1)];
+	}
+	return &pc_buckets[hash & (n_pc_buckets - 1)];
+}
+
+
+static size_t hash_link(const struct pl *link) {
+	return hash_cached_page(link->offset,
+		link->fsid_ino >> 32, link->fsid_ino & 0xffffffffu);
+}
+
+
+static struct nbsl *pc_bucket_of(const struct pl *link) {
+	return pc_bucket(hash_link(link));
+}
+
+
+/* moves the links of up to @n buckets of pc_old into pc_buckets, and
+ * releases pc_old once it's empty. order within a bucket is of no
+ * consequence. nodes are moved as they are rather than copied, since
+ * <struct pc_fill> refers to its placeholder by address; that's fine under
+ * vm_lock, as nothing else walks the page cache.
+ */
+static void move_pc_buckets(int n)
+{
+	assert(pc_old != NULL);
+	for(; n > 0 && pc_moved < n_pc_old; n--, pc_moved++) {
+		struct nbsl_node *nod;
+		while(nod = nbsl_pop(&pc_old[pc_moved]), nod != NULL) {
+			struct pl *link = container_of(nod, struct pl, nn);
+			struct nbsl *list = &pc_buckets[hash_link(link) & (n_pc_buckets - 1)];
+			struct nbsl_node *top;
+			do {
+				top = nbsl_top(list);
+			} while(!nbsl_push(list, top, nod));
+		}
+	}
+	if(pc_moved == n_pc_old) {
+		free(pc_old);
+		pc_old = NULL;
+	}
+}
+
+
+/* doubles pc_buckets once the previous resize has completed. links stay where
+ * they are until move_pc_buckets() gets to them.
+ */
+static void grow_pc(void)
+{
+	if(pc_old != NULL) return;
+	struct nbsl *nb = malloc(sizeof *nb * n_pc_buckets * 2);
+	if(nb == NULL) return;	/* try again next time */
+	for(int i=0; i < n_pc_buckets * 2; i++) nbsl_init(&nb[i]);
+	pc_old = pc_buckets;
+	pc_buckets = nb;
+	n_pc_buckets_log2++;
+	pc_moved = 0;
+}
+
+
+/* insert copy of @oldlink under @lookup_top with the given @status, or find
+ * an existing link, but either way stash it in *@cached_p.
  *
  * TODO: recycle the hash value from find_cached_page() as well.
  */
 static int push_cached_page(
 	struct pl **cached_p,
-	struct nbsl_node *lookup_top, const struct pl *oldlink)
+	struct nbsl_node *lookup_top, const struct pl *oldlink, uint32_t status)
 {
-	size_t hash = hash_cached_page(oldlink->offset,
-		oldlink->fsid_ino >> 32, oldlink->fsid_ino & 0xffffffffu);
-	struct nbsl *list = &pc_buckets[hash & (n_pc_buckets - 1)];
+	struct nbsl *list = pc_bucket_of(oldlink);
 
 	struct pl *nl = malloc(sizeof *nl);
 	if(nl == NULL) return -ENOMEM;
 	*nl = *oldlink;
-	atomic_store_explicit(&nl->status, 1, memory_order_relaxed);
+	atomic_store_explicit(&nl->status, status, memory_order_relaxed);
 	do {
 		struct nbsl_node *top = nbsl_top(list);
 		if(lookup_top != top) {
@@ -798,6 +1418,9 @@ static int push_cached_page(
 	atomic_store(&pl2pp(oldlink)->link, nl);
 	*cached_p = nl;
 
+	if(++n_cached_pages > (unsigned long)n_pc_buckets * PC_MAX_LOAD) grow_pc();
+	if(pc_old != NULL) move_pc_buckets(PC_MOVE_BATCH);
+
 	return 0;
 }
 
@@ -808,8 +1431,7 @@ static struct pl *find_cached_page(
 {
 	assert(top_p != NULL);
 
-	size_t hash = hash_lazy_mmap(mm, bump);
-	struct nbsl *bucket = &pc_buckets[hash & (n_pc_buckets - 1)];
+	struct nbsl *bucket = pc_bucket(hash_lazy_mmap(mm, bump));
 	struct nbsl_iter it;
 	for(struct nbsl_node *cur = *top_p = nbsl_first(bucket, &it);
 		cur != NULL;
@@ -830,15 +1452,71 @@ static struct pl *find_cached_page(
 }
 
 
-/* dequeues one link from page_free_list and returns it. */
+/* breaks one free large frame up into small pages on page_free_list.
+ * returns false if there were none left.
+ */
+static bool break_large_frame(void)
+{
+	assert(e_inside());
+	struct nbsl_node *nod = nbsl_pop(&large_free_list);
+	if(nod == NULL) return false;
+	atomic_fetch_sub_explicit(&n_large_free, 1, memory_order_relaxed);
+
+	struct pl *head = container_of(nod, struct pl, nn);
+	for(int i=1; i < LARGE_PAGES; i++) {
+		assert(get_pp(head->page_num + i)->link == NULL);
+		push_page(&page_free_list, &(struct pl){ .page_num = head->page_num + i });
+	}
+	push_page(&page_free_list, head);
+	e_free(head);
+	return true;
+}
+
+
+/* dequeues one link from page_free_list and returns it, or NULL when there
+ * are none left. callers back out with -ENOMEM, and the fault path runs page
+ * replacement before it tries again; see serve_fault_locked().
+ */
 static struct pl *get_free_pl(void)
 {
 	struct nbsl_node *nod = nbsl_pop(&page_free_list);
-	if(nod == NULL) {
-		printf("%s: out of memory!\n", __func__);
-		abort();
+	if(nod == NULL && break_large_frame()) nod = nbsl_pop(&page_free_list);
+	if(nod == NULL) return NULL;
+	atomic_fetch_sub_explicit(&n_free_pages, 1, memory_order_relaxed);
+
+	return container_of(nod, struct pl, nn);
+}
+
+
+/* as get_free_pl(), but for speculative allocation: returns NULL instead of
+ * digging into the reserve under the low watermark.
+ */
+static struct pl *try_get_free_pl(void)
+{
+	if(atomic_load_explicit(&n_free_pages, memory_order_relaxed) < free_low_wm) {
+		return NULL;
+	}
+	return get_free_pl();
+}
+
+
+/* returns the first page of a free large frame for an anonymous fault at
+ * @faddr in @mm, or NULL when the enclosing block isn't entirely within @mm,
+ * has pages in it already, or no large frames are left.
+ */
+static struct pl *try_get_large_pl(
+	const struct vm_space *sp, const struct lazy_mmap *mm, L4_Word_t faddr)
+{
+	uintptr_t base = faddr & ~LARGE_MASK;
+	if(base < mm->addr || mm->addr + mm->length - base < LARGE_SIZE
+		|| sp->vpt[base >> LARGE_BITS] != NULL)
+	{
+		return NULL;
 	}
 
+	struct nbsl_node *nod = nbsl_pop(&large_free_list);
+	if(nod == NULL) return NULL;
+	atomic_fetch_sub_explicit(&n_large_free, 1, memory_order_relaxed);
 	return container_of(nod, struct pl, nn);
 }
 
@@ -906,21 +1584,100 @@ static struct lazy_mmap *first_lazy_mmap(
 		else if(addr >= cand->addr + cand->length) n = n->rb_right;
 		else return cand;
 	}
-	/* >> */
-	while(cand != NULL && addr + sz <= cand->addr) {
+	/* the search ended next to @addr on either side. >> */
+	if(cand != NULL && addr >= cand->addr + cand->length) {
 		cand = container_of_or_null(__rb_next(&cand->rb),
 			struct lazy_mmap, rb);
 	}
-	/* << */
-	while(cand != NULL && addr >= cand->addr + cand->length) {
-		cand = container_of_or_null(__rb_prev(&cand->rb),
-			struct lazy_mmap, rb);
-	}
+	if(cand != NULL && addr + sz <= cand->addr) cand = NULL;
 	/* \o/ */
 	return cand;
 }
 
 
+/* finds the mapped file @ino on @fs and adds a reference to it, or creates
+ * one around vm's handle @fd. when the file was already mapped, its ->fd is
+ * not @fd and the caller should close @fd once it's released vm_lock.
+ * returns NULL when out of memory.
+ */
+static struct mfile *get_mfile(L4_ThreadId_t fs, uint64_t ino, int fd)
+{
+	struct mfile key = { .fs = fs, .ino = ino },
+		*f = htable_get(&file_table, hash_mfile(&key, NULL), &cmp_mfile, &key);
+	if(f != NULL) {
+		f->refs++;
+		return f;
+	}
+	f = malloc(sizeof *f);
+	if(f == NULL) return NULL;
+	*f = (struct mfile){ .fs = fs, .ino = ino, .fd = fd, .refs = 1 };
+	if(!htable_add(&file_table, hash_mfile(f, NULL), f)) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+
+/* drops a reference to @f. the last one takes it out of file_table and onto
+ * dead_files, whose handles are closed by close_dead_files() outside of
+ * vm_lock since the filesystem may be waiting on vm meanwhile.
+ */
+static void put_mfile(struct mfile *f)
+{
+	assert(f->refs > 0);
+	if(--f->refs > 0) return;
+	bool ok = htable_del(&file_table, hash_mfile(f, NULL), f);
+	assert(ok);
+	f->next = atomic_load_explicit(&dead_files, memory_order_relaxed);
+	atomic_store_explicit(&dead_files, f, memory_order_release);
+}
+
+
+/* drops the reference that get_mfile() took for an mmap(2) that then failed.
+ * when @f was created around the caller's handle @fd, it goes away without
+ * closing that, since the handle stays with the caller on failure.
+ */
+static void unget_mfile(struct mfile *f, int fd)
+{
+	if(f->fd != fd) {
+		put_mfile(f);
+		return;
+	}
+	assert(f->refs == 1);
+	bool ok = htable_del(&file_table, hash_mfile(f, NULL), f);
+	assert(ok);
+	free(f);
+}
+
+
+/* closes handles of files released by put_mfile(). called without vm_lock. */
+static void close_dead_files(void)
+{
+	if(atomic_load_explicit(&dead_files, memory_order_relaxed) == NULL) {
+		return;
+	}
+	mtx_lock(&vm_lock);
+	struct mfile *list = atomic_exchange(&dead_files, NULL);
+	mtx_unlock(&vm_lock);
+
+	for(struct mfile *f = list; f != NULL; f = f->next) {
+		int n = __io_close(f->fs, f->fd);
+		if(n != 0) {
+			printf("vm:%s: IO/close of fd=%d on %lu:%lu failed, n=%d\n",
+				__func__, f->fd, L4_ThreadNo(f->fs), L4_Version(f->fs), n);
+		}
+	}
+	mtx_lock(&vm_lock);
+	while(list != NULL) {
+		struct mfile *next = list->next;
+		free(list);
+		list = next;
+	}
+	mtx_unlock(&vm_lock);
+}
+
+
 static COLD void init_phys(L4_Fpage_t *phys, int n_phys)
 {
 	size_t p_min = ~0ul, p_max = 0;
@@ -934,38 +1691,60 @@ static COLD void init_phys(L4_Fpage_t *phys, int n_phys)
 		(unsigned long)pp_total, (unsigned long)p_min);
 	pp_first = p_min;
 
+	/* physical memory comes in naturally aligned fpages, so those of at
+	 * least LARGE_SIZE are carved up into large frames. the small page
+	 * freelist is filled from these as required.
+	 */
 	pp_ra = RA_NEW(struct pp, pp_total);
 	for(int i=0; i < n_phys; i++) {
 		int base = L4_Address(phys[i]) >> PAGE_BITS;
 		assert(base > 0);
+		bool large = L4_SizeLog2(phys[i]) >= LARGE_BITS;
+		struct nbsl *list = large ? &large_free_list : &page_free_list;
 		for(int o=0; o < L4_Size(phys[i]) >> PAGE_BITS; o++) {
 			struct pp *pp = ra_alloc(pp_ra, base + o - pp_first);
+			if(large && o % LARGE_PAGES != 0) {
+				atomic_store(&pp->link, NULL);
+				continue;
+			}
 			struct pl *link = malloc(sizeof *link);
-			*link = (struct pl){ .page_num = base + o, .status = 1 };
+			*link = (struct pl){ .page_num = base + o,
+				.status = large ? 1 | PL_LARGE : 1 };
 			atomic_store(&pp->link, link);
 			struct nbsl_node *top;
 			do {
-				top = nbsl_top(&page_free_list);
-			} while(!nbsl_push(&page_free_list, top, &link->nn));
+				top = nbsl_top(list);
+			} while(!nbsl_push(list, top, &link->nn));
 			assert(pl2pp(link) == pp);
 			assert(pp->link == link);
+			if(large) n_large_free++; else n_free_pages++;
 		}
 	}
+
+	/* same as sysmem's for small configurations, and 1/64th and 1/32nd of
+	 * memory for the rest. the low watermark also covers the non-speculative
+	 * allocations made by one fault or call.
+	 */
+	free_low_wm = max_t(unsigned long, 64,
+		(n_free_pages + n_large_free * LARGE_PAGES) / 64);
+	free_high_wm = free_low_wm * 2;
 	printf("vm: physical memory tracking initialized.\n");
 }
 
 
-static COLD void init_pc(const L4_Fpage_t *phys, int n_phys)
+static COLD void init_pc(const L4_Fpage_t *phys, int n_phys,
+	const uint32_t salt[static 4])
 {
 	uint64_t total_pages = 0;
 	for(int i=0; i < n_phys; i++) {
 		total_pages += L4_Size(phys[i]) / PAGE_SIZE;
 	}
 
-	/* pagecache bucket heads cost two words apiece, so we'll allocate one for
-	 * every 12 physical pages -- rounding up to nearest power of two.
+	/* pagecache bucket heads cost two words apiece, so we'll start with one
+	 * for every 64 physical pages -- rounding up to nearest power of two --
+	 * and let push_cached_page() grow them from there.
 	 */
-	n_pc_buckets_log2 = size_to_shift(total_pages / 12);
+	n_pc_buckets_log2 = max(6, size_to_shift(max_t(uint64_t, 1, total_pages / 64)));
 	pc_buckets = malloc(sizeof *pc_buckets * n_pc_buckets);
 	if(pc_buckets == NULL) {
 		printf("vm: can't allocate pagecache buckets???\n");
@@ -973,19 +1752,30 @@ static COLD void init_pc(const L4_Fpage_t *phys, int n_phys)
 	}
 	for(int i=0; i < n_pc_buckets; i++) nbsl_init(&pc_buckets[i]);
 
-	/* TODO: grab these off a random number generator when NDEBUG is defined,
-	 * but use stupid constants otherwise.
+	/* from root's random number generator, so that a hostile workload can't
+	 * aim for the same bucket on purpose.
 	 */
-	pc_salt[0] = 0xdeadbeef;
-	pc_salt[1] = 0xcafebabe;
-	pc_salt[2] = 0xfeedface;
-	pc_salt[3] = 0x12345678;
+	memcpy(pc_salt, salt, sizeof pc_salt);
 
 	printf("vm: page cache initialized with 2**%d (= %u) buckets\n",
 		n_pc_buckets_log2, n_pc_buckets);
 }
 
 
+static COLD void init_zero_page(void)
+{
+	struct pl *link = get_free_pl();
+	if(link == NULL) {
+		printf("vm:%s: out of memory!\n", __func__);
+		abort();
+	}
+	memset((void *)((uintptr_t)link->page_num << PAGE_BITS), '\0', PAGE_SIZE);
+	zero_page = link->page_num;
+	push_page(&page_active_list, link);
+	e_free(link);
+}
+
+
 static inline int prot_to_l4_rights(int prot)
 {
 	int m = (prot & PROT_READ) << 2
@@ -998,41 +1788,304 @@ static inline int prot_to_l4_rights(int prot)
 }
 
 
-static L4_Word_t get_as_free(struct vm_space *sp, size_t length)
-{
-	/* TODO: search through sp->as_free in reverse for a chunk that fits
-	 * @length & carve it up.
-	 */
-	return 0;
+static inline struct as_free *as_free_of(struct rb_node *n) {
+	return n == NULL ? NULL : rb_entry(n, struct as_free, rb);
 }
 
 
-static void remove_vp_range(struct vm_space *sp, size_t addr, size_t size)
+static void augment_as_free(struct rb_node *n, void *priv)
 {
-	assert(e_inside());
-	/* remove virtual pages.
-	 *
-	 * see comment in vm_erase()'s total iteration of @sp->pages. this is also
-	 * not nice, and could be made better in exactly the same ways.
-	 */
-	L4_Fpage_t fps[64];
-	int n_fps = 0;
-	plbuf pls = darray_new();
-	for(size_t pos = addr; pos < addr + size; pos += PAGE_SIZE) {
-		struct vp *v = htable_pop(&sp->pages, int_hash(pos), &cmp_vp_to_vaddr, &pos);
-		if(v == NULL) continue;
+	struct as_free *f = as_free_of(n);
+	f->max_length = f->length;
+	if(n->rb_left != NULL) {
+		f->max_length = max(f->max_length, as_free_of(n->rb_left)->max_length);
+	}
+	if(n->rb_right != NULL) {
+		f->max_length = max(f->max_length, as_free_of(n->rb_right)->max_length);
+	}
+}
 
-		assert(~v->status & 0x80000000);
-		L4_Fpage_t fp = L4_FpageLog2(v->status << PAGE_BITS, PAGE_BITS);
-		L4_Set_Rights(&fp, L4_FullyAccessible);
-		fps[n_fps++] = fp;
-		if(n_fps == ARRAY_SIZE(fps)) {
+
+/* recomputes ->max_length from @f up after its ->length changed. */
+static void update_as_free(struct as_free *f) {
+	for(struct rb_node *n = &f->rb; n != NULL; n = rb_parent(n)) {
+		augment_as_free(n, NULL);
+	}
+}
+
+
+static void insert_as_free(struct vm_space *sp, struct as_free *f)
+{
+	struct rb_node **p = &sp->as_free.rb_node, *parent = NULL;
+	while(*p != NULL) {
+		parent = *p;
+		if(f->addr < as_free_of(parent)->addr) p = &parent->rb_left;
+		else p = &parent->rb_right;
+	}
+	__rb_link_node(&f->rb, parent, p);
+	__rb_insert_color(&f->rb, &sp->as_free);
+	__rb_augment_insert(&f->rb, &augment_as_free, NULL);
+}
+
+
+static void erase_as_free(struct vm_space *sp, struct as_free *f)
+{
+	struct rb_node *deepest = __rb_augment_erase_begin(&f->rb);
+	__rb_erase(&f->rb, &sp->as_free);
+	__rb_augment_erase_end(deepest, &augment_as_free, NULL);
+}
+
+
+/* the first chunk that ends at or above @addr, or NULL. */
+static struct as_free *first_as_free(struct vm_space *sp, uintptr_t addr)
+{
+	struct as_free *best = NULL;
+	struct rb_node *n = sp->as_free.rb_node;
+	while(n != NULL) {
+		struct as_free *f = as_free_of(n);
+		if(f->addr + (f->length - 1) >= addr) {
+			best = f;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return best;
+}
+
+
+/* removes [@addr, @addr + @length) from @sp's free address space, such as
+ * when something's been put there by address.
+ */
+static void take_as(struct vm_space *sp, uintptr_t addr, size_t length)
+{
+	const uintptr_t last = addr + (length - 1);
+	for(struct as_free *f = first_as_free(sp, addr), *next;
+		f != NULL && f->addr <= last; f = next)
+	{
+		next = as_free_of(__rb_next(&f->rb));
+		const uintptr_t f_last = f->addr + (f->length - 1);
+		if(f->addr < addr && f_last > last) {
+			/* from the middle. if there's no memory for the tail, it'll
+			 * merely go unused.
+			 */
+			struct as_free *tail = malloc(sizeof *tail);
+			if(tail != NULL) {
+				*tail = (struct as_free){
+					.addr = last + 1, .length = f_last - last,
+				};
+				insert_as_free(sp, tail);
+			}
+			f->length = addr - f->addr;
+			update_as_free(f);
+			break;
+		} else if(f->addr < addr) {
+			f->length = addr - f->addr;
+			update_as_free(f);
+		} else if(f_last > last) {
+			/* (moving ->addr up doesn't change its place in the tree.) */
+			f->length = f_last - last;
+			f->addr = last + 1;
+			update_as_free(f);
+		} else {
+			erase_as_free(sp, f);
+			free(f);
+		}
+	}
+}
+
+
+/* adds [@addr, @addr + @length) to @sp's free address space, merging it with
+ * neighbouring chunks and with fresh space below mmap_bot. parts at or below
+ * mmap_bot are already free, and utcb, kip, and sysinfo areas never are. when
+ * out of memory the range goes unused.
+ */
+static void release_as(struct vm_space *sp, uintptr_t addr, size_t length)
+{
+	if(length == 0 || addr + (length - 1) <= sp->mmap_bot) return;
+	if(addr <= sp->mmap_bot) {
+		length -= sp->mmap_bot + 1 - addr;
+		addr = sp->mmap_bot + 1;
+	}
+	const L4_Fpage_t nogo[] = { sp->utcb_area, sp->kip_area, sp->sysinfo_area };
+	for(int i=0; i < ARRAY_SIZE(nogo); i++) {
+		if(!RANGE_IN_FPAGE(nogo[i], addr, length)) continue;
+		uintptr_t lo = L4_Address(nogo[i]), hi = lo + L4_Size(nogo[i]);
+		if(lo > addr) release_as(sp, addr, lo - addr);
+		if(hi - 1 < addr + (length - 1)) {
+			release_as(sp, hi, addr + length - hi);
+		}
+		return;
+	}
+
+	/* absorb overlapping and adjacent chunks. */
+	uintptr_t last = addr + (length - 1);
+	for(struct as_free *f = first_as_free(sp, addr - 1), *next;
+		f != NULL && f->addr <= last + 1; f = next)
+	{
+		next = as_free_of(__rb_next(&f->rb));
+		last = max(last, f->addr + (f->length - 1));
+		addr = min(addr, f->addr);
+		erase_as_free(sp, f);
+		free(f);
+	}
+	if(addr == sp->mmap_bot + 1) {
+		sp->mmap_bot = last;
+		return;
+	}
+	struct as_free *f = malloc(sizeof *f);
+	if(f == NULL) return;
+	*f = (struct as_free){ .addr = addr, .length = last - addr + 1 };
+	insert_as_free(sp, f);
+}
+
+
+/* the highest-addressed chunk in @n's subtree with at least @length bytes. */
+static struct as_free *as_free_fit_high(struct rb_node *n, size_t length)
+{
+	while(n != NULL && as_free_of(n)->max_length >= length) {
+		if(n->rb_right != NULL && as_free_of(n->rb_right)->max_length >= length) {
+			n = n->rb_right;
+		} else if(as_free_of(n)->length >= length) {
+			return as_free_of(n);
+		} else {
+			n = n->rb_left;
+		}
+	}
+	return NULL;
+}
+
+
+/* the lowest-addressed chunk in @n's subtree with at least @length bytes at
+ * or above @hint.
+ */
+static struct as_free *as_free_fit_above(
+	struct rb_node *n, uintptr_t hint, size_t length)
+{
+	if(n == NULL || as_free_of(n)->max_length < length) return NULL;
+	struct as_free *f = as_free_of(n), *found;
+	uintptr_t f_last = f->addr + (f->length - 1);
+	if(f_last < hint) return as_free_fit_above(n->rb_right, hint, length);
+	if(found = as_free_fit_above(n->rb_left, hint, length), found != NULL) {
+		return found;
+	}
+	if(f_last - max(f->addr, hint) + 1 >= length) return f;
+	return as_free_fit_above(n->rb_right, hint, length);
+}
+
+
+/* physical memory referenced by @v. */
+static L4_Fpage_t vp_fpage(const struct vp *v)
+{
+	assert(~v->status & 0x80000000);
+	return L4_FpageLog2((uintptr_t)v->status << PAGE_BITS,
+		VP_IS_LARGE(v) ? LARGE_BITS : PAGE_BITS);
+}
+
+
+/* splits the large page @vp into small pages of the same access in the same
+ * page table leaf. its mapping is revoked so that the small pages get faulted
+ * back in one at a time.
+ */
+static void split_large(struct vp *vp)
+{
+	assert(e_inside());
+	assert(VP_IS_LARGE(vp) && !VP_IS_COW(vp));
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, vp->pid);
+	struct vp_leaf *leaf = sp->vpt[vp->vaddr >> LARGE_BITS];
+	assert(vp == &leaf->pages[0] && leaf->n_live == 1);
+
+	L4_Fpage_t fp = vp_fpage(vp);
+	L4_Set_Rights(&fp, L4_FullyAccessible);
+	L4_UnmapFpage(fp);
+
+	plbuf pls = darray_new();
+	vp->vaddr &= ~VPF_LARGE;
+	for(int i=0; i < LARGE_PAGES; i++) {
+		struct vp *v = &leaf->pages[i];
+		if(i > 0) {
+			*v = (struct vp){
+				.vaddr = vp->vaddr + i * PAGE_SIZE,
+				.status = vp->status + i, .age = vp->age, .pid = vp->pid,
+			};
+		}
+		struct pp *phys = get_pp(v->status);
+		if(i == 0) {
+			/* the frame's link goes back on the active list as a small
+			 * page.
+			 */
+			struct pl *link0 = atomic_load(&phys->link);
+			assert(atomic_load(&link0->status) & PL_LARGE);
+			atomic_store_explicit(&link0->status, 0, memory_order_release);
+			push_page(&page_active_list, link0);
+			darray_push(pls, link0);
+		} else {
+			assert(atomic_load(&phys->link) == NULL);
+			push_page(&page_active_list, &(struct pl){ .page_num = v->status });
+		}
+		atomic_store_explicit(&phys->owner, v, memory_order_relaxed);
+	}
+	leaf->n_live = LARGE_PAGES;
+	flush_plbuf(&pls);
+}
+
+
+/* splits the large page that covers @addr in @sp, if any. */
+static void split_large_at(struct vm_space *sp, uintptr_t addr)
+{
+	struct vp *v = vp_get(sp, addr);
+	if(v != NULL && VP_IS_LARGE(v)) split_large(v);
+}
+
+
+static void remove_vp_range(struct vm_space *sp, size_t addr, size_t size)
+{
+	assert(e_inside());
+	/* large pages that're only partly covered get split first. */
+	if(addr & LARGE_MASK) split_large_at(sp, addr);
+	if((addr + size) & LARGE_MASK) split_large_at(sp, addr + size - 1);
+
+	/* remove virtual pages.
+	 *
+	 * see comment in vm_erase()'s total iteration of @sp->vpt. this is also
+	 * not nice, and could be made better in exactly the same ways.
+	 */
+	L4_Fpage_t fps[64];
+	int n_fps = 0;
+	bool zero = false;
+	plbuf pls = darray_new();
+	uintptr_t pos = addr;
+	for(struct vp *v = vp_next(sp, &pos, addr + size);
+		v != NULL; v = vp_next(sp, &pos, addr + size))
+	{
+		if(v->status == zero_page) {
+			/* revoked just the once, below. */
+			zero = true;
+			remove_vp(v, &pls);
+			continue;
+		} else if(VP_IS_SWAPPED(v)) {
+			/* not mapped. */
+			remove_vp(v, &pls);
+			continue;
+		}
+		L4_Fpage_t fp = vp_fpage(v);
+		L4_Set_Rights(&fp, L4_FullyAccessible);
+		fps[n_fps++] = fp;
+		if(n_fps == ARRAY_SIZE(fps)) {
 			L4_UnmapFpages(ARRAY_SIZE(fps), fps);
 			n_fps = 0;
 		}
 
 		remove_vp(v, &pls);
 	}
+	if(zero) {
+		if(n_fps == ARRAY_SIZE(fps)) {
+			L4_UnmapFpages(n_fps, fps);
+			n_fps = 0;
+		}
+		fps[n_fps] = L4_FpageLog2((uintptr_t)zero_page << PAGE_BITS, PAGE_BITS);
+		L4_Set_Rights(&fps[n_fps++], L4_FullyAccessible);
+	}
 	if(n_fps > 0) L4_UnmapFpages(n_fps, fps);
 	flush_plbuf(&pls);
 }
@@ -1115,6 +2168,7 @@ static void munmap_space(struct vm_space *sp, L4_Word_t addr, size_t size)
 						__func__, cur);
 				}
 			}
+			if(cur->file != NULL) put_mfile(cur->file);
 			__rb_erase(&cur->rb, &sp->maps);
 			if(sp->last_mmap == cur) sp->last_mmap = &no_last_mmap;
 			e_free(cur);
@@ -1123,7 +2177,8 @@ static void munmap_space(struct vm_space *sp, L4_Word_t addr, size_t size)
 			/* the other way around; shorten and add fragment for tail. */
 			struct lazy_mmap *tail = malloc(sizeof *tail);
 			if(tail == NULL) goto Enomem;
-			*tail = *cur;	/* TODO: duplicate fds? */
+			*tail = *cur;
+			if(tail->file != NULL) tail->file->refs++;
 			tail->addr = addr + size;
 			tail->length = cur->length - (tail->addr - cur->addr);
 			tail->tailsz = cur->tailsz;
@@ -1158,6 +2213,7 @@ static void munmap_space(struct vm_space *sp, L4_Word_t addr, size_t size)
 	}
 
 	assert(first_lazy_mmap(sp, addr, size) == NULL);
+	release_as(sp, addr, size);
 	return;
 
 Enomem:
@@ -1170,6 +2226,90 @@ Enomem:
 }
 
 
+/* whether [address, address + length) overlaps the areas in @sp that mmaps
+ * may not cover.
+ */
+static bool in_nogo(const struct vm_space *sp, L4_Word_t address, size_t length)
+{
+	/* NOTE: instead of checking these for every mmap, we could allow
+	 * lazy_mmaps over sip, kip, and utcb but render them ineffective in
+	 * vm_pf() (and therefore vm_munmap()). this saves us a _NP return
+	 * from mmap(2).
+	 */
+	const L4_Fpage_t nogo[] = { sp->utcb_area, sp->kip_area, sp->sysinfo_area,
+		L4_FpageLog2(sp->brk - PAGE_SIZE, PAGE_BITS),
+		L4_FpageLog2(0, PAGE_BITS) /* unused vps have ->vaddr == 0 */ };
+	for(int i=0; i < ARRAY_SIZE(nogo); i++) {
+		if(RANGE_IN_FPAGE(nogo[i], address, length)) return true;
+	}
+	return false;
+}
+
+
+/* carves @length bytes off the top of @sp's fresh address space, stepping
+ * over maps put there by address, and utcb, kip, and sysinfo areas. what's
+ * stepped over goes into as_free. returns 0 when there's not enough left
+ * above brk.
+ */
+static L4_Word_t carve_as(struct vm_space *sp, size_t length)
+{
+	const uintptr_t floor = max_t(uintptr_t, sp->brk, PAGE_SIZE);
+	while(sp->mmap_bot >= floor + length - 1) {
+		/* mm, delicious. */
+		L4_Word_t address = sp->mmap_bot - length + 1;
+		/* lowest start of anything in the way, or mmap_bot + 1 for none. */
+		const uintptr_t clear = sp->mmap_bot + 1;
+		uintptr_t below = clear;
+		struct lazy_mmap *mm = first_lazy_mmap(sp, address, length);
+		if(mm != NULL) below = mm->addr;
+		const L4_Fpage_t nogo[] = {
+			sp->utcb_area, sp->kip_area, sp->sysinfo_area,
+		};
+		for(int i=0; i < ARRAY_SIZE(nogo); i++) {
+			if(RANGE_IN_FPAGE(nogo[i], address, length)) {
+				below = min_t(uintptr_t, below, L4_Address(nogo[i]));
+			}
+		}
+		if(below == clear) {
+			sp->mmap_bot -= length;
+			return address;
+		}
+
+		/* skip down past the obstacle, leaving what's free above it. */
+		L4_Word_t old_bot = sp->mmap_bot;
+		sp->mmap_bot = below - 1;
+		for(uintptr_t pos = below; pos <= old_bot; ) {
+			mm = first_lazy_mmap(sp, pos, old_bot - pos + 1);
+			uintptr_t end = mm == NULL ? old_bot + 1 : max(pos, mm->addr);
+			if(end > pos) release_as(sp, pos, end - pos);
+			if(mm == NULL) break;
+			pos = mm->addr + mm->length;
+		}
+	}
+	return 0;
+}
+
+
+/* returns the start of @length bytes of unused address space in @sp, the
+ * lowest at or above @hint if there is such, or 0 when there's none. these
+ * come from as_free first, and fresh address space after.
+ */
+static L4_Word_t alloc_as(struct vm_space *sp, size_t length, L4_Word_t hint)
+{
+	struct as_free *f = NULL;
+	L4_Word_t address;
+	if(hint != 0) f = as_free_fit_above(sp->as_free.rb_node, hint, length);
+	if(f != NULL) address = max(f->addr, hint);
+	else {
+		f = as_free_fit_high(sp->as_free.rb_node, length);
+		if(f == NULL) return carve_as(sp, length);
+		address = f->addr + f->length - length;
+	}
+	take_as(sp, address, length);
+	return address;
+}
+
+
 /* TODO: expand existing mmaps even when @fixed is set. */
 static int reserve_mmap(
 	struct lazy_mmap *mm,
@@ -1180,19 +2320,9 @@ static int reserve_mmap(
 	assert((address & PAGE_MASK) == 0);
 	assert(e_inside());	/* for munmap_space() */
 
-	/* NOTE: instead of checking these for every mmap, we could allow
-	 * lazy_mmaps over sip, kip, and utcb but render them ineffective in
-	 * vm_pf() (and therefore vm_munmap()). this saves us a _NP return
-	 * from mmap(2).
-	 */
-	const L4_Fpage_t nogo[] = { sp->utcb_area, sp->kip_area, sp->sysinfo_area,
-		L4_FpageLog2(sp->brk - PAGE_SIZE, PAGE_BITS) };
-	for(int i=0; i < ARRAY_SIZE(nogo); i++) {
-		if(RANGE_IN_FPAGE(nogo[i], address, length)) {
-			/* bad hint. bad! */
-			if(fixed) return -EEXIST; else address = 0;
-			break;
-		}
+	if(in_nogo(sp, address, length)) {
+		/* bad hint. bad! */
+		if(fixed) return -EEXIST; else address = 0;
 	}
 
 	if(IS_ANON_MMAP(mm)) {
@@ -1211,19 +2341,20 @@ static int reserve_mmap(
 			old = insert_lazy_mmap(sp, mm);
 		}
 	} else if(address == 0 || (old = insert_lazy_mmap(sp, mm)) != NULL) {
-		/* TODO: use @address hint to find something "nearby". */
-		address = get_as_free(sp, mm->length);
-		if(address != 0) mm->addr = address;
-		else {
-			/* carve up more fresh address space. mm, delicious. */
-			/* FIXME: avoid utcb, kip, sysinfo */
-			mm->addr = sp->mmap_bot - mm->length + 1;
-			sp->mmap_bot -= mm->length;
+		mm->addr = alloc_as(sp, mm->length, address);
+		if(mm->addr == 0) {
+			if(IS_ANON_MMAP(mm)) {
+				htable_del(&anon_mmap_table,
+					hash_lazy_mmap_by_ino(mm, NULL), mm);
+			}
+			return -ENOMEM;
 		}
 		old = insert_lazy_mmap(sp, mm);
 	}
-
 	assert(old == NULL);
+	/* (a no-op for alloc_as()'s own.) */
+	take_as(sp, mm->addr, mm->length);
+
 	return 0;
 }
 
@@ -1233,8 +2364,6 @@ static int vm_mmap(
 	int prot, int flags,
 	L4_Word_t fd_serv, int fd, off_t offset)
 {
-	assert(invariants());
-
 	if(length == 0) return -EINVAL;
 	if((*addr_ptr | offset) & PAGE_MASK) return -EINVAL;
 	if((flags & MAP_PRIVATE) && (flags & MAP_SHARED)) return -EINVAL;
@@ -1244,38 +2373,63 @@ static int vm_mmap(
 	if(target_pid == 0) target_pid = sender_pid;
 	if(target_pid > SNEKS_MAX_PID || target_pid == 0) return -EINVAL;
 
+	int n, close_fd = -1;
+	uint64_t ino = fd;
+	if((flags & MAP_ANONYMOUS) && (flags & MAP_SHARED)) {
+		/* (error if fd_serv != nil?) */
+		fd_serv = L4_MyGlobalId().raw;
+		ino = atomic_fetch_add(&next_anon_ino, 1);
+		offset = 0;
+	} else if(~flags & MAP_ANONYMOUS) {
+		if(fd_serv == L4_nilthread.raw) return -EBADF;
+		/* touch-a ma spaghetti. (outside vm_lock since filesystems may take
+		 * their time.)
+		 */
+		L4_ThreadId_t fs = { .raw = fd_serv };
+		n = __io_touch(fs, fd);
+		if(n != 0) return n > 0 ? -EIO : n;
+		close_fd = fd;
+		unsigned f_ino, f_gen;
+		n = __fs_identify(fs, &f_ino, &f_gen, fd);
+		if(n == 0) ino = FILE_IDENT(f_ino, f_gen);
+		else ino = HANDLE_IDENT(atomic_fetch_add(&next_anon_ino, 1));
+	}
+
 	/* TODO: validate target_pid to be either userspace caller's PID, or that
 	 * the caller is a systask (and actual sender).
 	 */
+	mtx_lock(&vm_lock);
+	assert(invariants());
 	struct vm_space *sp = ra_id2ptr(vm_space_ra, target_pid);
-	if(sp->kip_area.raw == 0) return -EINVAL;
-
+	if(sp->kip_area.raw == 0) { n = -EINVAL; goto end; }
 	struct lazy_mmap *mm = malloc(sizeof *mm);
-	if(mm == NULL) return -ENOMEM;
-	int n;
-	if((flags & MAP_ANONYMOUS) && (flags & MAP_SHARED)) {
-		/* (error if fd_serv != nil?) */
-		fd_serv = L4_MyGlobalId().raw;
-		fd = atomic_fetch_add(&next_anon_ino, 1);
-		offset = 0;
-	} else if((~flags & MAP_ANONYMOUS) && fd_serv != L4_nilthread.raw) {
-		/* touch-a ma spaghetti */
-		n = __io_touch((L4_ThreadId_t){ .raw = fd_serv }, fd);
-		if(n != 0) {
+	if(mm == NULL) { n = -ENOMEM; goto end; }
+	*mm = (struct lazy_mmap){
+		.flags = prot_to_l4_rights(prot) << 16
+			| (flags & ~(MAP_FIXED | MAP_POPULATE
+				| MAP_FAULTAROUND_MASK << MAP_FAULTAROUND_SHIFT)),
+		.fd_serv.raw = fd_serv, .ino = ino, .offset = offset >> PAGE_BITS,
+		.tailsz = length % PAGE_SIZE,
+		.around = (flags >> MAP_FAULTAROUND_SHIFT) & MAP_FAULTAROUND_MASK,
+	};
+	if(close_fd >= 0) {
+		mm->file = get_mfile(mm->fd_serv, ino, fd);
+		if(mm->file == NULL) {
 			free(mm);
-			if(n > 0) n = -EIO;
+			n = -ENOMEM;
 			goto end;
 		}
+		/* keep vm's handle unless the file was already mapped. */
+		if(mm->file->fd == fd) close_fd = -1;
 	}
-	*mm = (struct lazy_mmap){
-		.flags = prot_to_l4_rights(prot) << 16 | (flags & ~MAP_FIXED),
-		.fd_serv.raw = fd_serv, .ino = fd, .offset = offset >> PAGE_BITS,
-		.tailsz = length % PAGE_SIZE,
-	};
+	mtx_lock(&sp->lock);
 	int eck = e_begin();
 	n = reserve_mmap(mm, sp, *addr_ptr, PAGE_CEIL(length), !!(flags & MAP_FIXED));
+	if(n == 0 && (flags & MAP_POPULATE)) populate_range(sp, mm);
 	e_end(eck);
+	mtx_unlock(&sp->lock);
 	if(n < 0) {
+		if(mm->file != NULL) unget_mfile(mm->file, fd);
 		free(mm);
 		goto end;
 	}
@@ -1285,14 +2439,17 @@ static int vm_mmap(
 
 end:
 	assert(invariants());
+	mtx_unlock(&vm_lock);
+	/* on failure, @fd stays with the caller. */
+	if(n == 0 && close_fd >= 0) {
+		__io_close((L4_ThreadId_t){ .raw = fd_serv }, close_fd);
+	}
 	return n;
 }
 
 
 static int vm_brk(L4_Word_t addr)
 {
-	assert(invariants());
-
 	int sender_pid = pidof_NP(muidl_get_sender());
 	if(unlikely(sender_pid >= SNEKS_MAX_PID)) return -EINVAL;
 
@@ -1303,7 +2460,9 @@ static int vm_brk(L4_Word_t addr)
 	if(addr > user_addr_max) addr = user_addr_max;
 	addr = PAGE_CEIL(addr);
 
-	int eck = e_begin();
+	lock_space(sp);
+	assert(invariants());
+	int n = 0, eck = e_begin();
 	if(sp->brk == 0) {
 		/* do nothing! */
 	} else if(sp->brk < addr) {
@@ -1321,16 +2480,17 @@ static int vm_brk(L4_Word_t addr)
 			} else {
 				/* here's your brk fastpath */
 				mm->length = addr - mm->addr;
+				take_as(sp, sp->brk, addr - sp->brk);
 			}
 		}
 		if(mm == NULL) {
 			mm = malloc(sizeof *mm);
-			if(mm == NULL) return -ENOMEM;
+			if(mm == NULL) { n = -ENOMEM; goto end; }
 			*mm = (struct lazy_mmap){
 				.flags = L4_FullyAccessible << 16 | (MAP_ANONYMOUS | MAP_PRIVATE),
 			};
-			int n = reserve_mmap(mm, sp, sp->brk, addr - sp->brk, true);
-			if(n < 0) { free(mm); return n; }
+			n = reserve_mmap(mm, sp, sp->brk, addr - sp->brk, true);
+			if(n < 0) { free(mm); goto end; }
 		}
 	} else {
 		/* remove memory */
@@ -1343,77 +2503,113 @@ static int vm_brk(L4_Word_t addr)
 			 */
 			mm->length = addr - mm->addr;
 			remove_vp_range(sp, addr, sp->brk - addr);
+			release_as(sp, addr, sp->brk - addr);
 		} else {
 			/* full unmap */
 			munmap_space(sp, addr, sp->brk - addr);
 		}
 	}
-	e_end(eck);
-
 	sp->brk = addr;
 
+end:
+	e_end(eck);
 	assert(invariants());
-	return 0;
+	unlock_space(sp);
+	return n;
 }
 
 
 static int vm_erase(pid_t target_pid)
 {
-	assert(invariants());
-
 	int sender_pid = pidof_NP(muidl_get_sender());
 	if(unlikely(sender_pid < SNEKS_MIN_SYSID)) return -EPERM;
 
+	mtx_lock(&vm_lock);
+	assert(invariants());
 	struct vm_space *sp = ra_id2ptr(vm_space_ra, target_pid);
 	if(L4_IsNilFpage(sp->utcb_area) || L4_IsNilFpage(sp->kip_area)) {
-		assert(sp->pages.elems == 0);
+		assert(sp->vpt == NULL || vp_next(sp, &(uintptr_t){ 0 }, ~0ul) == NULL);
 		assert(__rb_first(&sp->maps) == NULL);
+		mtx_unlock(&vm_lock);
 		return -EINVAL;
 	}
 
+	mtx_lock(&sp->lock);
 	int eck = e_begin();
+	erase_space(sp);
+	e_end(eck);
+
+	assert(invariants());
+	mtx_unlock(&vm_lock);
+	return 0;
+}
+
 
+static int cmp_pl_page_num_desc(const void *a, const void *b) {
+	const struct pl *x = *(const struct pl **)a, *y = *(const struct pl **)b;
+	return (int)(y->page_num > x->page_num) - (int)(y->page_num < x->page_num);
+}
+
+
+/* releases everything in @sp and @sp itself. also used by vm_fork() to take
+ * down a partially constructed child, so it tolerates page table leaves that
+ * were allocated but never filled. caller should be inside an epoch and hold
+ * vm_lock and @sp's lock; the latter is released and destroyed.
+ */
+static void erase_space(struct vm_space *sp)
+{
 	/* toss free address space tracking bits */
 	RB_FOREACH_SAFE(cur, &sp->as_free) {
 		__rb_erase(cur, &sp->as_free);
 		free(rb_entry(cur, struct as_free, rb));
 	}
 
-	/* and the process virtual memory */
-	L4_Fpage_t fps[64];
-	int n_fps = 0;
-	plbuf pls = darray_new();
-	struct htable_iter it;
-	for(struct vp *v = htable_first(&sp->pages, &it); v != NULL; v = htable_next(&sp->pages, &it)) {
-		/* TODO: this isn't nice: it's slower than a destroying
-		 * L4_ThreadControl() on account of the multiple syscalls in a
-		 * nontrivial space, it'll needlessly unmap laterally related virtual
-		 * memory, and the call to unmap loses access data used by page
-		 * replacement.
-		 *
-		 * all of these are minor issues until benchmarks and page replacement
-		 * get implemented.
-		 *
-		 * the solutions are 1) collecting <struct pp>, sorting them by
-		 * physical address, and passing them in a cache-favouring order to
-		 * L4_Unmap; 2) sucking up and dealing with it; and 3) storing a copy
-		 * of the access bits in <struct pp>.
-		 */
-		assert(~v->status & 0x80000000);
-		L4_Fpage_t fp = L4_FpageLog2(v->status << PAGE_BITS, PAGE_BITS);
-		L4_Set_Rights(&fp, L4_FullyAccessible);
-		fps[n_fps++] = fp;
-		if(n_fps == ARRAY_SIZE(fps)) {
-			/* drop the bass */
-			L4_UnmapFpages(ARRAY_SIZE(fps), fps);
-			n_fps = 0;
+	/* and the process virtual memory. its threads are gone by now (see
+	 * VM::erase; vm_fork()'s partial children never had any), and their
+	 * mappings with them, so nothing gets unmapped here. that'd only flush
+	 * shared pages' mappings in other spaces besides.
+	 *
+	 * exclusive private pages skip remove_vp() and are freed in descending
+	 * order of physical address afterward, so that page_free_list hands them
+	 * back out ascending.
+	 */
+	plbuf pls = darray_new(), priv = darray_new();
+	uintptr_t pos = 0;
+	for(struct vp *v = vp_next(sp, &pos, ~0ul); v != NULL; v = vp_next(sp, &pos, ~0ul)) {
+		if(VP_IS_SWAPPED(v) || v->status == zero_page || VP_IS_COW(v)) {
+			remove_vp(v, &pls);
+			continue;
 		}
-
-		remove_vp(v, &pls);
+		struct pp *phys = get_pp(v->status);
+		struct pl *link0 = atomic_load_explicit(&phys->link,
+			memory_order_relaxed);
+		if(!PL_IS_PRIVATE(link0)
+			|| atomic_load_explicit(&phys->owner, memory_order_relaxed) != v
+			|| has_shares(int_hash(link0->page_num), link0->page_num, 1))
+		{
+			remove_vp(v, &pls);
+			continue;
+		}
+		atomic_store_explicit(&phys->link, NULL, memory_order_relaxed);
+		atomic_store_explicit(&phys->owner, NULL, memory_order_relaxed);
+		if(VP_IS_LARGE(v)) free_large(link0, &pls);
+		else darray_push(priv, link0);
+		vp_del(v);
 	}
-	if(n_fps > 0) L4_UnmapFpages(n_fps, fps);
-	htable_clear(&sp->pages);
+	if(priv.size > 1) {
+		qsort(priv.item, priv.size, sizeof *priv.item, &cmp_pl_page_num_desc);
+	}
+	struct pl **it;
+	darray_foreach(it, priv) {
+		free_page(*it, &pls);
+	}
+	darray_free(priv);
 	flush_plbuf(&pls);
+	for(int i = 0; i < VPT_SIZE; i++) {
+		if(sp->vpt[i] != NULL) free_leaf(sp->vpt[i]);
+	}
+	free(sp->vpt);
+	sp->vpt = NULL;
 
 	/* and finally the lazy mmaps */
 	RB_FOREACH_SAFE(cur, &sp->maps) {
@@ -1427,9 +2623,9 @@ static int vm_erase(pid_t target_pid)
 				printf("vm:%s: anon shared mm=%p not in htable?\n",
 					__func__, mm);
 			}
-		} else if(!L4_IsNilThread(mm->fd_serv)) {
-			/* TODO: unref the inode on the filesystem, as appropriate */
+		} else if(mm->file != NULL) {
 			assert(!IS_ANON_MMAP(mm));
+			put_mfile(mm->file);
 		}
 		__rb_erase(&mm->rb, &sp->maps);
 		e_free(mm);
@@ -1437,11 +2633,9 @@ static int vm_erase(pid_t target_pid)
 
 	sp->last_mmap = &no_last_mmap;
 	sp->kip_area = sp->utcb_area = sp->sysinfo_area = L4_Nilpage;
+	mtx_unlock(&sp->lock);
+	mtx_destroy(&sp->lock);
 	ra_free(vm_space_ra, sp);
-	e_end(eck);
-
-	assert(invariants());
-	return 0;
 }
 
 
@@ -1540,479 +2734,2245 @@ static void free_page(struct pl *link0, plbuf *plbuf)
 }
 
 
-/* adds dropped active_page_list links to @plbuf. */
-static void remove_vp(struct vp *vp, plbuf *plbuf)
+/* same for a large frame, into large_free_list. */
+static void free_large(struct pl *link0, plbuf *plbuf)
 {
-	assert(e_inside());
-	assert(~vp->status & 0x80000000);	/* must be resident */
-	struct pp *phys = get_pp(vp->status);
-	struct pl *link0 = atomic_load_explicit(&phys->link,
-		memory_order_acquire);
-	if(PL_IS_PRIVATE(link0) && !VP_IS_COW(vp)) {
-		assert(atomic_load(&phys->owner) == vp);	/* single owner */
-		assert(!has_shares(int_hash(link0->page_num), link0->page_num, 1));
-		struct pl *link = atomic_exchange(&phys->link, NULL);
-		assert(link0 == link);	/* private, so won't have changed */
-		struct vp *old = atomic_exchange(&phys->owner, NULL);
-		assert(old == vp);	/* likewise */
-		free_page(link0, plbuf);
-	} else if(rm_share(vp) && VP_IS_ANON(vp)) {
-		/* eagerly release pages that're not in the page cache. */
-		free_page(link0, plbuf);
-	}
-	assert(atomic_load(&phys->owner) != vp);
-	e_free(vp);
+	struct pp *phys = pl2pp(link0);
+	atomic_store_explicit(&link0->status, 0, memory_order_release);
+	push_large_page(&large_free_list, link0);
+	assert(atomic_load(&phys->link) != link0);
+	darray_push(*plbuf, link0);
 }
 
 
-static int vm_munmap(L4_Word_t addr, L4_Word_t size)
+/* swap_open maintenance. */
+static void swap_open_add(struct swap_hdr *h)
 {
-	int sender_pid = pidof_NP(muidl_get_sender());
-	if(sender_pid == 0 || sender_pid > SNEKS_MAX_PID) return -EINVAL;
+	assert(h->open_ix < 0);
+	int left = PAGE_SIZE - sizeof *h - h->len[0] - h->len[1];
+	assert(left >= 0);
+	h->open_bin = left / SWAP_BIN_SIZE;
+	h->open_ix = swap_open[h->open_bin].size;
+	darray_push(swap_open[h->open_bin], (uintptr_t)h >> PAGE_BITS);
+	swap_open_mask |= 1ull << h->open_bin;
+}
+
+
+static void swap_open_del(struct swap_hdr *h)
+{
+	assert(h->open_bin >= 0 && h->open_bin < N_SWAP_BINS);
+	typeof(&swap_open[0]) bin = &swap_open[h->open_bin];
+	assert(h->open_ix >= 0 && h->open_ix < bin->size);
+	uint32_t last = darray_pop(*bin);
+	if(h->open_ix < bin->size) {
+		bin->item[h->open_ix] = last;
+		((struct swap_hdr *)((uintptr_t)last << PAGE_BITS))->open_ix = h->open_ix;
+	}
+	if(bin->size == 0) swap_open_mask &= ~(1ull << h->open_bin);
+	h->open_ix = -1;
+}
+
+
+/* takes the swap frame @page_num off swap_frame_list and hands its link to
+ * @list, which should be page_free_list or page_active_list. in the latter
+ * case caller should set the owner.
+ */
+static void unlink_swap_frame(uint32_t page_num, struct nbsl *list)
+{
+	assert(e_inside());
+	struct pl *link = atomic_load_explicit(&get_pp(page_num)->link,
+		memory_order_relaxed);
+	atomic_store_explicit(&link->status, 0, memory_order_release);
+	push_page(list, link);
+	if(!nbsl_del(&swap_frame_list, &link->nn)) {
+		printf("vm:%s: concurrent nbsl_del()?\n", __func__);
+		assert(false);
+	}
+	e_free(link);
+	n_swap_frames--;
+}
+
+
+/* stores @len bytes of compressed page from @data in the free half of a swap
+ * frame from the smallest bin where every frame has room for it. when there's none, @victim's frame becomes a new
+ * swap frame, or if @victim is NULL, a free one does. otherwise @victim is
+ * released. @victim should be a link on page_active_list without an owner,
+ * and gets added to @plbuf as in free_page(). returns the vp->status that
+ * designates the stored data, or 0 when a new swap frame was needed but
+ * there was no free memory.
+ */
+static uint32_t swap_store(
+	const void *data, int len, struct pl *victim, plbuf *plbuf)
+{
+	assert(len > 0 && len <= MAX_SWAP_SIZE);
+
+	struct swap_hdr *h = NULL;
+	int first = (len + SWAP_BIN_SIZE - 1) / SWAP_BIN_SIZE;
+	uint64_t avail = first < N_SWAP_BINS ? swap_open_mask >> first : 0;
+	if(avail != 0) {
+		int b = first + __builtin_ctzll(avail);
+		assert(swap_open[b].size > 0);
+		h = (struct swap_hdr *)(
+			(uintptr_t)swap_open[b].item[swap_open[b].size - 1] << PAGE_BITS);
+		assert(PAGE_SIZE - sizeof *h - h->len[0] - h->len[1] >= len);
+	}
+
+	if(h != NULL) {
+		swap_open_del(h);
+		if(victim != NULL) free_page(victim, plbuf);
+	} else {
+		struct pl *link = victim != NULL ? victim : get_free_pl();
+		if(link == NULL) return 0;
+		h = (struct swap_hdr *)((uintptr_t)link->page_num << PAGE_BITS);
+		*h = (struct swap_hdr){ .open_ix = -1 };
+		if(victim != NULL) {
+			atomic_store_explicit(&victim->status, 0, memory_order_release);
+			push_page(&swap_frame_list, victim);
+			darray_push(*plbuf, victim);
+		} else {
+			push_page(&swap_frame_list, link);
+			e_free(link);
+		}
+		swap_open_add(h);
+		n_swap_frames++;
+	}
+	int half = h->len[0] == 0 ? 0 : 1;
+	assert(h->len[half] == 0);
+	h->len[half] = len;
+	memcpy(swap_data(h, half), data, len);
+	n_swapped++;
+
+	return SWAP_STATUS((uintptr_t)h >> PAGE_BITS, half);
+}
+
+
+/* releases the swapped page designated by @status. */
+static void swap_free(uint32_t status)
+{
+	assert(e_inside());
+	struct swap_hdr *h = swap_hdr_of(status);
+	int half = SWAP_HALF(status);
+	assert(h->len[half] > 0);
+	h->len[half] = 0;
+	n_swapped--;
+	if(h->len[1 - half] != 0) swap_open_add(h);
+	else {
+		swap_open_del(h);
+		unlink_swap_frame(SWAP_FRAME(status), &page_free_list);
+	}
+}
+
+
+/* returns the status of a new copy of the swapped page at @status, or 0 when
+ * out of memory. this doesn't decompress anything.
+ */
+static uint32_t swap_dup(uint32_t status)
+{
+	struct swap_hdr *h = swap_hdr_of(status);
+	int half = SWAP_HALF(status), len = h->len[half];
+	char buf[len];
+	memcpy(buf, swap_data(h, half), len);
+	return swap_store(buf, len, NULL, NULL);
+}
+
+
+/* compresses @vp's page into swap, releasing its frame or reusing it as a
+ * swap frame. returns true on success, or false when the page didn't compress
+ * well enough, in which case it's left as it was. caller should have revoked
+ * all access to the page.
+ */
+static bool swap_out_page(struct vp *vp, plbuf *plbuf)
+{
+	assert(e_inside());
+	assert(VP_IS_ANON(vp) && !VP_IS_COW(vp) && !VP_IS_SHARED(vp));
+	assert(!VP_IS_LARGE(vp) && !VP_IS_SWAPPED(vp) && vp->status != zero_page);
+
+	char buf[LZ4_COMPRESSBOUND(PAGE_SIZE)];
+	int len = LZ4_compress_fast_extState(lz4_state,
+		(void *)((uintptr_t)vp->status << PAGE_BITS), buf,
+		PAGE_SIZE, sizeof buf, 1);
+	if(len <= 0 || len > MAX_SWAP_SIZE) return false;
+
+	struct pp *phys = get_pp(vp->status);
+	struct vp *old = atomic_exchange(&phys->owner, NULL);
+	assert(old == vp);	/* private, so single owner */
+	struct pl *link = atomic_load_explicit(&phys->link, memory_order_relaxed);
+	assert(PL_IS_PRIVATE(link));
+	vp->status = swap_store(buf, len, link, plbuf);
+	return true;
+}
+
+
+/* decompresses @vp's page out of swap into a frame of its own. when the other
+ * half of the swap frame is free, that frame is reused in place. returns false
+ * when a frame was needed but there was no free memory.
+ */
+static bool swap_in_page(struct vp *vp)
+{
+	assert(e_inside());
+	assert(VP_IS_SWAPPED(vp));
+	uint32_t status = vp->status, frame = SWAP_FRAME(status);
+	struct swap_hdr *h = swap_hdr_of(status);
+	int half = SWAP_HALF(status), len = h->len[half], n;
+	uint32_t page_num;
+	if(h->len[1 - half] != 0) {
+		struct pl *link = get_free_pl();
+		if(link == NULL) return false;
+		page_num = link->page_num;
+		n = LZ4_decompress_safe(swap_data(h, half),
+			(void *)((uintptr_t)page_num << PAGE_BITS), len, PAGE_SIZE);
+		h->len[half] = 0;
+		n_swapped--;
+		swap_open_add(h);
+		atomic_store_explicit(&pl2pp(link)->owner, vp, memory_order_relaxed);
+		push_page(&page_active_list, link);
+		e_free(link);
+	} else {
+		/* expand into the same frame via a buffer. */
+		char buf[len];
+		memcpy(buf, swap_data(h, half), len);
+		h->len[half] = 0;
+		n_swapped--;
+		swap_open_del(h);
+		page_num = frame;
+		n = LZ4_decompress_safe(buf, (void *)h, len, PAGE_SIZE);
+		atomic_store_explicit(&get_pp(frame)->owner, vp, memory_order_relaxed);
+		unlink_swap_frame(frame, &page_active_list);
+	}
+	if(n != PAGE_SIZE) {
+		printf("vm:%s: n=%d\n", __func__, n);
+		abort();
+	}
+	vp->status = page_num;
+	return true;
+}
+
+
+/* removes @vp from its address space. adds dropped active_page_list links to
+ * @plbuf.
+ */
+static void remove_vp(struct vp *vp, plbuf *plbuf)
+{
+	assert(e_inside());
+	if(VP_IS_SWAPPED(vp)) {
+		swap_free(vp->status);
+		vp_del(vp);
+		return;
+	} else if(vp->status == zero_page) {
+		/* untracked, see zero_page. */
+		vp_del(vp);
+		return;
+	}
+	struct pp *phys = get_pp(vp->status);
+	struct pl *link0 = atomic_load_explicit(&phys->link,
+		memory_order_acquire);
+	if(PL_IS_PRIVATE(link0) && !VP_IS_COW(vp)) {
+		assert(atomic_load(&phys->owner) == vp);	/* single owner */
+		assert(!has_shares(int_hash(link0->page_num), link0->page_num, 1));
+		struct pl *link = atomic_exchange(&phys->link, NULL);
+		assert(link0 == link);	/* private, so won't have changed */
+		struct vp *old = atomic_exchange(&phys->owner, NULL);
+		assert(old == vp);	/* likewise */
+		if(VP_IS_LARGE(vp)) free_large(link0, plbuf);
+		else free_page(link0, plbuf);
+	} else if(rm_share(vp) && VP_IS_ANON(vp)) {
+		/* eagerly release pages that're not in the page cache. */
+		free_page(link0, plbuf);
+	}
+	assert(atomic_load(&phys->owner) != vp);
+	vp_del(vp);
+}
+
+
+static int vm_munmap(L4_Word_t addr, L4_Word_t size)
+{
+	int sender_pid = pidof_NP(muidl_get_sender());
+	if(sender_pid == 0 || sender_pid > SNEKS_MAX_PID) return -EINVAL;
 	addr &= ~PAGE_MASK;
 	size = PAGE_CEIL(size);
 	if(!VALID_ADDR_SIZE(addr, size)) return -EINVAL;
 	struct vm_space *sp = ra_id2ptr(vm_space_ra, sender_pid);
 	if(sp->kip_area.raw == 0) return -EINVAL;
 
+	lock_space(sp);
 	int eck = e_begin();
 	munmap_space(sp, addr, size);
 	e_end(eck);
+	unlock_space(sp);
 
 	return 0;
 }
 
 
-static int fork_maps(struct vm_space *src, struct vm_space *dest)
+/* splits @mm at @addr, which lies inside it past its first page, so that @mm
+ * keeps the part below @addr. returns the part above, or NULL when out of
+ * memory.
+ */
+static struct lazy_mmap *split_lazy_mmap(
+	struct vm_space *sp, struct lazy_mmap *mm, uintptr_t addr)
 {
-	RB_FOREACH(cur, &src->maps) {
-		struct lazy_mmap *orig = container_of(cur, struct lazy_mmap, rb),
-			*copy = malloc(sizeof *copy);
-		if(copy == NULL) goto Enomem;
-		*copy = *orig;
-		if(IS_ANON_MMAP(copy)) {
-			assert(copy->fd_serv.raw == L4_MyGlobalId().raw);
-			bool ok = htable_add(&anon_mmap_table,
-				hash_lazy_mmap_by_ino(copy, NULL), copy);
-			if(!ok) goto Enomem;
+	assert((addr & PAGE_MASK) == 0);
+	assert(addr > mm->addr && addr < mm->addr + mm->length);
+
+	struct lazy_mmap *tail = malloc(sizeof *tail);
+	if(tail == NULL) return NULL;
+	*tail = *mm;
+	tail->addr = addr;
+	tail->length = mm->addr + mm->length - addr;
+	tail->offset = mm->offset + ((addr - mm->addr) >> PAGE_BITS);
+	tail->ra_prev = tail->ra_end = tail->ra_size = 0;
+	if(IS_ANON_MMAP(tail)) {
+		bool ok = htable_add(&anon_mmap_table,
+			hash_lazy_mmap_by_ino(tail, NULL), tail);
+		if(!ok) {
+			free(tail);
+			return NULL;
 		}
-		/* FIXME: duplicate file descriptors etc. */
-		void *dupe = insert_lazy_mmap(dest, copy);
-		assert(dupe == NULL);
+	}
+	if(tail->file != NULL) tail->file->refs++;
+	mm->length = addr - mm->addr;
+	mm->tailsz = PAGE_SIZE;
+	struct lazy_mmap *old = insert_lazy_mmap(sp, tail);
+	assert(old == NULL);
+	return tail;
+}
+
+
+/* splits the lazy_mmaps across either end of [addr, addr + size) so that each
+ * lies entirely inside or outside of it. returns 0 or -ENOMEM.
+ */
+static int isolate_range(struct vm_space *sp, uintptr_t addr, size_t size)
+{
+	struct lazy_mmap *mm = find_lazy_mmap(sp, addr);
+	if(mm != NULL && mm->addr < addr && split_lazy_mmap(sp, mm, addr) == NULL) {
+		return -ENOMEM;
+	}
+	mm = find_lazy_mmap(sp, addr + size - 1);
+	if(mm != NULL && mm->addr + mm->length > addr + size
+		&& split_lazy_mmap(sp, mm, addr + size) == NULL)
+	{
+		return -ENOMEM;
 	}
 	return 0;
+}
 
-Enomem:
-	/* FIXME: cleanup! */
-	return -ENOMEM;
+
+/* whether [addr, addr + size) is covered by lazy_mmaps with no gaps. */
+static bool range_mapped(struct vm_space *sp, uintptr_t addr, size_t size)
+{
+	for(uintptr_t pos = addr; pos - addr < size;) {
+		struct lazy_mmap *mm = find_lazy_mmap(sp, pos);
+		if(mm == NULL) return false;
+		pos = mm->addr + mm->length;
+	}
+	return true;
 }
 
 
-static int fork_pages(struct vm_space *src, struct vm_space *dest)
+/* whether @v in @mm may be made writable without copy-on-write. */
+static bool vp_exclusive(const struct vp *v, const struct lazy_mmap *mm)
 {
-	/* NOTE: we could malloc src->pages.elems instances of <struct vp> to
-	 * avoid checking malloc return values mid-loop, and dodge some rollback
-	 * overhead in case one of them doesn't work out. dlmalloc has a fancy
-	 * dlindependent_calloc() function for doing just that, and likely quicker
-	 * than a sequence of scattered mallocs. (however, this is optimizations,
-	 * and there's no benchmark.)
-	 */
-	struct vp *copy = NULL;
-	L4_Fpage_t unmaps[64];
-	int unmap_pos = 0, n_pages = 0;
-	struct htable_iter it;
-	for(struct vp *cur = htable_first(&src->pages, &it);
-		cur != NULL;
-		cur = htable_next(&src->pages, &it))
+	if(mm->flags & MAP_SHARED) return true;
+	if(VP_IS_SWAPPED(v)) return true;	/* always private anonymous */
+	if(v->status == zero_page || !VP_IS_ANON(v)) return false;
+	return atomic_load_explicit(&get_pp(v->status)->owner,
+			memory_order_relaxed) == v
+		&& !has_shares(hash_vp_by_phys(v, NULL), v->status, 1);
+}
+
+
+/* sets access to the virtual pages of @sp in [addr, addr + size) to @rights,
+ * and revokes access that was taken away from their mappings. pages that
+ * become writable but aren't exclusive to their vp go under copy-on-write,
+ * and those already under it stay so.
+ */
+static void protect_vp_range(
+	struct vm_space *sp, uintptr_t addr, size_t size, int rights)
+{
+	assert(e_inside());
+	if(addr & LARGE_MASK) split_large_at(sp, addr);
+	if((addr + size) & LARGE_MASK) split_large_at(sp, addr + size - 1);
+
+	L4_Fpage_t fps[64];
+	int n_fps = 0, zero_revoke = 0;
+	uintptr_t pos = addr;
+	for(struct vp *v = vp_next(sp, &pos, addr + size);
+		v != NULL; v = vp_next(sp, &pos, addr + size))
+	{
+		const int old = VP_RIGHTS(v);
+		v->vaddr &= ~VPM_RIGHTS;
+		v->vaddr |= rights & ~L4_Writable;
+		if((rights & L4_Writable) && !VP_IS_COW(v)) {
+			const struct lazy_mmap *mm = find_lazy_mmap(sp,
+				v->vaddr & ~PAGE_MASK);
+			v->vaddr |= vp_exclusive(v, mm) ? L4_Writable : VPF_COW;
+		}
+		int revoke = old & ~VP_RIGHTS(v);
+		if(revoke == 0 || VP_IS_SWAPPED(v)) continue;
+		if(v->status == zero_page) {
+			/* revoked just the once, below. */
+			zero_revoke |= revoke;
+			continue;
+		}
+		L4_Fpage_t fp = vp_fpage(v);
+		L4_Set_Rights(&fp, revoke);
+		fps[n_fps++] = fp;
+		if(n_fps == ARRAY_SIZE(fps)) {
+			L4_UnmapFpages(ARRAY_SIZE(fps), fps);
+			n_fps = 0;
+		}
+	}
+	if(zero_revoke != 0) {
+		if(n_fps == ARRAY_SIZE(fps)) {
+			L4_UnmapFpages(n_fps, fps);
+			n_fps = 0;
+		}
+		fps[n_fps] = L4_FpageLog2((uintptr_t)zero_page << PAGE_BITS, PAGE_BITS);
+		L4_Set_Rights(&fps[n_fps++], zero_revoke);
+	}
+	if(n_fps > 0) L4_UnmapFpages(n_fps, fps);
+}
+
+
+static int vm_mprotect(L4_Word_t addr, L4_Word_t length, int prot)
+{
+	int sender_pid = pidof_NP(muidl_get_sender());
+	if(sender_pid == 0 || sender_pid > SNEKS_MAX_PID) return -EINVAL;
+	if(addr & PAGE_MASK) return -EINVAL;
+	if(prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+	length = PAGE_CEIL(length);
+	if(length == 0) return 0;
+	if(!VALID_ADDR_SIZE(addr, length)) return -ENOMEM;
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, sender_pid);
+	if(sp->kip_area.raw == 0) return -EINVAL;
+
+	lock_space(sp);
+	assert(invariants());
+	int eck = e_begin(), n = -ENOMEM;
+	if(!range_mapped(sp, addr, length)) goto end;
+	n = isolate_range(sp, addr, length);
+	if(n < 0) goto end;
+
+	const int rights = prot_to_l4_rights(prot);
+	for(struct lazy_mmap *mm = find_lazy_mmap(sp, addr);
+		mm != NULL && mm->addr < addr + length;
+		mm = container_of_or_null(__rb_next(&mm->rb), struct lazy_mmap, rb))
 	{
-		assert(VP_IS_COW(cur) ^ !!(VP_RIGHTS(cur) & L4_Writable));
+		mm->flags = (mm->flags & ~(7l << 16)) | rights << 16;
+	}
+	protect_vp_range(sp, addr, length, rights);
+
+end:
+	e_end(eck);
+	assert(invariants());
+	unlock_space(sp);
+	return n;
+}
+
 
-		if(copy == NULL) {
-			copy = malloc(sizeof *copy);
-			if(copy == NULL) goto Enomem;
+/* prefetches [addr, addr + size) of @sp: file pages are read into the page
+ * cache, and pages in compressed swap are brought back in. stops short when
+ * free memory runs low.
+ */
+static void willneed_range(struct vm_space *sp, uintptr_t addr, size_t size)
+{
+	assert(e_inside());
+	for(uintptr_t pos = addr; pos - addr < size; pos += PAGE_SIZE) {
+		if(atomic_load_explicit(&n_free_pages, memory_order_relaxed) < free_low_wm) {
+			break;
+		}
+		struct lazy_mmap *mm = find_lazy_mmap(sp, pos);
+		struct vp *vp = vp_get(sp, pos);
+		if(vp != NULL && VP_IS_SWAPPED(vp)) {
+			if(!swap_in_page(vp)) break;
+		} else if(vp == NULL && (~mm->flags & MAP_ANONYMOUS)) {
+			struct nbsl_node *top;
+			int bump = (pos - mm->addr) >> PAGE_BITS;
+			struct pl *cached = find_cached_page(&top, mm, bump);
+			if(cached == NULL && start_fill(&cached, top, mm, bump) < 0) break;
 		}
-		size_t hash = hash_vp_by_vaddr(cur, NULL);
+	}
+}
+
+
+/* resolves every page of @mm in @sp ahead of access for MAP_POPULATE, so
+ * that first touch is served by remap_fault(). private anonymous memory gets
+ * fresh pages unless it's read-only. file pages are read into the page cache
+ * first; those still being filled on return are left to the fault path. stops
+ * short when free memory runs low.
+ */
+static void populate_range(struct vm_space *sp, const struct lazy_mmap *mm)
+{
+	assert(e_inside());
+	if(~mm->flags & MAP_ANONYMOUS) willneed_range(sp, mm->addr, mm->length);
+	const bool zero = (mm->flags & MAP_ANONYMOUS) && (~mm->flags & MAP_SHARED)
+		&& (~mm->flags & (L4_Writable << 16));
+	for(uintptr_t addr = mm->addr; addr < mm->addr + mm->length; addr += PAGE_SIZE) {
+		struct vp *vp;
+		if(vp_get(sp, addr) == NULL && prefault_page(&vp, sp, mm, addr, zero) < 0) {
+			break;
+		}
+	}
+}
 
-/* (use this after lazy brk has been removed, subsequent to pf rejigger.) */
-#if 0
-		/* NOTE: for now, all pages are in memory. at some point swapped
-		 * pages and pages removed from page cache may appear.
-		 */
-		assert(cur->status & ~0x80000000);
-#endif
 
-		if(!VP_IS_ANON(cur)
-			&& (VP_IS_SHARED(cur)
-				|| ((~VP_RIGHTS(cur) & L4_Writable) && !VP_IS_COW(cur))))
+/* offers the pages of @sp in [addr, addr + size) for same-page merging right
+ * away, taking them as cold. caller holds vm_lock and @sp's lock, the latter
+ * of which is released meanwhile for merge_frame().
+ */
+static void merge_range(struct vm_space *sp, uintptr_t addr, size_t size)
+{
+	assert(e_inside());
+	darray(uint32_t) pages = darray_new();
+	uintptr_t pos = addr;
+	for(struct vp *v = vp_next(sp, &pos, addr + size);
+		v != NULL; v = vp_next(sp, &pos, addr + size))
+	{
+		if(VP_IS_ANON(v) && !VP_IS_SHARED(v) && !VP_IS_LARGE(v)
+			&& !VP_IS_SWAPPED(v) && v->status != zero_page)
 		{
-			/* ignore private+file+ro or shared pages since they'll be mapped
-			 * lazily using the page cache.
-			 */
-#ifdef TRACE_FORK
-			printf("vm: full pagecache page ignored at vaddr=%#x\n",
-				cur->vaddr & ~PAGE_MASK);
-#endif
-			continue;
-		} else if(VP_IS_SHARED(cur)) {
-			/* shared pages get another reference and the show goes on.
-			 *
-			 * FIXME: this appears to be a dead case, since all pages shared
-			 * but not under copy-on-write are visible through the page cache.
-			 */
-#ifdef TRACE_FORK
-			printf("vm: forking shared page at vaddr=%#x\n",
-				cur->vaddr & ~PAGE_MASK);
-#endif
-			abort();	/* retain until hit */
-			*copy = (struct vp){
-				.vaddr = cur->vaddr,
-				.status = cur->status,
-				.age = 1,
-			};
-			bool ok = htable_add(&dest->pages, hash, copy);
-			if(!ok || !add_share(cur->status, copy)) goto Enomem;
-		} else {
-			/* anonymous and private pages get copy-on-write. this applies
-			 * even if said pages were read-only right now and made writable
-			 * later.
-			 *
-			 * TODO: test this once mprotect() appears.
-			 */
-#ifdef TRACE_FORK
-			printf("vm: cow for anon/private page at vaddr=%#x\n",
-				cur->vaddr & ~PAGE_MASK);
-#endif
-			/* older TODO: indicate read-only sharing somewhere besides
-			 * share_table.
-			 */
-			bool unmap = !VP_IS_COW(cur) && (VP_RIGHTS(cur) & L4_Writable) != 0;
-			*copy = (struct vp){
-				.vaddr = (cur->vaddr & ~L4_Writable)
-					| ((VP_RIGHTS(cur) & L4_Writable) ? VPF_COW : 0),
-				.status = cur->status,
-				.age = 1,
-			};
-			bool ok = htable_add(&dest->pages, hash, copy);
-			if(!ok) goto Enomem;
-			if(unmap) {
-				cur->vaddr |= VPF_COW;
-				cur->vaddr &= ~L4_Writable;
-				assert(VP_IS_COW(cur));
+			darray_push(pages, v->status);
+		}
+	}
+	mtx_unlock(&sp->lock);
+	plbuf pls = darray_new();
+	uint32_t *it;
+	darray_foreach(it, pages) merge_frame(*it, true, &pls);
+	flush_plbuf(&pls);
+	darray_free(pages);
+	mtx_lock(&sp->lock);
+}
+
+
+static int vm_madvise(L4_Word_t addr, L4_Word_t length, int advice)
+{
+	int sender_pid = pidof_NP(muidl_get_sender());
+	if(sender_pid == 0 || sender_pid > SNEKS_MAX_PID) return -EINVAL;
+	if(addr & PAGE_MASK) return -EINVAL;
+	length = PAGE_CEIL(length);
+	if(length == 0) return 0;
+	if(!VALID_ADDR_SIZE(addr, length)) return -ENOMEM;
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, sender_pid);
+	if(sp->kip_area.raw == 0) return -EINVAL;
+
+	lock_space(sp);
+	assert(invariants());
+	int eck = e_begin(), n = -ENOMEM;
+	if(!range_mapped(sp, addr, length)) goto end;
+	switch(advice) {
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+			n = isolate_range(sp, addr, length);
+			if(n < 0) break;
+			for(struct lazy_mmap *mm = find_lazy_mmap(sp, addr);
+				mm != NULL && mm->addr < addr + length;
+				mm = container_of_or_null(__rb_next(&mm->rb),
+					struct lazy_mmap, rb))
+			{
+				mm->advice = advice;
+				mm->ra_size = 0;
 			}
-			if(!add_share(cur->status, copy)) {
-				if(unmap) {
-					cur->vaddr &= ~VPF_COW;
-					cur->vaddr |= L4_Writable;
-					assert(!VP_IS_COW(cur));
-				}
-				goto Enomem;
+			break;
+		case MADV_WILLNEED:
+			willneed_range(sp, addr, length);
+			n = 0;
+			break;
+		case MADV_DONTNEED:
+			/* private pages refault as zeroes or from the file, and shared
+			 * ones from the page cache.
+			 */
+			remove_vp_range(sp, addr, length);
+			n = 0;
+			break;
+		case MADV_MERGEABLE:
+			merge_range(sp, addr, length);
+			n = 0;
+			break;
+		default:
+			n = -EINVAL;
+			break;
+	}
+
+end:
+	e_end(eck);
+	assert(invariants());
+	unlock_space(sp);
+	return n;
+}
+
+
+static int vm_mincore(L4_Word_t addr, L4_Word_t length,
+	uint8_t *vec, unsigned *vec_len_p)
+{
+	*vec_len_p = 0;
+	int sender_pid = pidof_NP(muidl_get_sender());
+	if(sender_pid == 0 || sender_pid > SNEKS_MAX_PID) return -EINVAL;
+	if(addr & PAGE_MASK) return -EINVAL;
+	length = PAGE_CEIL(length);
+	if(length == 0) return 0;
+	if(length >> PAGE_BITS > SNEKS_VM_COREVEC_MAX) return -EINVAL;
+	if(!VALID_ADDR_SIZE(addr, length)) return -ENOMEM;
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, sender_pid);
+	if(sp->kip_area.raw == 0) return -EINVAL;
+
+	lock_space(sp);
+	int n = -ENOMEM;
+	if(!range_mapped(sp, addr, length)) goto end;
+	for(unsigned i = 0; i < length >> PAGE_BITS; i++) {
+		const struct vp *v = vp_get(sp, addr + i * PAGE_SIZE);
+		vec[i] = v != NULL && !VP_IS_SWAPPED(v);
+	}
+	*vec_len_p = length >> PAGE_BITS;
+	n = 0;
+
+end:
+	unlock_space(sp);
+	return n;
+}
+
+
+/* moves the virtual pages of @sp in [from, from + size) to start at @to,
+ * where there are none. contents stay put; mappings at the old address are
+ * revoked. large pages are split unless the move keeps their alignment.
+ * returns 0, or -ENOMEM before anything was moved.
+ */
+static int move_vp_range(
+	struct vm_space *sp, uintptr_t from, size_t size, uintptr_t to)
+{
+	assert(e_inside());
+	assert(!OVERLAP_EXCL(from, size, to, size));
+
+	uintptr_t pos;
+	if(from & LARGE_MASK) split_large_at(sp, from);
+	if((from + size) & LARGE_MASK) split_large_at(sp, from + size - 1);
+	if(((to - from) & LARGE_MASK) != 0) {
+		pos = from;
+		for(struct vp *v = vp_next(sp, &pos, from + size);
+			v != NULL; v = vp_next(sp, &pos, from + size))
+		{
+			if(VP_IS_LARGE(v)) split_large(v);
+		}
+	}
+
+	/* allocate page table leaves up front so that vp_new() can't fail
+	 * halfway.
+	 */
+	pos = from;
+	for(struct vp *v = vp_next(sp, &pos, from + size);
+		v != NULL; v = vp_next(sp, &pos, from + size))
+	{
+		uintptr_t dest = (v->vaddr & ~PAGE_MASK) - from + to;
+		struct vp_leaf **leafp = &sp->vpt[dest >> LARGE_BITS];
+		if(*leafp == NULL && (*leafp = alloc_leaf()) == NULL) {
+			for(uintptr_t a = to & ~LARGE_MASK; a < to + size; a += LARGE_SIZE) {
+				struct vp_leaf **lp = &sp->vpt[a >> LARGE_BITS];
+				if(*lp != NULL && (*lp)->n_live == 0) {
+					free_leaf(*lp);
+					*lp = NULL;
+				}
+			}
+			return -ENOMEM;
+		}
+	}
+
+	L4_Fpage_t fps[64];
+	int n_fps = 0;
+	bool zero = false;
+	pos = from;
+	for(struct vp *v = vp_next(sp, &pos, from + size);
+		v != NULL; v = vp_next(sp, &pos, from + size))
+	{
+		uintptr_t dest = (v->vaddr & ~PAGE_MASK) - from + to;
+		struct vp *nv = vp_new(sp, dest);
+		assert(nv != NULL);
+		*nv = *v;
+		nv->vaddr = dest | (v->vaddr & PAGE_MASK);
+
+		if(VP_IS_SWAPPED(v)) {
+			/* not mapped, and not referenced from elsewhere. */
+		} else if(v->status == zero_page) {
+			/* revoked just the once, below. */
+			zero = true;
+		} else {
+			struct pp *phys = get_pp(v->status);
+			struct vp *owner = v;
+			if(!atomic_compare_exchange_strong(&phys->owner, &owner, nv)) {
+				size_t hash = hash_vp_by_phys(v, NULL);
+				if(!htable_add(&share_table, hash, nv)) {
+					printf("vm:%s: out of memory for share_table\n", __func__);
+					abort();
+				}
+				bool ok = htable_del(&share_table, hash, v);
+				assert(ok);
+			}
+			L4_Fpage_t fp = vp_fpage(v);
+			L4_Set_Rights(&fp, L4_FullyAccessible);
+			fps[n_fps++] = fp;
+			if(n_fps == ARRAY_SIZE(fps)) {
+				L4_UnmapFpages(ARRAY_SIZE(fps), fps);
+				n_fps = 0;
+			}
+		}
+		vp_del(v);
+	}
+	if(zero) {
+		if(n_fps == ARRAY_SIZE(fps)) {
+			L4_UnmapFpages(n_fps, fps);
+			n_fps = 0;
+		}
+		fps[n_fps] = L4_FpageLog2((uintptr_t)zero_page << PAGE_BITS, PAGE_BITS);
+		L4_Set_Rights(&fps[n_fps++], L4_FullyAccessible);
+	}
+	if(n_fps > 0) L4_UnmapFpages(n_fps, fps);
+
+	return 0;
+}
+
+
+static int vm_mremap(
+	L4_Word_t *addr_ptr, L4_Word_t old_length, L4_Word_t new_length,
+	int flags, L4_Word_t new_addr)
+{
+	int sender_pid = pidof_NP(muidl_get_sender());
+	if(sender_pid == 0 || sender_pid > SNEKS_MAX_PID) return -EINVAL;
+	const L4_Word_t addr = *addr_ptr;
+	old_length = PAGE_CEIL(old_length);
+	new_length = PAGE_CEIL(new_length);
+	if((addr & PAGE_MASK) || old_length == 0 || new_length == 0) return -EINVAL;
+	if(flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) return -EINVAL;
+	if((flags & MREMAP_FIXED) && (~flags & MREMAP_MAYMOVE)) return -EINVAL;
+	if(!VALID_ADDR_SIZE(addr, old_length)) return -EFAULT;
+	if(flags & MREMAP_FIXED) {
+		if((new_addr & PAGE_MASK) || !VALID_ADDR_SIZE(new_addr, new_length)
+			|| OVERLAP_EXCL(addr, old_length, new_addr, new_length))
+		{
+			return -EINVAL;
+		}
+	}
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, sender_pid);
+	if(sp->kip_area.raw == 0) return -EINVAL;
+
+	lock_space(sp);
+	assert(invariants());
+	int eck = e_begin(), n = 0;
+	struct lazy_mmap *mm = find_lazy_mmap(sp, addr);
+	if(mm == NULL || addr + old_length > mm->addr + mm->length) {
+		n = -EFAULT;
+		goto end;
+	}
+
+	if(~flags & MREMAP_FIXED) {
+		const uintptr_t grow = addr + old_length;
+		if(new_length <= old_length) {
+			/* shrink in place. */
+			if(new_length < old_length) {
+				munmap_space(sp, addr + new_length, old_length - new_length);
+			}
+			goto end;
+		} else if(grow == mm->addr + mm->length
+			&& grow > sp->mmap_bot && grow - 1 + (new_length - old_length) <= user_addr_max
+			&& first_lazy_mmap(sp, grow, new_length - old_length) == NULL
+			&& !in_nogo(sp, grow, new_length - old_length))
+		{
+			/* grow in place, above the part of the address space that's yet
+			 * to be handed out.
+			 */
+			take_as(sp, grow, new_length - old_length);
+			mm->length += new_length - old_length;
+			mm->tailsz = PAGE_SIZE;
+			goto end;
+		} else if(~flags & MREMAP_MAYMOVE) {
+			n = -ENOMEM;
+			goto end;
+		}
+	}
+
+	/* move the pages and the map. */
+	n = isolate_range(sp, addr, old_length);
+	if(n < 0) goto end;
+	mm = find_lazy_mmap(sp, addr);
+	assert(mm->addr == addr && mm->length == old_length);
+	if(flags & MREMAP_FIXED) {
+		if(in_nogo(sp, new_addr, new_length)) {
+			n = -EINVAL;
+			goto end;
+		}
+		munmap_space(sp, new_addr, new_length);
+		take_as(sp, new_addr, new_length);
+	} else {
+		new_addr = alloc_as(sp, new_length, 0);
+		if(new_addr == 0) {
+			n = -ENOMEM;
+			goto end;
+		}
+	}
+	n = move_vp_range(sp, addr, min(old_length, new_length), new_addr);
+	if(n < 0) {
+		release_as(sp, new_addr, new_length);
+		goto end;
+	}
+	if(new_length < old_length) {
+		munmap_space(sp, addr + new_length, old_length - new_length);
+	}
+	release_as(sp, addr, min(old_length, new_length));
+
+	__rb_erase(&mm->rb, &sp->maps);
+	if(sp->last_mmap == mm) sp->last_mmap = &no_last_mmap;
+	if(new_length != old_length) mm->tailsz = PAGE_SIZE;
+	mm->addr = new_addr;
+	mm->length = new_length;
+	mm->ra_prev = mm->ra_end = mm->ra_size = 0;
+	struct lazy_mmap *old = insert_lazy_mmap(sp, mm);
+	assert(old == NULL);
+	*addr_ptr = new_addr;
+
+end:
+	e_end(eck);
+	assert(invariants());
+	unlock_space(sp);
+	return n;
+}
+
+
+/* copies @src's lazy mmaps into @dest. the copies are allocated all at once
+ * ahead of time so that running out of memory halfway leaves nothing
+ * unaccounted for; those already inserted get released by vm_fork() thru
+ * erase_space().
+ */
+static int fork_maps(struct vm_space *src, struct vm_space *dest)
+{
+	size_t n_maps = 0;
+	RB_FOREACH(cur, &src->maps) n_maps++;
+	if(n_maps == 0) return 0;
+
+	struct lazy_mmap **copies = (struct lazy_mmap **)independent_calloc(
+		n_maps, sizeof **copies, NULL);
+	if(copies == NULL) return -ENOMEM;
+	size_t pos = 0;
+	int n = 0;
+	RB_FOREACH(cur, &src->maps) {
+		struct lazy_mmap *orig = container_of(cur, struct lazy_mmap, rb),
+			*copy = copies[pos++];
+		*copy = *orig;
+		if(IS_ANON_MMAP(copy)) {
+			assert(copy->fd_serv.raw == L4_MyGlobalId().raw);
+			bool ok = htable_add(&anon_mmap_table,
+				hash_lazy_mmap_by_ino(copy, NULL), copy);
+			if(!ok) {
+				n = -ENOMEM;
+				break;
+			}
+		}
+		if(copy->file != NULL) copy->file->refs++;
+		void *dupe = insert_lazy_mmap(dest, copy);
+		assert(dupe == NULL);
+	}
+	if(n < 0) {
+		/* the one that failed and the rest weren't inserted. */
+		for(size_t i = pos - 1; i < n_maps; i++) free(copies[i]);
+	}
+	free(copies);
+
+	return n;
+}
+
+
+/* copies @src's free address space into @dest. on failure, those already
+ * inserted get released by vm_fork() thru erase_space().
+ */
+static int fork_as_free(struct vm_space *src, struct vm_space *dest)
+{
+	RB_FOREACH(cur, &src->as_free) {
+		struct as_free *copy = malloc(sizeof *copy);
+		if(copy == NULL) return -ENOMEM;
+		*copy = *as_free_of(cur);
+		insert_as_free(dest, copy);
+	}
+	return 0;
+}
+
+
+/* whether fork_pages() copies @v into the child. private+file+ro and shared
+ * pages are skipped since they'll be mapped lazily using the page cache.
+ */
+static inline bool fork_copies(const struct vp *v) {
+	return VP_IS_ANON(v)
+		|| (!VP_IS_SHARED(v)
+			&& ((VP_RIGHTS(v) & L4_Writable) || VP_IS_COW(v)));
+}
+
+
+static int cmp_words(const void *a, const void *b) {
+	L4_Word_t x = *(const L4_Word_t *)a, y = *(const L4_Word_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* revokes write access to the physical pages numbered in @pages, which gets
+ * sorted in place. aligned runs of consecutive frames go out as a single
+ * fpage each, so that e.g. a split large page costs one item rather than
+ * LARGE_PAGES; L4_UnmapFpages() takes at most 64 per call regardless.
+ */
+static void unmap_writable(L4_Word_t *pages, int n_pages)
+{
+	qsort(pages, n_pages, sizeof *pages, &cmp_words);
+	L4_Fpage_t fps[64];
+	int n_fps = 0;
+	for(int i = 0, len; i < n_pages; i += len) {
+		len = 1;
+		while(i + len < n_pages && pages[i + len] == pages[i] + len) len++;
+		L4_Word_t page = pages[i];
+		for(int left = len; left > 0;) {
+			int shift = MSB(left);
+			if(page != 0) shift = min_t(int, shift, __builtin_ctzl(page));
+			L4_Fpage_t fp = L4_FpageLog2(page << PAGE_BITS, PAGE_BITS + shift);
+			L4_Set_Rights(&fp, L4_Writable);
+			fps[n_fps++] = fp;
+			if(n_fps == ARRAY_SIZE(fps)) {
+				L4_UnmapFpages(ARRAY_SIZE(fps), fps);
+				n_fps = 0;
+			}
+			page += 1 << shift;
+			left -= 1 << shift;
+		}
+	}
+	if(n_fps > 0) L4_UnmapFpages(n_fps, fps);
+}
+
+
+/* copies @src's private and anonymous pages into @dest under copy-on-write.
+ * the first pass counts pages to copy and to write-protect, and allocates
+ * @dest's page table leaves and the unmap array up front so that the second
+ * pass, which fills them in, only fails in add_share(). write access in @src
+ * is revoked after the second pass whether it fails or not, since by then
+ * the affected vps are already marked copy-on-write.
+ */
+static int fork_pages(struct vm_space *src, struct vm_space *dest)
+{
+	int n_pages = 0, n_unmaps = 0, dest_pid = ra_ptr2id(vm_space_ra, dest);
+	for(int i = 0; i < VPT_SIZE; i++) {
+		const struct vp_leaf *leaf = src->vpt[i];
+		if(leaf == NULL) continue;
+		int n = 0;
+		for(int j = 0; j < LARGE_PAGES; j++) {
+			const struct vp *cur = &leaf->pages[j];
+			if(cur->vaddr == 0 || !fork_copies(cur)) continue;
+			assert(!VP_IS_LARGE(cur));	/* see vm_fork() */
+			n++;
+			if((VP_RIGHTS(cur) & L4_Writable) && !VP_IS_SWAPPED(cur)) {
+				n_unmaps++;
+			}
+		}
+		if(n > 0) {
+			assert(dest->vpt[i] == NULL);
+			dest->vpt[i] = alloc_leaf();
+			if(dest->vpt[i] == NULL) return -ENOMEM;
+			n_pages += n;
+		}
+	}
+	L4_Word_t *unmaps = NULL;
+	if(n_unmaps > 0) {
+		unmaps = malloc(n_unmaps * sizeof *unmaps);
+		if(unmaps == NULL) return -ENOMEM;
+	}
+
+	/* NOTE: this walks @src's page table in address order, so @dest's gets
+	 * filled in leaf by leaf.
+	 */
+	int unmap_pos = 0;
+	uintptr_t pos = 0;
+	for(struct vp *cur = vp_next(src, &pos, ~0ul);
+		cur != NULL;
+		cur = vp_next(src, &pos, ~0ul))
+	{
+		assert(!VP_IS_COW(cur) || (~VP_RIGHTS(cur) & L4_Writable));
+		const uintptr_t vaddr = cur->vaddr & ~PAGE_MASK;
+
+/* (use this after lazy brk has been removed, subsequent to pf rejigger.) */
+#if 0
+		/* NOTE: for now, all pages are in memory. at some point swapped
+		 * pages and pages removed from page cache may appear.
+		 */
+		assert(cur->status & ~0x80000000);
+#endif
+
+		if(!fork_copies(cur)) {
+#ifdef TRACE_FORK
+			printf("vm: full pagecache page ignored at vaddr=%#x\n",
+				cur->vaddr & ~PAGE_MASK);
+#endif
+			continue;
+		}
+
+		/* can't fail since the leaf was allocated in the first pass. */
+		struct vp *copy = vp_new(dest, vaddr);
+		assert(copy != NULL);
+		if(VP_IS_SWAPPED(cur)) {
+			/* swapped pages get a compressed copy of their own, which costs
+			 * less than decompressing them for copy-on-write.
+			 */
+			*copy = (struct vp){
+				.vaddr = cur->vaddr,
+				.status = swap_dup(cur->status),
+				.age = 1,
+				.pid = dest_pid,
+			};
+			if(copy->status == 0) {
+				vp_del(copy);
+				n_pages = -ENOMEM;
+				break;
+			}
+		} else if(VP_IS_SHARED(cur)) {
+			/* shared pages get another reference and the show goes on.
+			 *
+			 * FIXME: this appears to be a dead case, since all pages shared
+			 * but not under copy-on-write are visible through the page cache.
+			 */
+#ifdef TRACE_FORK
+			printf("vm: forking shared page at vaddr=%#x\n",
+				cur->vaddr & ~PAGE_MASK);
+#endif
+			abort();	/* retain until hit */
+			*copy = (struct vp){
+				.vaddr = cur->vaddr,
+				.status = cur->status,
+				.age = 1,
+				.pid = dest_pid,
+			};
+			if(!add_share(cur->status, copy)) {
+				vp_del(copy);
+				n_pages = -ENOMEM;
+				break;
+			}
+		} else {
+			/* anonymous and private pages get copy-on-write. this applies
+			 * even if said pages were read-only right now and made writable
+			 * later, so both sides are marked regardless of access.
+			 */
+#ifdef TRACE_FORK
+			printf("vm: cow for anon/private page at vaddr=%#x\n",
+				cur->vaddr & ~PAGE_MASK);
+#endif
+			/* older TODO: indicate read-only sharing somewhere besides
+			 * share_table.
+			 */
+			bool unmap = !VP_IS_COW(cur) && (VP_RIGHTS(cur) & L4_Writable) != 0;
+			*copy = (struct vp){
+				.vaddr = (cur->vaddr & ~(L4_Writable | VPF_MERGED)) | VPF_COW,
+				.status = cur->status,
+				.age = 1,
+				.pid = dest_pid,
+			};
+			if(cur->status != zero_page && !add_share(cur->status, copy)) {
+				vp_del(copy);
+				n_pages = -ENOMEM;
+				break;
+			}
+
+			cur->vaddr |= VPF_COW;
+			if(unmap) {
+				cur->vaddr &= ~L4_Writable;
+				assert(unmap_pos < n_unmaps);
+				unmaps[unmap_pos++] = cur->status;
+			}
+		}
+	}
+
+	if(unmap_pos > 0) unmap_writable(unmaps, unmap_pos);
+	free(unmaps);
+	return n_pages;
+}
+
+
+static int vm_fork(pid_t srcpid, pid_t destpid)
+{
+	if(srcpid > SNEKS_MAX_PID || destpid > SNEKS_MAX_PID) return -EINVAL;
+
+	pid_t sender_pid = pidof_NP(muidl_get_sender());
+	if(sender_pid < SNEKS_MIN_SYSID) return -EINVAL;
+
+	mtx_lock(&vm_lock);
+	assert(invariants());
+	int n = 0;
+	struct vm_space *src;
+	if(srcpid == 0) {
+		/* spawn case. */
+		src = NULL;
+	} else if(srcpid <= SNEKS_MAX_PID) {
+		/* user fork case. */
+		src = ra_id2ptr(vm_space_ra, srcpid);
+		if(src->kip_area.raw == 0) { n = -EINVAL; goto end; }
+	} else {
+		/* values in between. */
+		n = -EINVAL;
+		goto end;
+	}
+
+	struct vm_space *dest = ra_alloc(vm_space_ra,
+		destpid > 0 ? destpid : -1);
+	if(dest == NULL) { n = -EEXIST; goto end; }
+	assert(destpid <= 0 || destpid == ra_ptr2id(vm_space_ra, dest));
+
+	dest->vpt = calloc(VPT_SIZE, sizeof *dest->vpt);
+	if(dest->vpt == NULL || mtx_init(&dest->lock, mtx_plain) != thrd_success) {
+		free(dest->vpt);
+		ra_free(vm_space_ra, dest);
+		n = -ENOMEM;
+		goto end;
+	}
+	dest->maps = RB_ROOT;
+	dest->as_free = RB_ROOT;
+	dest->last_mmap = &no_last_mmap;
+	if(src == NULL) {
+		/* creates an unconfigured address space as for spawn. caller should
+		 * use VM::configure() to set it up before causing page faults.
+		 */
+		dest->kip_area.raw = ~0ul;
+		dest->utcb_area = L4_Nilpage;
+		dest->brk = 0;
+		dest->mmap_bot = user_addr_max;
+	} else {
+		/* fork from @src. */
+		dest->kip_area = src->kip_area;
+		dest->utcb_area = src->utcb_area;
+		dest->sysinfo_area = src->sysinfo_area;
+		dest->brk = src->brk;
+		dest->mmap_bot = src->mmap_bot;
+		/* large pages are split ahead of copy-on-write, which works on small
+		 * pages only.
+		 */
+		mtx_lock(&src->lock);
+		mtx_lock(&dest->lock);
+		int eck = e_begin();
+		uintptr_t pos = 0;
+		for(struct vp *cur = vp_next(src, &pos, ~0ul);
+			cur != NULL;
+			cur = vp_next(src, &pos, ~0ul))
+		{
+			if(VP_IS_LARGE(cur)) split_large(cur);
+		}
+		e_end(eck);
+		n = fork_maps(src, dest);
+		if(n == 0) n = fork_as_free(src, dest);
+		if(n == 0) n = fork_pages(src, dest);
+		mtx_unlock(&src->lock);
+		if(n < 0) {
+			/* take down the partial child. */
+			eck = e_begin();
+			erase_space(dest);
+			e_end(eck);
+			goto end;
+		}
+		mtx_unlock(&dest->lock);
+	}
+	n = ra_ptr2id(vm_space_ra, dest);
+
+end:
+	assert(invariants());
+	mtx_unlock(&vm_lock);
+	return n;
+}
+
+
+static int vm_configure(
+	L4_Word_t *last_resv_p,
+	pid_t pid, L4_Fpage_t utcb, L4_Fpage_t kip)
+{
+	if(pid > SNEKS_MAX_PID) return -EINVAL;
+	L4_Fpage_t si = L4_FpageLog2(L4_Address(kip) + L4_Size(kip), PAGE_BITS);
+	if(fpage_overlap(kip, utcb) || fpage_overlap(si, utcb)) return -EINVAL;
+
+	/* (@sp isn't faulted on before this returns, so its own lock isn't
+	 * needed.)
+	 */
+	mtx_lock(&vm_lock);
+	assert(invariants());
+	int n = -EINVAL;
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, pid);
+	if(sp->kip_area.raw == 0) goto end;
+	if(sp->kip_area.raw != ~0ul || !L4_IsNilFpage(sp->utcb_area)) {
+		/* TODO: should be "illegal state" */
+		goto end;
+	}
+
+	sp->kip_area = kip;
+	sp->utcb_area = utcb;
+	sp->sysinfo_area = si;
+
+	/* anonymous memory between 0x10000 and min(kip.start, utcb.start,
+	 * si.start), exclusive.
+	 */
+	uintptr_t resv_low = min(L4_Address(sp->kip_area),
+		min(L4_Address(sp->utcb_area), L4_Address(sp->sysinfo_area)));
+	if(resv_low <= 0x10000) goto end;
+	struct lazy_mmap *lowmem = malloc(sizeof *lowmem);
+	if(lowmem == NULL) { n = -ENOMEM; goto end; }
+	*lowmem = (struct lazy_mmap){
+		.flags = L4_FullyAccessible << 16 | MAP_PRIVATE | MAP_ANONYMOUS,
+	};
+	int eck = e_begin();
+	n = reserve_mmap(lowmem, sp, 0x10000, resv_low - 0x10000, true);
+	e_end(eck);
+	if(n < 0) { free(lowmem); goto end; }
+	*last_resv_p = max(L4_Address(si) + L4_Size(si), L4_Address(utcb) + L4_Size(utcb)) - 1;
+
+end:
+	assert(invariants());
+	mtx_unlock(&vm_lock);
+	return n;
+}
+
+
+/* installs @data at @addr in @target_pid's space as fresh private anonymous
+ * memory under a single lazy_mmap, padded out with zeroes to a page
+ * boundary.
+ */
+static int vm_upload_pages(
+	pid_t target_pid, L4_Word_t addr,
+	const uint8_t *data, unsigned data_len,
+	int prot, int flags)
+{
+	if((addr & PAGE_MASK) != 0) return -EINVAL;
+	if(~flags & MAP_ANONYMOUS) return -EINVAL;	/* can't specify file */
+	if(~flags & MAP_FIXED) return -EINVAL;		/* per spec */
+	if(prot == 0) return -EINVAL;
+	if(flags & MAP_SHARED) return -ENOSYS;	/* FIXME when required */
+	if(~flags & MAP_PRIVATE) return -EINVAL;/* ^- wew lad */
+	size_t length = max_t(size_t, PAGE_SIZE, PAGE_CEIL(data_len));
+	if(!VALID_ADDR_SIZE(addr, length)) return -EINVAL;
+
+	mtx_lock(&vm_lock);
+	assert(invariants());
+	int n = -EINVAL;
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, target_pid);
+	if(unlikely(L4_IsNilFpage(sp->utcb_area))) goto end;
+
+	/* insert lazy_mmap to maintain "mmap or brk" invariants.
+	 * (i'm not sure if that's useful.)
+	 */
+	struct lazy_mmap *mm = malloc(sizeof *mm);
+	if(mm == NULL) { n = -ENOMEM; goto end; }
+	*mm = (struct lazy_mmap){
+		.flags = prot_to_l4_rights(prot) << 16
+			| (flags & ~(MAP_FIXED | MAP_POPULATE)),
+	};
+	mtx_lock(&sp->lock);
+	int eck = e_begin();
+	n = reserve_mmap(mm, sp, addr, length, true);
+	if(n < 0) {
+		free(mm);
+		goto unlock;
+	}
+	assert(mm->addr == addr && mm->length == length);
+	assert(~mm->flags & MAP_FIXED);
+
+	remove_vp_range(sp, addr, length);
+	for(size_t off = 0; off < length; off += PAGE_SIZE) {
+		struct vp *v = vp_new(sp, addr + off);
+		if(unlikely(v == NULL)) {
+			munmap_space(sp, addr, length);
+			n = -ENOMEM;
+			goto unlock;
+		}
+		v->vaddr |= prot_to_l4_rights(prot) | VPF_ANON;
+		v->age = 1;
+		assert(VP_RIGHTS(v) == prot_to_l4_rights(prot));
+
+		/* allocate fresh new anonymous memory for this. */
+		struct pl *link = get_free_pl();
+		if(unlikely(link == NULL)) {
+			vp_del(v);
+			munmap_space(sp, addr, length);
+			n = -ENOMEM;
+			goto unlock;
+		}
+		uint8_t *mem = (uint8_t *)(link->page_num << PAGE_BITS);
+		size_t part = off < data_len ? min_t(size_t, PAGE_SIZE, data_len - off) : 0;
+		memcpy(mem, data + off, part);
+		if(part < PAGE_SIZE) memset(mem + part, '\0', PAGE_SIZE - part);
+		push_page(&page_active_list, link);
+		e_free(link);
+		v->status = (L4_Word_t)mem >> PAGE_BITS;
+		atomic_store_explicit(&get_pp(v->status)->owner, v, memory_order_relaxed);
+	}
+
+unlock:
+	e_end(eck);
+	mtx_unlock(&sp->lock);
+end:
+	assert(invariants());
+	mtx_unlock(&vm_lock);
+	return n;
+}
+
+
+static int vm_upload_page(
+	pid_t target_pid, L4_Word_t addr,
+	const uint8_t *data, unsigned data_len,
+	int prot, int flags)
+{
+	return vm_upload_pages(target_pid, addr, data, data_len, prot, flags);
+}
+
+
+static void vm_breath_of_life(
+	L4_Word_t *rc_p,
+	L4_Word_t target_raw, L4_Word_t sp, L4_Word_t ip)
+{
+	L4_LoadMR(0, (L4_MsgTag_t){ .X.u = 2 }.raw);
+	L4_LoadMR(1, ip);
+	L4_LoadMR(2, sp);
+	L4_MsgTag_t tag = L4_Reply((L4_ThreadId_t){ .raw = target_raw });
+	*rc_p = L4_IpcFailed(tag) ? L4_ErrorCode() : 0;
+}
+
+
+static int vm_pager(L4_Word_t *pager_p, pid_t pid)
+{
+	if(pidof_NP(muidl_get_sender()) < SNEKS_MIN_SYSID) return -EPERM;
+	if(pid <= 0 || pid > SNEKS_MAX_PID) return -EINVAL;
+	*pager_p = service_tids[pid % n_service_threads].raw;
+	return 0;
+}
+
+
+static void vm_iopf(L4_Fpage_t fault, L4_Word_t fip, L4_MapItem_t *page_ptr)
+{
+	/* userspace tasks can't have I/O ports. at all. it is verboten. */
+	printf("%s: IO fault from pid=%d, ip=%#lx, port=%#lx:%#lx\n",
+		__func__, pidof_NP(muidl_get_sender()), fip,
+		L4_IoFpagePort(fault), L4_IoFpageSize(fault));
+	muidl_raise_no_reply();
+}
+
+
+/* breaks copy-on-write on @virt. returns the page to map, or L4_Nilpage when a
+ * copy was needed but there was no free memory, in which case nothing has
+ * changed.
+ */
+static L4_Fpage_t pf_cow(struct vp *virt)
+{
+	assert(VP_IS_COW(virt));
+	assert(~VP_RIGHTS(virt) & L4_Writable);
+
+	if(virt->status == zero_page) {
+		/* first write into a page of zeroes. */
+		assert(VP_IS_ANON(virt));
+		struct pl *newpl = get_free_pl();
+		if(newpl == NULL) return L4_Nilpage;
+		memset((void *)((uintptr_t)newpl->page_num << PAGE_BITS),
+			'\0', PAGE_SIZE);
+		virt->status = newpl->page_num;
+		virt->vaddr &= ~VPF_COW;
+		virt->vaddr |= L4_Writable;
+		atomic_store_explicit(&pl2pp(newpl)->owner, virt,
+			memory_order_release);
+		push_page(&page_active_list, newpl);
+		e_free(newpl);
+		goto map;
+	}
+
+	struct pp *phys = get_pp(virt->status);
+	struct vp *primary = atomic_load_explicit(&phys->owner,
+		memory_order_relaxed);
+	size_t hash = int_hash(virt->status);
+	/* is @virt the sole owner of the page, which isn't in the page cache?
+	 * when its share is secondary, it's one of those in share_table.
+	 */
+	bool sole = (primary == NULL || primary == virt) && VP_IS_ANON(virt)
+		&& !has_shares(hash, virt->status, primary == virt ? 1 : 2);
+	struct pl *newpl = NULL;
+	if(!sole && (newpl = get_free_pl(), newpl == NULL)) return L4_Nilpage;
+
+	if(primary != virt) {
+		/* our share was secondary; remove it. */
+		bool ok = htable_del(&share_table, hash, virt);
+		if(!ok) {
+			printf("%s: expected share, wasn't found???\n", __func__);
+			abort();
+		}
+	}
+	if(sole) {
+		/* take ownership. */
+		assert(primary == NULL || atomic_load(&phys->owner) == virt);
+		if(primary == NULL) {
+			/* take primary share. */
+			atomic_store_explicit(&phys->owner, virt, memory_order_relaxed);
+		}
+		virt->vaddr &= ~VPF_COW;
+		virt->vaddr |= L4_Writable;
+		/* (shared anonymous memory is never COW.) */
+		assert(~virt->vaddr & VPF_SHARED);
+	} else {
+		/* make a copy. */
+		if(primary == virt) {
+			/* drop primary share. */
+			atomic_store_explicit(&phys->owner, NULL, memory_order_relaxed);
+		}
+		memcpy((void *)((uintptr_t)newpl->page_num << PAGE_BITS),
+			(void *)((uintptr_t)virt->status << PAGE_BITS),
+			PAGE_SIZE);
+		virt->status = newpl->page_num;
+		virt->vaddr &= ~(VPF_COW | VPF_SHARED);
+		virt->vaddr |= L4_Writable | VPF_ANON;
+		atomic_store_explicit(&pl2pp(newpl)->owner, virt,
+			memory_order_release);
+		push_page(&page_active_list, newpl);
+		e_free(newpl);
+	}
+
+map:
+	if(virt->vaddr & VPF_MERGED) {
+		virt->vaddr &= ~VPF_MERGED;
+		n_unmerged++;
+	}
+	L4_Fpage_t map_page = L4_FpageLog2(virt->status << PAGE_BITS, PAGE_BITS);
+	L4_Set_Rights(&map_page, VP_RIGHTS(virt));
+	return map_page;
+}
+
+
+/* page cache fill thread. takes <struct pc_fill> off fill_queue, reads the
+ * page in, finishes the fill, and sends it to the service threads of the
+ * faults parked on it for completion.
+ */
+static noreturn int fill_thread_fn(void *param_ptr)
+{
+	for(;;) {
+		mtx_lock(&fill_lock);
+		while(fill_queue == NULL) cnd_wait(&fill_cond, &fill_lock);
+		struct pc_fill *fill = fill_queue;
+		fill_queue = fill->next;
+		if(fill_queue == NULL) fill_queue_tail = &fill_queue;
+		mtx_unlock(&fill_lock);
+
+		uint8_t *page = (uint8_t *)((uintptr_t)fill->link->page_num << PAGE_BITS);
+		unsigned length = PAGE_SIZE;
+		assert(fill->offset <= INT_MAX);
+		int n = __io_read(fill->file->fs, fill->file->fd, PAGE_SIZE, fill->offset,
+			page, &length);
+		if(n == 0 && length < PAGE_SIZE) {
+			/* file tail case */
+			memset(page + length, '\0', PAGE_SIZE - length);
+		}
+		fill->status = n == 0 ? length : (n > 0 ? -EIO : n);
+
+		mtx_lock(&vm_lock);
+		unsigned pagers = finish_fill(fill);
+		mtx_unlock(&vm_lock);
+		/* @fill may be gone once the first of these has been received. */
+		while(pagers != 0) {
+			int ix = ffsl(pagers) - 1;
+			pagers &= ~(1u << ix);
+			L4_LoadMR(0, (L4_MsgTag_t){ .X.label = FILL_DONE_LABEL, .X.u = 2 }.raw);
+			L4_LoadMR(1, (L4_Word_t)fill);
+			L4_LoadMR(2, ix);
+			L4_MsgTag_t tag = L4_Send(L4_LocalIdOf(service_tids[ix]));
+			if(L4_IpcFailed(tag)) {
+				printf("vm:%s: completion send to %d failed, ec=%lu\n",
+					__func__, ix, L4_ErrorCode());
+			}
+		}
+	}
+}
+
+
+/* takes @link out of the page cache and releases its page. */
+static void unlink_cached_page(struct pl *link)
+{
+	assert(e_inside());
+	assert(pl2pp(link)->owner == NULL);
+	atomic_store_explicit(&link->status, 0, memory_order_release);
+	push_page(&page_free_list, link);
+	if(!nbsl_del(pc_bucket_of(link), &link->nn)) {
+		printf("vm:%s: concurrent nbsl_del()?\n", __func__);
+		assert(false);
+	}
+	n_cached_pages--;
+	e_free(link);
+}
+
+
+/* removes @vp from its address space ahead of its page getting evicted. the
+ * next fault on it goes thru the page cache again.
+ */
+static void drop_vp(struct vp *vp)
+{
+	assert(!VP_IS_ANON(vp));
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, vp->pid);
+	mtx_lock(&sp->lock);
+	vp_del(vp);
+	mtx_unlock(&sp->lock);
+}
+
+
+/* drops the virtual pages that reference @link so that it can be evicted
+ * from the page cache. caller should unmap the page after this, and then
+ * unlink_cached_page() it.
+ */
+static void drop_cached_page(struct pl *link)
+{
+	assert(e_inside());
+	struct vp *owner = atomic_exchange(&pl2pp(link)->owner, NULL);
+	if(owner != NULL) drop_vp(owner);
+	size_t hash = int_hash(link->page_num);
+	struct htable_iter it;
+	for(struct vp *vp = htable_firstval(&share_table, &it, hash);
+		vp != NULL;
+		vp = htable_nextval(&share_table, &it, hash))
+	{
+		if(vp->status != link->page_num) continue;
+		htable_delval(&share_table, &it);
+		drop_vp(vp);
+	}
+}
+
+
+/* page replacement. this is a CLOCK over pc_buckets that samples the access
+ * bits of clean file-backed pages with rightless L4_UnmapFpages() in batches.
+ * pages that were referenced age up, those that weren't age down, and those
+ * already at zero are evicted. pages written thru a shared mapping become
+ * PL_DIRTY and stay put since there's no writeback; nor are shared anonymous
+ * pages or placeholders considered. returns the number of pages freed, which
+ * may be less than @want after two sweeps over the cache.
+ */
+static int reclaim_pages(int want)
+{
+	assert(e_inside());
+	static unsigned hand = 0;
+
+	/* the hand only sweeps pc_buckets, so a resize in progress is finished
+	 * first.
+	 */
+	if(pc_old != NULL) move_pc_buckets(n_pc_old);
+
+	int n_freed = 0, n_buckets = 0;
+	while(n_freed < want && n_buckets < 2 * n_pc_buckets) {
+		L4_Fpage_t fps[64];
+		struct pl *pls[ARRAY_SIZE(fps)];
+		int n = 0;
+		while(n < ARRAY_SIZE(fps) / 2 && n_buckets < 2 * n_pc_buckets) {
+			struct nbsl *list = &pc_buckets[hand];
+			hand = (hand + 1) & (n_pc_buckets - 1);
+			n_buckets++;
+			struct nbsl_iter it;
+			for(struct nbsl_node *cur = nbsl_first(list, &it);
+				cur != NULL && n < ARRAY_SIZE(fps);
+				cur = nbsl_next(list, &it))
+			{
+				struct pl *link = container_of(cur, struct pl, nn);
+				uint32_t st = atomic_load_explicit(&link->status,
+					memory_order_relaxed);
+				if(st == 0 || PL_STATE(st) != 1 || (st & PL_DIRTY)
+					|| PL_IS_ANON(link))
+				{
+					continue;
+				}
+				pls[n] = link;
+				fps[n] = L4_FpageLog2((uintptr_t)link->page_num << PAGE_BITS,
+					PAGE_BITS);
+				L4_Set_Rights(&fps[n], 0);
+				n++;
+			}
+		}
+		if(n == 0) continue;
+
+		L4_UnmapFpages(n, fps);
+		int n_victims = 0;
+		for(int i=0; i < n; i++) {
+			uint32_t st = atomic_load_explicit(&pls[i]->status,
+				memory_order_relaxed), age = PL_AGE(st);
+			if(L4_Rights(fps[i]) & L4_Writable) {
+				atomic_store_explicit(&pls[i]->status, st | PL_DIRTY,
+					memory_order_relaxed);
+				continue;
+			} else if(L4_Rights(fps[i]) != 0) {
+				age = min_t(uint32_t, age + 1, PL_MAX_AGE);
+			} else if(age > 0) {
+				age >>= 1;
+			} else {
+				/* gone. (reuses the front of both arrays.) */
+				pls[n_victims] = pls[i];
+				fps[n_victims] = L4_FpageLog2(
+					(uintptr_t)pls[i]->page_num << PAGE_BITS, PAGE_BITS);
+				L4_Set_Rights(&fps[n_victims], L4_FullyAccessible);
+				n_victims++;
+				continue;
+			}
+			atomic_store_explicit(&pls[i]->status, PL_LIVE_AGE(age),
+				memory_order_relaxed);
+		}
+		if(n_victims == 0) continue;
+
+		for(int i=0; i < n_victims; i++) drop_cached_page(pls[i]);
+		L4_UnmapFpages(n_victims, fps);
+		for(int i=0; i < n_victims; i++) unlink_cached_page(pls[i]);
+		n_freed += n_victims;
+	}
+
+	return n_freed;
+}
+
+
+/* whether @vp's page in @link may go to compressed swap: private anonymous
+ * memory that's solely owned, not a large page, and not the zero page.
+ */
+static inline bool swappable(const struct vp *vp, const struct pl *link) {
+	return VP_IS_ANON(vp) && !VP_IS_COW(vp) && !VP_IS_SHARED(vp)
+		&& !VP_IS_LARGE(vp) && PL_IS_PRIVATE(link);
+}
+
+
+/* page replacement into compressed swap. this is a CLOCK over physical
+ * frames much like reclaim_pages(), except that it looks at private
+ * anonymous pages via their owners, and those that age down to zero get
+ * compressed by swap_out_page() instead of evicted. returns the number of
+ * frames freed, which is about half the number of pages swapped out.
+ */
+static int swap_out_pages(int want)
+{
+	assert(e_inside());
+	static size_t hand = 0;
+
+	int n_freed = 0;
+	size_t n_seen = 0;
+	plbuf pls = darray_new();
+	while(n_freed < want && n_seen < 2 * pp_total) {
+		L4_Fpage_t fps[64];
+		struct pl *links[ARRAY_SIZE(fps)];
+		int n = 0;
+		for(; n < ARRAY_SIZE(fps) / 2 && n_seen < 2 * pp_total; n_seen++) {
+			uint32_t page_num = pp_first + hand;
+			hand = (hand + 1) % pp_total;
+			struct pp *phys = get_pp(page_num);
+			struct pl *link = atomic_load_explicit(&phys->link,
+				memory_order_relaxed);
+			struct vp *owner = atomic_load_explicit(&phys->owner,
+				memory_order_relaxed);
+			if(link == NULL || owner == NULL) continue;
+			uint32_t st = atomic_load_explicit(&link->status,
+				memory_order_relaxed);
+			if(PL_STATE(st) != 1 || (st & PL_LARGE)
+				|| !swappable(owner, link))
+			{
+				continue;
+			}
+			links[n] = link;
+			fps[n] = L4_FpageLog2((uintptr_t)page_num << PAGE_BITS, PAGE_BITS);
+			L4_Set_Rights(&fps[n], 0);
+			n++;
+		}
+		if(n == 0) continue;
+
+		L4_UnmapFpages(n, fps);
+		int n_victims = 0;
+		for(int i=0; i < n; i++) {
+			uint32_t st = atomic_load_explicit(&links[i]->status,
+				memory_order_relaxed), age = PL_AGE(st);
+			if(L4_Rights(fps[i]) != 0) {
+				age = min_t(uint32_t, age + 1, PL_MAX_AGE);
+			} else if(age > 0) {
+				age >>= 1;
+			} else {
+				/* gone. (reuses the front of both arrays.) */
+				links[n_victims] = links[i];
+				fps[n_victims] = L4_FpageLog2(
+					(uintptr_t)links[i]->page_num << PAGE_BITS, PAGE_BITS);
+				L4_Set_Rights(&fps[n_victims], L4_FullyAccessible);
+				n_victims++;
+				continue;
+			}
+			atomic_store_explicit(&links[i]->status, PL_LIVE_AGE(age),
+				memory_order_relaxed);
+		}
+		if(n_victims == 0) continue;
+
+		/* the owners' spaces are locked across the unmap so that the fault
+		 * fast path can't restore a mapping before the page is compressed.
+		 */
+		struct vm_space *sps[ARRAY_SIZE(fps)];
+		int n_sps = 0;
+		for(int i=0; i < n_victims; i++) {
+			struct vp *vp = atomic_load_explicit(&pl2pp(links[i])->owner,
+				memory_order_relaxed);
+			struct vm_space *sp = ra_id2ptr(vm_space_ra, vp->pid);
+			int j = 0;
+			while(j < n_sps && sps[j] != sp) j++;
+			if(j == n_sps) {
+				mtx_lock(&sp->lock);
+				sps[n_sps++] = sp;
+			}
+		}
+		L4_UnmapFpages(n_victims, fps);
+		for(int i=0; i < n_victims; i++) {
+			struct vp *vp = atomic_load_explicit(&pl2pp(links[i])->owner,
+				memory_order_relaxed);
+			unsigned long before = n_swap_frames;
+			if(!swap_out_page(vp, &pls)) {
+				/* incompressible. come back to it later. */
+				atomic_store_explicit(&links[i]->status,
+					PL_LIVE_AGE(PL_MAX_AGE), memory_order_relaxed);
+			} else if(n_swap_frames == before) {
+				n_freed++;
+			}
+		}
+		for(int i=0; i < n_sps; i++) mtx_unlock(&sps[i]->lock);
+	}
+	flush_plbuf(&pls);
+
+	return n_freed;
+}
+
+
+/* moves loaned frames that sysmem has returned from page_loan_list back to
+ * page_free_list. caller holds vm_lock. returns how many.
+ */
+static int reclaim_loans(void)
+{
+	assert(e_inside());
+	if(atomic_load_explicit(&n_returned_pages, memory_order_acquire) == 0) {
+		return 0;
+	}
+	int n = 0;
+	struct nbsl_iter it;
+	for(struct nbsl_node *cur = nbsl_first(&page_loan_list, &it);
+		cur != NULL;
+		cur = nbsl_next(&page_loan_list, &it))
+	{
+		struct pl *link = container_of(cur, struct pl, nn);
+		if(atomic_load_explicit(&link->status,
+			memory_order_acquire) != PL_RETURNED)
+		{
+			continue;
+		}
+		push_page(&page_free_list, link);
+		if(!nbsl_del_at(&page_loan_list, &it)) {
+			printf("vm:%s: concurrent nbsl_del_at()?\n", __func__);
+			assert(false);
+		}
+		e_free(link);
+		n++;
+	}
+	atomic_fetch_sub_explicit(&n_returned_pages, n, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&n_loaned_pages, n, memory_order_relaxed);
+	return n;
+}
+
+
+/* runs page replacement when free memory has dropped under the low
+ * watermark, until it's over the high one or nothing more can be evicted.
+ * this happens at the start of fault handling and after page cache fills,
+ * where no <struct vp> or page cache links are held. caller holds vm_lock but
+ * no space locks, since victims' spaces get locked on the way.
+ */
+static void balance_free_pages(void)
+{
+	unsigned long n_free = atomic_load_explicit(&n_free_pages,
+		memory_order_relaxed);
+	if(likely(n_free >= free_low_wm)) return;
+
+	int eck = e_begin(), n = 0;
+	/* free large frames are broken up before anything gets evicted. */
+	while(n_free < free_high_wm && break_large_frame()) {
+		n_free = atomic_load_explicit(&n_free_pages, memory_order_relaxed);
+	}
+	if(n_free < free_low_wm) n = reclaim_pages(free_high_wm - n_free);
+	/* and then private anonymous memory goes to compressed swap. */
+	n_free = atomic_load_explicit(&n_free_pages, memory_order_relaxed);
+	if(n_free < free_low_wm) n += swap_out_pages(free_high_wm - n_free);
+	e_end(eck);
+	/* finally, frames that sysmem has borrowed. */
+	n_free = atomic_load_explicit(&n_free_pages, memory_order_relaxed);
+	unsigned long n_loaned = atomic_load_explicit(&n_loaned_pages,
+		memory_order_relaxed);
+	if(n_free < free_low_wm && n_loaned > 0) {
+		int32_t got = 0;
+		int err = __sysmem_shrink(L4_Pager(), &got,
+			min_t(unsigned long, n_loaned, free_high_wm - n_free));
+		if(err != 0) {
+			printf("vm:%s: Sysmem::shrink failed, err=%d\n", __func__, err);
+		} else {
+			/* the balloon thread can't have them while we hold vm_lock. */
+			eck = e_begin();
+			reclaim_loans();
+			e_end(eck);
+			n += got;
+			n_free = atomic_load_explicit(&n_free_pages, memory_order_relaxed);
+		}
+	}
+	if(n == 0 && n_free < free_low_wm / 2) {
+		printf("vm:%s: low on memory (%lu pages free), nothing to evict\n",
+			__func__, n_free);
+	}
+}
+
+
+/* whether @phys may be merged into by merge_frame(): a private anonymous
+ * page that's either copy-on-write, or exclusive and write-protected for the
+ * duration.
+ */
+static bool merge_target(const struct pp *phys)
+{
+	struct pl *link = atomic_load_explicit(&phys->link, memory_order_relaxed);
+	struct vp *owner = atomic_load_explicit(&phys->owner, memory_order_relaxed);
+	if(link == NULL || owner == NULL || !PL_IS_PRIVATE(link)) return false;
+	uint32_t st = atomic_load_explicit(&link->status, memory_order_relaxed);
+	return PL_STATE(st) == 1 && (~st & PL_LARGE)
+		&& VP_IS_ANON(owner) && !VP_IS_SHARED(owner) && !VP_IS_LARGE(owner);
+}
+
+
+/* takes write access to @vp's page away from its space, leaving the vp as it
+ * was so that the fault fast path restores it once @vp's space is unlocked.
+ */
+static void revoke_write(const struct vp *vp)
+{
+	if(~VP_RIGHTS(vp) & L4_Writable) return;
+	L4_Fpage_t fp = vp_fpage(vp);
+	L4_Set_Rights(&fp, L4_Writable);
+	L4_UnmapFpages(1, &fp);
+}
+
+
+/* puts @vp under copy-on-write of @page_num, and marks it merged. this
+ * applies whether @vp is writable or not, since it'll be sharing the frame.
+ */
+static void merge_vp(struct vp *vp, uint32_t page_num)
+{
+	vp->status = page_num;
+	vp->vaddr |= VPF_MERGED | VPF_COW;
+	vp->vaddr &= ~L4_Writable;
+}
+
+
+/* lists @phys in merge_table as a target for frames whose contents hash to
+ * @sum. when the table can't grow, @phys's sum is forgotten instead so that
+ * it'll be looked at afresh on the next pass.
+ */
+static void offer_merge_target(struct pp *phys, uint32_t sum)
+{
+	merge_sums[ra_ptr2id(pp_ra, phys)] = sum;
+	if(!htable_add(&merge_table, sum, phys)) {
+		merge_sums[ra_ptr2id(pp_ra, phys)] = ~sum;
+	}
+}
+
+
+/* visits the frame @page_num for same-page merging. when it's an exclusive
+ * private anonymous page whose contents haven't changed since the last pass,
+ * or @cold is set, it's merged into the zero page or a frame found in
+ * merge_table with the same contents and released; or added to merge_table
+ * itself when there's none. caller holds vm_lock but no space locks.
+ */
+static void merge_frame(uint32_t page_num, bool cold, plbuf *plbuf)
+{
+	assert(e_inside());
+	struct pp *phys = get_pp(page_num);
+	if(!merge_target(phys)) return;
+
+	const uint32_t *mem = (const uint32_t *)((uintptr_t)page_num << PAGE_BITS);
+	uint32_t sum = hash(mem, PAGE_SIZE / sizeof *mem, 0),
+		*prev = &merge_sums[page_num - pp_first];
+	struct vp *vp = atomic_load_explicit(&phys->owner, memory_order_relaxed);
+	struct pl *link = atomic_load_explicit(&phys->link, memory_order_relaxed);
+	if(VP_IS_COW(vp) || has_shares(int_hash(page_num), page_num, 1)) {
+		/* can't change while write-protected, so it's fine as a target. */
+		offer_merge_target(phys, sum);
+		return;
+	}
+	if(*prev != sum && !cold) {
+		/* changed since the last pass. */
+		*prev = sum;
+		return;
+	}
+	*prev = sum;
+
+	struct vm_space *sp = ra_id2ptr(vm_space_ra, vp->pid), *other = NULL;
+	mtx_lock(&sp->lock);
+	revoke_write(vp);
+	uint32_t into = 0;
+	struct vp *into_vp = NULL;
+	if(memcmp(mem, (void *)((uintptr_t)zero_page << PAGE_BITS), PAGE_SIZE) == 0) {
+		into = zero_page;
+	} else {
+		struct htable_iter it;
+		for(struct pp *cand = htable_firstval(&merge_table, &it, sum);
+			cand != NULL && into == 0;
+			cand = htable_nextval(&merge_table, &it, sum))
+		{
+			if(merge_sums[ra_ptr2id(pp_ra, cand)] != sum || cand == phys
+				|| !merge_target(cand))
+			{
+				continue;
 			}
-
-			if(unmap) {
-				L4_Fpage_t phys = L4_FpageLog2(
-					cur->status << PAGE_BITS, PAGE_BITS);
-				L4_Set_Rights(&phys, L4_Writable);
-				unmaps[unmap_pos++] = phys;
-				if(unmap_pos == ARRAY_SIZE(unmaps)) {
-					L4_UnmapFpages(ARRAY_SIZE(unmaps), unmaps);
-					unmap_pos = 0;
-				}
+			struct vp *cv = atomic_load_explicit(&cand->owner,
+				memory_order_relaxed);
+			struct vm_space *csp = ra_id2ptr(vm_space_ra, cv->pid);
+			if(csp != sp) mtx_lock(&csp->lock);
+			revoke_write(cv);
+			uint32_t cand_num = cv->status;
+			if(memcmp(mem, (void *)((uintptr_t)cand_num << PAGE_BITS),
+				PAGE_SIZE) == 0)
+			{
+				into = cand_num;
+				into_vp = cv;
+				other = csp != sp ? csp : NULL;
+			} else if(csp != sp) {
+				mtx_unlock(&csp->lock);
 			}
 		}
-
-		n_pages++; copy = NULL;
 	}
-	free(copy);
-
-end:
-	if(unmap_pos > 0) L4_UnmapFpages(unmap_pos, unmaps);
-	return n_pages;
 
-Enomem:
-	n_pages = -ENOMEM;
-	goto end;
+	bool ok = into != 0;
+	if(ok && into != zero_page) {
+		vp->status = into;
+		ok = add_share(into, vp);
+		if(!ok) vp->status = page_num;	/* out of memory; leave it be. */
+	}
+	if(into == 0) {
+		offer_merge_target(phys, sum);
+	} else if(ok) {
+		/* no one gets to see the old frame after this. the target's owner
+		 * shares its frame from now on, so it goes under copy-on-write too.
+		 */
+		merge_vp(vp, into);
+		if(into_vp != NULL) merge_vp(into_vp, into);
+		L4_Fpage_t fp = L4_FpageLog2((uintptr_t)page_num << PAGE_BITS,
+			PAGE_BITS);
+		L4_Set_Rights(&fp, L4_FullyAccessible);
+		L4_UnmapFpages(1, &fp);
+		struct vp *old = atomic_exchange(&phys->owner, NULL);
+		assert(old == vp);
+		struct pl *l = atomic_exchange(&phys->link, NULL);
+		assert(l == link);
+		free_page(link, plbuf);
+		n_merged++;
+	}
+	if(other != NULL) mtx_unlock(&other->lock);
+	mtx_unlock(&sp->lock);
 }
 
 
-static int vm_fork(pid_t srcpid, pid_t destpid)
+/* visits the next @n_frames physical frames for same-page merging. a new
+ * pass starts over with an empty merge_table, since pages listed there may
+ * have changed since.
+ */
+static void merge_pages(int n_frames)
 {
-	assert(invariants());
-	if(srcpid > SNEKS_MAX_PID || destpid > SNEKS_MAX_PID) return -EINVAL;
-
-	pid_t sender_pid = pidof_NP(muidl_get_sender());
-	if(sender_pid < SNEKS_MIN_SYSID) return -EINVAL;
+	assert(e_inside());
+	static size_t hand = 0;
+#ifdef DEBUG_ME_HARDER
+	static unsigned long prev_merged = 0, prev_unmerged = 0;
+#endif
 
-	struct vm_space *src;
-	if(srcpid == 0) {
-		/* spawn case. */
-		src = NULL;
-	} else if(srcpid <= SNEKS_MAX_PID) {
-		/* user fork case. */
-		src = ra_id2ptr(vm_space_ra, srcpid);
-		if(src->kip_area.raw == 0) return -EINVAL;
-	} else {
-		/* values in between. */
-		return -EINVAL;
+	plbuf pls = darray_new();
+	for(int i=0; i < n_frames; i++) {
+		merge_frame(pp_first + hand, false, &pls);
+		hand = (hand + 1) % pp_total;
+		if(hand != 0) continue;
+		htable_clear(&merge_table);
+#ifdef DEBUG_ME_HARDER
+		if(n_merged != prev_merged || n_unmerged != prev_unmerged) {
+			printf("vm: merged %lu pages, %lu since written\n",
+				n_merged, n_unmerged);
+			prev_merged = n_merged;
+			prev_unmerged = n_unmerged;
+		}
+#endif
 	}
+	flush_plbuf(&pls);
+}
 
-	struct vm_space *dest = ra_alloc(vm_space_ra,
-		destpid > 0 ? destpid : -1);
-	if(dest == NULL) return -EEXIST;
-	assert(destpid <= 0 || destpid == ra_ptr2id(vm_space_ra, dest));
 
-	htable_init(&dest->pages, &hash_vp_by_vaddr, NULL);
-	dest->maps = RB_ROOT;
-	dest->as_free = RB_ROOT;
-	dest->last_mmap = &no_last_mmap;
-	if(src == NULL) {
-		/* creates an unconfigured address space as for spawn. caller should
-		 * use VM::configure() to set it up before causing page faults.
-		 */
-		dest->kip_area.raw = ~0ul;
-		dest->utcb_area = L4_Nilpage;
-		dest->brk = 0;
-		dest->mmap_bot = user_addr_max;
-	} else {
-		/* fork from @src. */
-		dest->kip_area = src->kip_area;
-		dest->utcb_area = src->utcb_area;
-		dest->sysinfo_area = src->sysinfo_area;
-		dest->brk = src->brk;
-		dest->mmap_bot = src->mmap_bot;
-		int n = fork_maps(src, dest);
-		if(n == 0) n = fork_pages(src, dest);
-		if(n < 0) {
-			/* FIXME: cleanup */
-			return n;
-		}
+/* same-page merging thread. runs merge_pages() every MERGE_INTERVAL_MS,
+ * which bounds the rate at merge_batch frames per interval.
+ */
+static noreturn int merge_thread_fn(void *param_ptr)
+{
+	for(;;) {
+		L4_Sleep(L4_TimePeriod(MERGE_INTERVAL_MS * 1000));
+		mtx_lock(&vm_lock);
+		int eck = e_begin();
+		merge_pages(merge_batch);
+		assert(invariants());
+		e_end(eck);
+		mtx_unlock(&vm_lock);
 	}
-
-	assert(invariants());
-	return ra_ptr2id(vm_space_ra, dest);
 }
 
 
-static int vm_configure(
-	L4_Word_t *last_resv_p,
-	pid_t pid, L4_Fpage_t utcb, L4_Fpage_t kip)
+/* balloon thread. lends free frames to sysmem under its memory pressure as
+ * long as we're over the high watermark, and takes them back when sysmem
+ * returns them; see <sneks/mm.h> for the protocol.
+ *
+ * sysmem waits on this thread for the reply, and whoever holds vm_lock may be
+ * waiting on sysmem in turn, so vm_lock is only tried for; without it no
+ * frame is offered, and the list work is left for the next message or for
+ * when BALLOON_OFFER_MS passes without one. the parts that may malloc() or
+ * free(), and thereby call Sysmem::brk, come after the reply's been sent.
+ */
+static int balloon_thread_fn(void *param_ptr)
 {
-	assert(invariants());
-	if(pid > SNEKS_MAX_PID) return -EINVAL;
-	struct vm_space *sp = ra_id2ptr(vm_space_ra, pid);
-	if(sp->kip_area.raw == 0) return -EINVAL;
-	if(sp->kip_area.raw != ~0ul || !L4_IsNilFpage(sp->utcb_area)) {
-		/* TODO: should be "illegal state" */
-		return -EINVAL;
+	L4_ThreadId_t sysmem_tid = L4_Pager(), sender;
+	L4_Accept(L4_UntypedWordsAcceptor);
+	L4_LoadMR(0, (L4_MsgTag_t){ .X.label = BALLOON_HELLO }.raw);
+	L4_MsgTag_t tag = L4_Call(sysmem_tid);
+	if(L4_IpcFailed(tag)) {
+		printf("vm:%s: can't introduce balloon thread, ec=%lu\n", __func__,
+			L4_ErrorCode());
+		return 0;
 	}
-	L4_Fpage_t si = L4_FpageLog2(L4_Address(kip) + L4_Size(kip), PAGE_BITS);
-	if(fpage_overlap(kip, utcb) || fpage_overlap(si, utcb)) return -EINVAL;
 
-	sp->kip_area = kip;
-	sp->utcb_area = utcb;
-	sp->sysinfo_area = si;
+	struct pl *offer = NULL;	/* on page_offer_list */
+	bool granted = false;	/* offer was taken, but hasn't moved yet */
+	for(;;) {
+		bool pending = offer != NULL
+			|| atomic_load_explicit(&n_returned_pages, memory_order_relaxed) > 0;
+		L4_Accept(L4_MapGrantItems(L4_CompleteAddressSpace));
+		tag = L4_Wait_Timeout(
+			pending ? L4_TimePeriod(BALLOON_OFFER_MS * 1000) : L4_Never,
+			&sender);
+		L4_Accept(L4_UntypedWordsAcceptor);
+		bool timeout = false;
+		if(L4_IpcFailed(tag)) {
+			if(L4_ErrorCode() != 3) {
+				printf("vm:%s: ipc failed, ec=%lu\n", __func__, L4_ErrorCode());
+				continue;
+			}
+			timeout = true;
+		} else if(!L4_SameThreads(sender, sysmem_tid)) {
+			continue;
+		}
 
-	/* anonymous memory between 0x10000 and min(kip.start, utcb.start,
-	 * si.start), exclusive.
-	 */
-	uintptr_t resv_low = min(L4_Address(sp->kip_area),
-		min(L4_Address(sp->utcb_area), L4_Address(sp->sysinfo_area)));
-	if(resv_low <= 0x10000) return -EINVAL;
-	struct lazy_mmap *lowmem = malloc(sizeof *lowmem);
-	if(lowmem == NULL) return -ENOMEM;
-	*lowmem = (struct lazy_mmap){
-		.flags = L4_FullyAccessible << 16 | MAP_PRIVATE | MAP_ANONYMOUS,
-	};
-	int eck = e_begin();
-	int n = reserve_mmap(lowmem, sp, 0x10000, resv_low - 0x10000, true);
-	e_end(eck);
-	if(n < 0) { free(lowmem); return n; }
+		bool locked = mtx_trylock(&vm_lock) == thrd_success;
+		int eck = e_begin();
+		struct pl *popped = NULL;
+		bool revoke = timeout && !granted;
+		if(!timeout) {
+			L4_Fpage_t fp = offer == NULL || granted ? L4_Nilpage
+				: L4_FpageLog2((L4_Word_t)offer->page_num << PAGE_BITS, PAGE_BITS);
+			bool grant = false;
+			switch(L4_Label(tag)) {
+				case BALLOON_WANT:
+					if(locked && offer == NULL
+						&& atomic_load_explicit(&n_free_pages,
+							memory_order_relaxed) > free_high_wm)
+					{
+						struct nbsl_node *nod = nbsl_pop(&page_free_list);
+						if(nod != NULL) {
+							atomic_fetch_sub_explicit(&n_free_pages, 1,
+								memory_order_relaxed);
+							offer = popped = container_of(nod, struct pl, nn);
+							fp = L4_FpageLog2(
+								(L4_Word_t)offer->page_num << PAGE_BITS, PAGE_BITS);
+						}
+					}
+					L4_LoadMR(0, (L4_MsgTag_t){
+						.X.label = BALLOON_OFFER, .X.u = 1 }.raw);
+					L4_LoadMR(1, fp.raw);
+					break;
+				case BALLOON_TAKE:
+					if(L4_IsNilFpage(fp)) L4_LoadMR(0, 0);
+					else {
+						L4_Set_Rights(&fp, L4_FullyAccessible);
+						L4_GrantItem_t gi = L4_GrantItem(fp, 0);
+						L4_LoadMR(0, (L4_MsgTag_t){ .X.t = 2 }.raw);
+						L4_LoadMRs(1, 2, gi.raw);
+						grant = true;
+					}
+					break;
+				case BALLOON_RETURN: {
+					L4_Word_t addr;
+					L4_StoreMR(1, &addr);
+					struct pl *link = atomic_load_explicit(
+						&get_pp(addr >> PAGE_BITS)->link, memory_order_relaxed);
+					assert(link != NULL && link->page_num == addr >> PAGE_BITS);
+					if(link == offer) {
+						/* back before it was moved onto page_loan_list. */
+						assert(granted);
+						granted = false;
+						revoke = true;
+					} else {
+						atomic_store_explicit(&link->status, PL_RETURNED,
+							memory_order_release);
+						atomic_fetch_add_explicit(&n_returned_pages, 1,
+							memory_order_release);
+					}
+					L4_LoadMR(0, 0);
+					break;
+				}
+				default:
+					printf("vm:%s: unknown label=%#lx\n", __func__, L4_Label(tag));
+					L4_LoadMR(0, 0);
+					break;
+			}
+			/* a failed grant leaves the offer standing. */
+			if(L4_IpcSucceeded(L4_Reply(sender)) && grant) granted = true;
+		}
 
-	assert(invariants());
-	*last_resv_p = max(L4_Address(si) + L4_Size(si), L4_Address(utcb) + L4_Size(utcb)) - 1;
-	return 0;
+		if(locked) {
+			if(popped != NULL) {
+				push_page(&page_offer_list, popped);
+				offer = atomic_load_explicit(&pl2pp(popped)->link,
+					memory_order_relaxed);
+				e_free(popped);
+			}
+			if(offer != NULL && (granted || revoke)) {
+				push_page(granted ? &page_loan_list : &page_free_list, offer);
+				if(!nbsl_del(&page_offer_list, &offer->nn)) {
+					printf("vm:%s: concurrent nbsl_del()?\n", __func__);
+					assert(false);
+				}
+				e_free(offer);
+				if(granted) {
+					atomic_fetch_add_explicit(&n_loaned_pages, 1,
+						memory_order_relaxed);
+				}
+				offer = NULL;
+				granted = false;
+			}
+			reclaim_loans();
+		}
+		e_end(eck);
+		if(locked) mtx_unlock(&vm_lock);
+	}
 }
 
 
-static int vm_upload_page(
-	pid_t target_pid, L4_Word_t addr,
-	const uint8_t *data, unsigned data_len,
-	int prot, int flags)
+/* inserts a placeholder for page @bump of @mm into the page cache and queues
+ * its fill. returns 0 and the placeholder in *@cached_p, or an existing link
+ * found in its place; or negative errno.
+ */
+static int start_fill(
+	struct pl **cached_p,
+	struct nbsl_node *top, const struct lazy_mmap *mm, int bump)
 {
-	assert(invariants());
-	struct vm_space *sp = ra_id2ptr(vm_space_ra, target_pid);
-	if(unlikely(L4_IsNilFpage(sp->utcb_area))) return -EINVAL;
-	if((addr & PAGE_MASK) != 0) return -EINVAL;
-	if(~flags & MAP_ANONYMOUS) return -EINVAL;	/* can't specify file */
-	if(~flags & MAP_FIXED) return -EINVAL;		/* per spec */
-	if(prot == 0) return -EINVAL;
-	if(flags & MAP_SHARED) return -ENOSYS;	/* FIXME when required */
-	if(~flags & MAP_PRIVATE) return -EINVAL;/* ^- wew lad */
-
-	struct vp *v = malloc(sizeof *v);
-	if(unlikely(v == NULL)) return -ENOMEM;
-	v->vaddr = addr | prot_to_l4_rights(prot) | VPF_ANON;
-	v->age = 1;
-	assert(VP_RIGHTS(v) == prot_to_l4_rights(prot));
+	assert(e_inside());
+	assert(~mm->flags & MAP_ANONYMOUS);
+	assert(mm->file != NULL);
 
-	/* insert lazy_mmap to maintain "mmap or brk" invariants.
-	 * (i'm not sure if that's useful.)
+	struct pc_fill *fill = malloc(sizeof *fill);
+	if(fill == NULL) return -ENOMEM;
+	/* (it's ok to modify link->foo since those fields are unused in the
+	 * freelist. push_cached_page() always adds a new link.)
 	 */
-	struct lazy_mmap *mm = malloc(sizeof *mm);
-	if(mm == NULL) {
-		free(v);
+	struct pl *link = get_free_pl();
+	if(link == NULL) {
+		free(fill);
 		return -ENOMEM;
 	}
-	*mm = (struct lazy_mmap){
-		.flags = VP_RIGHTS(v) << 16 | (flags & ~MAP_FIXED),
-	};
-	int eck = e_begin();
-	int n = reserve_mmap(mm, sp, addr, PAGE_SIZE, true);
+	link->fsid_ino = (uint64_t)pidof_NP(mm->fd_serv) << 48
+		| (mm->ino & ~(0xffffull << 48));
+	assert(PL_FSID(link) == pidof_NP(mm->fd_serv));
+	assert(PL_INO(link) == mm->ino);
+	link->offset = mm->offset + bump;
+	int n = push_cached_page(cached_p, top, link, PL_FILLING);
 	if(n < 0) {
-		free(v);
-		free(mm);
-		e_end(eck);
-		return n;
-	}
-	assert(mm->addr == addr && mm->length == PAGE_SIZE);
-	assert(~mm->flags & MAP_FIXED);
-
-	size_t hash = int_hash(addr);
-	struct vp *old = htable_pop(&sp->pages, hash, &cmp_vp_to_vaddr, &addr);
-	if(old != NULL) {
-		plbuf pls = darray_new();
-		remove_vp(old, &pls);
-		flush_plbuf(&pls);
-	}
-
-	/* allocate fresh new anonymous memory for this. */
-	struct pl *link = get_free_pl();
-	uint8_t *mem = (uint8_t *)(link->page_num << PAGE_BITS);
-	memcpy(mem, data, data_len);
-	if(data_len < PAGE_SIZE) {
-		memset(mem + data_len, '\0', PAGE_SIZE - data_len);
+		push_page(&page_free_list, link);
+		e_free(link);
+		free(fill);
+		return n == -EEXIST ? 0 : n;
 	}
-	push_page(&page_active_list, link);
 	e_free(link);
-	v->status = (L4_Word_t)mem >> PAGE_BITS;
-	atomic_store_explicit(&get_pp(v->status)->owner, v, memory_order_relaxed);
-	e_end(eck);
 
-	/* plunk it in there. */
-	assert(hash_vp_by_vaddr(v, NULL) == hash);
-	bool ok = htable_add(&sp->pages, hash, v);
-	if(unlikely(!ok)) {
-		/* FIXME: roll back and return an error. */
-		printf("%s: can't handle failing htable_add()!\n", __func__);
-		abort();
+	*fill = (struct pc_fill){
+		.link = *cached_p, .file = mm->file,
+		.offset = (size_t)(mm->offset + bump) * PAGE_SIZE,
+	};
+	if(!htable_add(&fill_table, hash_fill_by_page(fill, NULL), fill)) {
+		unlink_cached_page(fill->link);
+		free(fill);
+		return -ENOMEM;
 	}
+	fill->file->refs++;
 
-	assert(invariants());
-	return 0;
-}
-
+	mtx_lock(&fill_lock);
+	*fill_queue_tail = fill;
+	fill_queue_tail = &fill->next;
+	cnd_signal(&fill_cond);
+	mtx_unlock(&fill_lock);
 
-static void vm_breath_of_life(
-	L4_Word_t *rc_p,
-	L4_Word_t target_raw, L4_Word_t sp, L4_Word_t ip)
-{
-	L4_LoadMR(0, (L4_MsgTag_t){ .X.u = 2 }.raw);
-	L4_LoadMR(1, ip);
-	L4_LoadMR(2, sp);
-	L4_MsgTag_t tag = L4_Reply((L4_ThreadId_t){ .raw = target_raw });
-	*rc_p = L4_IpcFailed(tag) ? L4_ErrorCode() : 0;
+	return 0;
 }
 
 
-static void vm_iopf(L4_Fpage_t fault, L4_Word_t fip, L4_MapItem_t *page_ptr)
+/* parks the fault @w on the fill of placeholder @link. returns -EAGAIN on
+ * success, as fetch_cached_page() does.
+ */
+static int park_fault(struct pl *link, const struct pf_wait *w)
 {
-	assert(invariants());
-
-	/* userspace tasks can't have I/O ports. at all. it is verboten. */
-	printf("%s: IO fault from pid=%d, ip=%#lx, port=%#lx:%#lx\n",
-		__func__, pidof_NP(muidl_get_sender()), fip,
-		L4_IoFpagePort(fault), L4_IoFpageSize(fault));
-	muidl_raise_no_reply();
+	struct pc_fill *fill = htable_get(&fill_table, int_hash(link->page_num),
+		&cmp_fill_to_page, &(uint32_t){ link->page_num });
+	assert(fill != NULL);
+	struct pf_wait *copy = malloc(sizeof *copy);
+	if(copy == NULL) return -ENOMEM;
+	*copy = *w;
+	copy->next = fill->waiters;
+	fill->waiters = copy;
+	TRACE_FAULT("vm:%s: faddr=%#lx parked on phys=%#lx\n", __func__,
+		w->faddr, (unsigned long)link->page_num << PAGE_BITS);
+	return -EAGAIN;
 }
 
 
-static L4_Fpage_t pf_cow(struct vp *virt)
+/* detect sequential access thru the page cache on @mm and read pages ahead
+ * of @bump when it occurs. the window starts at MIN_READAHEAD pages and
+ * doubles up to MAX_READAHEAD each time it's issued, which happens once the
+ * fault position has gone past the middle of the previous window. the slack
+ * in "sequential" is so that fault-around doesn't hide the pattern.
+ *
+ * MADV_RANDOM turns readahead off, and MADV_SEQUENTIAL assumes sequential
+ * access from the start with the largest window.
+ */
+static void readahead(struct lazy_mmap *mm, int bump)
 {
-	assert(VP_IS_COW(virt));
-	assert(~VP_RIGHTS(virt) & L4_Writable);
+	assert(~mm->flags & MAP_ANONYMOUS);
+	if(mm->advice == MADV_RANDOM) return;
+	if(mm->advice != MADV_SEQUENTIAL
+		&& (bump <= mm->ra_prev
+			|| bump - mm->ra_prev > 1 << MAX_FAULT_AROUND_LOG2))
+	{
+		/* random access, or the first one. */
+		if(bump != mm->ra_prev) mm->ra_size = 0;
+		mm->ra_prev = bump;
+		return;
+	}
+	mm->ra_prev = bump;
+	if(mm->ra_size > 0 && bump + mm->ra_size / 2 < mm->ra_end) return;
 
-	struct pp *phys = get_pp(virt->status);
-	struct vp *primary = atomic_load_explicit(&phys->owner,
-		memory_order_relaxed);
-	size_t hash = int_hash(virt->status);
-	if(primary != virt) {
-		/* our share was secondary; remove it. */
-		bool ok = htable_del(&share_table, hash, virt);
-		if(!ok) {
-			printf("%s: expected share, wasn't found???\n", __func__);
-			abort();
-		}
+	if(mm->advice == MADV_SEQUENTIAL) mm->ra_size = MAX_READAHEAD;
+	else {
+		mm->ra_size = mm->ra_size == 0 ? MIN_READAHEAD
+			: min_t(int, mm->ra_size * 2, MAX_READAHEAD);
 	}
-	/* is @virt the sole owner of the page, which isn't in the page cache? */
-	if((primary == NULL || primary == virt) && VP_IS_ANON(virt)
-		&& !has_shares(hash, virt->status, 1))
-	{
-		/* it is. take ownership. */
-		assert(primary == NULL || atomic_load(&phys->owner) == virt);
-		if(primary == NULL) {
-			/* take primary share. */
-			atomic_store_explicit(&phys->owner, virt, memory_order_relaxed);
-		}
-		virt->vaddr &= ~VPF_COW;
-		virt->vaddr |= L4_Writable;
-		/* (shared anonymous memory is never COW.) */
-		assert(~virt->vaddr & VPF_SHARED);
-	} else {
-		/* no. make a copy. */
-		if(primary == virt) {
-			/* drop primary share. */
-			atomic_store_explicit(&phys->owner, NULL, memory_order_relaxed);
+	uint32_t first = max_t(uint32_t, mm->ra_end, bump + 1),
+		last = min_t(uint32_t, bump + 1 + mm->ra_size,
+			mm->length >> PAGE_BITS);
+	TRACE_FAULT("vm:%s: pages [%u, %u) of %x:%lx\n", __func__, first, last,
+		pidof_NP(mm->fd_serv), (unsigned long)mm->ino);
+	for(uint32_t p = first; p < last; p++) {
+		if(atomic_load_explicit(&n_free_pages, memory_order_relaxed) < free_low_wm) {
+			last = p;
+			break;
 		}
-		struct pl *newpl = get_free_pl();
-		memcpy((void *)((uintptr_t)newpl->page_num << PAGE_BITS),
-			(void *)((uintptr_t)virt->status << PAGE_BITS),
-			PAGE_SIZE);
-		virt->status = newpl->page_num;
-		virt->vaddr &= ~(VPF_COW | VPF_SHARED);
-		virt->vaddr |= L4_Writable | VPF_ANON;
-		atomic_store_explicit(&pl2pp(newpl)->owner, virt,
-			memory_order_release);
-		push_page(&page_active_list, newpl);
-		e_free(newpl);
+		struct nbsl_node *top;
+		struct pl *cached = find_cached_page(&top, mm, p);
+		if(cached == NULL && start_fill(&cached, top, mm, p) < 0) break;
 	}
-
-	L4_Fpage_t map_page = L4_FpageLog2(virt->status << PAGE_BITS, PAGE_BITS);
-	L4_Set_Rights(&map_page, VP_RIGHTS(virt));
-	return map_page;
-}
-
-
-static ssize_t read_at(const struct lazy_mmap *mm,
-	void *buf, unsigned length, size_t offset)
-{
-	assert(offset <= INT_MAX);
-	int n = __io_read(mm->fd_serv, mm->ino, length, offset, buf, &length);
-	if(n != 0) return n > 0 ? -EIO : n; else return length;
+	mm->ra_end = max_t(uint32_t, mm->ra_end, last);
 }
 
 
-/* finds the cached page, or reads it from @mm if it's not in cache.
- * @bump is # of pages from @mm start. @vp is the virtual page that'll take
- * ownership of a freshly-loaded page. return value is negative errno, or 0
- * when found, or 1 when loaded. *@cached_p will be filled in.
- *
- * TODO: in the future this function will do some sort of continuation
- * business to allow vm to respond while waiting for IO. for now, not so much.
- * this'll also require some way to wait on ongoing fetches, so the actual
- * item that lands in the page cache may also be a placeholder.
+/* finds page @bump of @mm in the page cache. on a miss anonymous pages are
+ * created right away, while file-backed ones get a placeholder and a queued
+ * fill. return value is 0 when *@cached_p was filled in; -EAGAIN when the
+ * page isn't there yet and @w, if not NULL, was parked on its fill; or
+ * negative errno.
  */
 static int fetch_cached_page(
 	struct pl **cached_p,
-	const struct lazy_mmap *mm, int bump, struct vp *vp)
+	struct lazy_mmap *mm, int bump, const struct pf_wait *w)
 {
 	assert(e_inside());
 	struct nbsl_node *top;
@@ -2022,63 +4982,38 @@ static int fetch_cached_page(
 		TRACE_FAULT("vm:%s:pc hit on %x:%lx:%x\n", __func__,
 			pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
 			mm->offset + bump);
-		*cached_p = cached;
-		return 0;
-	} else {
-		/* allocate, read, and try to insert. */
+	} else if(mm->flags & MAP_ANONYMOUS) {
+		/* shared anonymous memory is there for the taking. */
 		struct pl *link = get_free_pl();
-		void *page = (void *)((uintptr_t)link->page_num << PAGE_BITS);
-		unsigned n_bytes;
-		if(mm->flags & MAP_ANONYMOUS) n_bytes = 0;
-		else {
-			ssize_t n = read_at(mm, page, PAGE_SIZE,
-				(mm->offset + bump) * PAGE_SIZE);
-			if(unlikely(n < 0)) {
-				push_page(&page_free_list, link);
-				e_free(link);
-				return n;
-			}
-			n_bytes = n;
-			if(n_bytes < PAGE_SIZE) {
-				TRACE_FAULT("vm:%s: short read (got %u bytes)\n",
-					__func__, n_bytes);
-			}
-		}
-		if(n_bytes < PAGE_SIZE) {
-			memset(page + n_bytes, '\0', PAGE_SIZE - n_bytes);
-		}
-
-		/* insert. (it's ok to modify link->foo since those fields are unused
-		 * in the freelist. push_cached_page() always adds a new link.)
-		 */
+		if(link == NULL) return -ENOMEM;
+		memset((void *)((uintptr_t)link->page_num << PAGE_BITS), '\0',
+			PAGE_SIZE);
 		link->fsid_ino = (uint64_t)pidof_NP(mm->fd_serv) << 48
 			| (mm->ino & ~(0xffffull << 48));
-		assert(PL_FSID(link) == pidof_NP(mm->fd_serv));
-		assert(PL_INO(link) == mm->ino);
 		link->offset = mm->offset + bump;
-		atomic_store(&pl2pp(link)->owner, vp);
-		int n = push_cached_page(&cached, top, link);
-		if(n == 0) {
-			assert(cached != NULL);
-			TRACE_FAULT("vm:%s:pc miss on %x:%lx:%x, vp'=%p, phys=%p\n", __func__,
-				pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
-				mm->offset + bump, vp, pl2pp(link));
-			n = 1;	/* actual miss and insert */
-			assert(pl2pp(cached)->owner == vp);
-		} else {
-			assert(n == -EEXIST);
-			push_page(&page_free_list, link);
-			assert(cached != NULL);
-			TRACE_FAULT("vm:%s:pc false miss on %x:%lx:%x\n", __func__,
-				pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
-				mm->offset + bump);
-			n = 0;	/* it's a hit after all */
-		}
+		int n = push_cached_page(&cached, top, link, PL_LIVE_AGE(1));
+		if(n < 0) push_page(&page_free_list, link);
 		e_free(link);
+		if(n < 0 && n != -EEXIST) return n;
+		TRACE_FAULT("vm:%s:pc %s on %x:%lx:%x\n", __func__,
+			n == 0 ? "miss" : "near-miss", pidof_NP(mm->fd_serv),
+			(unsigned long)mm->ino, mm->offset + bump);
+	} else {
+		int n = start_fill(&cached, top, mm, bump);
+		if(n < 0) return n;
+		TRACE_FAULT("vm:%s:pc miss on %x:%lx:%x, phys=%p\n", __func__,
+			pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
+			mm->offset + bump, pl2pp(cached));
+	}
+	assert(cached != NULL);
 
-		*cached_p = cached;
-		return n;
+	if(~mm->flags & MAP_ANONYMOUS) readahead(mm, bump);
+	if(PL_STATE(atomic_load_explicit(&cached->status, memory_order_acquire)) == PL_FILLING) {
+		return w != NULL ? park_fault(cached, w) : -EAGAIN;
 	}
+
+	*cached_p = cached;
+	return 0;
 }
 
 
@@ -2087,66 +5022,14 @@ static int fetch_cached_page(
  */
 static int pf_mmap_shared(
 	L4_Fpage_t *map_page_p, struct vp *vp,	/* out */
-	const struct lazy_mmap *mm, L4_Word_t faddr, int fault_rwx)
+	struct lazy_mmap *mm, L4_Word_t faddr, const struct pf_wait *w)
 {
 	assert(e_inside());
 
-	struct nbsl_node *top;
-	int bump = ((faddr & ~PAGE_MASK) - mm->addr) >> PAGE_BITS;
-	struct pl *cached = find_cached_page(&top, mm, bump);
-	if(cached == NULL) {
-		/* allocate. */
-		struct pl *link = get_free_pl();
-		void *page = (void *)((uintptr_t)link->page_num << PAGE_BITS);
-		unsigned n_bytes;
-		if(mm->flags & MAP_ANONYMOUS) n_bytes = 0;
-		else {
-			ssize_t n = read_at(mm, page, PAGE_SIZE,
-				mm->offset * PAGE_SIZE + ((faddr & ~PAGE_MASK) - mm->addr));
-			if(unlikely(n < 0)) {
-				push_page(&page_free_list, link);
-				e_free(link);
-				return n;
-			}
-			n_bytes = n;
-#ifdef TRACE_FAULTS
-			if(n_bytes < PAGE_SIZE) {
-				TRACE_FAULT("vm:%s: short read (got %u bytes)\n", __func__, n_bytes);
-			}
-#endif
-		}
-		if(n_bytes < PAGE_SIZE) {
-			/* file tail case */
-			memset(page + n_bytes, '\0', PAGE_SIZE - n_bytes);
-		}
-
-		/* insert. (it's ok to modify link->foo since those fields are unused
-		 * in the freelist. push_cached_page() always adds a new link.)
-		 */
-		link->fsid_ino = (uint64_t)pidof_NP(mm->fd_serv) << 48
-			| (mm->ino & ~(0xffffull << 48));
-		assert(PL_FSID(link) == pidof_NP(mm->fd_serv));
-		assert(PL_INO(link) == mm->ino);
-		link->offset = mm->offset + bump;
-		int n = push_cached_page(&cached, top, link);
-		if(n == 0) {
-			TRACE_FAULT("vm:%s:pc miss on %x:%lx:%x, vp'=%p, phys=%p\n", __func__,
-				pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
-				mm->offset + bump, vp, pl2pp(link));
-		} else {
-			assert(n == -EEXIST);
-			push_page(&page_free_list, link);
-			assert(cached != NULL);
-			TRACE_FAULT("vm:%s:pc near-miss on %x:%lx:%x\n", __func__,
-				pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
-				mm->offset + bump);
-		}
-		e_free(link);
-	} else {
-		TRACE_FAULT("vm:%s:pc hit on %x:%lx:%x\n", __func__,
-			pidof_NP(mm->fd_serv), (unsigned long)mm->ino,
-			mm->offset + bump);
-	}
+	struct pl *cached;
+	int n = fetch_cached_page(&cached, mm,
+		((faddr & ~PAGE_MASK) - mm->addr) >> PAGE_BITS, w);
+	if(n < 0) return n;
 	assert(cached != NULL);
 
 	if((faddr & ~PAGE_MASK) == mm->addr + mm->length - PAGE_SIZE && mm->tailsz < PAGE_SIZE) {
@@ -2155,6 +5038,7 @@ static int pf_mmap_shared(
 		 */
 		TRACE_FAULT("vm:%s:tail case (->tailsz=%u)\n", __func__, mm->tailsz);
 		struct pl *link = get_free_pl();
+		if(link == NULL) return -ENOMEM;
 		*map_page_p = L4_FpageLog2(link->page_num << PAGE_BITS, PAGE_BITS);
 		uint8_t *mem = (uint8_t *)(link->page_num << PAGE_BITS);
 		memcpy(mem, (uint8_t *)(cached->page_num << PAGE_BITS), mm->tailsz);
@@ -2172,8 +5056,7 @@ static int pf_mmap_shared(
 		 * add_share().
 		 */
 		vp->status = cached->page_num;
-		int n = add_share(cached->page_num, vp);
-		if(n < 0) return n;
+		if(!add_share(cached->page_num, vp)) return -ENOMEM;
 		*map_page_p = L4_FpageLog2(cached->page_num << PAGE_BITS, PAGE_BITS);
 		vp->vaddr |= VPF_SHARED;
 	}
@@ -2189,18 +5072,19 @@ static int pf_mmap_shared(
  */
 static int pf_mmap_private(
 	L4_Fpage_t *map_page_p, struct vp *vp,	/* out */
-	const struct lazy_mmap *mm, L4_Word_t faddr, int fault_rwx)
+	struct lazy_mmap *mm, L4_Word_t faddr, const struct pf_wait *w)
 {
 	assert(e_inside());
-	assert(fault_rwx & L4_Writable);
+	assert(w->fault_rwx & L4_Writable);
 
 	struct pl *cached;
 	int offset = ((faddr & ~PAGE_MASK) - mm->addr) >> PAGE_BITS,
-		n = fetch_cached_page(&cached, mm, offset, vp);
+		n = fetch_cached_page(&cached, mm, offset, w);
 	if(n < 0) return n;
 	assert(cached != NULL);
 
 	struct pl *link = get_free_pl();
+	if(link == NULL) return -ENOMEM;
 	*map_page_p = L4_FpageLog2((uintptr_t)link->page_num << PAGE_BITS,
 		PAGE_BITS);
 	void *page_mem = (void *)L4_Address(*map_page_p),
@@ -2219,35 +5103,232 @@ static int pf_mmap_private(
 	assert(!VP_IS_SHARED(vp));
 	assert(!VP_IS_COW(vp));
 
-	if(n == 1) {
-		/* drop ownership of the freshly-loaded page. */
-		struct vp *old = atomic_exchange(&pl2pp(cached)->owner, NULL);
-		assert(old == vp);
+	return 0;
+}
+
+
+/* gives the page at @addr in @mm a <struct vp> in @sp if that can be done
+ * without IO: the zero page when @zero is set, otherwise a zeroed fresh page
+ * for private anonymous memory, and what's already in the page cache for
+ * everything else. the tail page of a file map is skipped since it'd need a
+ * private copy. returns 1 and the new vp in *@vp_p, 0 when the page was
+ * skipped, or -ENOMEM when memory ran low.
+ */
+static int prefault_page(
+	struct vp **vp_p, struct vm_space *sp, const struct lazy_mmap *mm,
+	uintptr_t addr, bool zero)
+{
+	assert(e_inside());
+	assert(vp_get(sp, addr) == NULL);
+	const bool anon_private = (mm->flags & MAP_ANONYMOUS)
+		&& (~mm->flags & MAP_SHARED);
+	assert(!zero || anon_private);
+	if(!anon_private && addr == mm->addr + mm->length - PAGE_SIZE
+		&& mm->tailsz < PAGE_SIZE)
+	{
+		return 0;
 	}
 
-	return 0;
+	struct pl *link = NULL;
+	if(zero) {
+		/* nothing to allocate. */
+	} else if(anon_private) {
+		link = try_get_free_pl();
+		if(link == NULL) return -ENOMEM;
+	} else {
+		struct nbsl_node *top;
+		link = find_cached_page(&top, mm, (addr - mm->addr) >> PAGE_BITS);
+		if(link == NULL || PL_STATE(atomic_load_explicit(&link->status,
+			memory_order_acquire)) == PL_FILLING)
+		{
+			return 0;
+		}
+	}
+
+	struct vp *vp = vp_new(sp, addr);
+	if(unlikely(vp == NULL)) {
+		if(anon_private && link != NULL) {
+			push_page(&page_free_list, link);
+			e_free(link);
+		}
+		return -ENOMEM;
+	}
+	vp->vaddr |= (mm->flags >> 16) & 7;
+	vp->status = zero ? zero_page : link->page_num;
+	vp->age = 1;
+	if(zero) {
+		vp->vaddr |= VPF_ANON;
+		if(vp->vaddr & L4_Writable) {
+			vp->vaddr |= VPF_COW;
+			vp->vaddr &= ~L4_Writable;
+		}
+	} else if(anon_private) {
+		memset((void *)((uintptr_t)link->page_num << PAGE_BITS),
+			'\0', PAGE_SIZE);
+		vp->vaddr |= VPF_ANON;
+		atomic_store_explicit(&pl2pp(link)->owner, vp,
+			memory_order_relaxed);
+		push_page(&page_active_list, link);
+		e_free(link);
+	} else {
+		if(!add_share(vp->status, vp)) {
+			vp_del(vp);
+			return -ENOMEM;
+		}
+		vp->vaddr |= VPF_SHARED;
+		/* copy-on-write as for read faults on private file maps. */
+		if((~mm->flags & MAP_SHARED) && (vp->vaddr & L4_Writable)) {
+			vp->vaddr |= VPF_COW;
+			vp->vaddr &= ~L4_Writable;
+		}
+	}
+
+	*vp_p = vp;
+	return 1;
 }
 
 
-static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
+/* resolves pages in @mm that lie in the aligned fault-around window of
+ * @faddr_page and don't yet have a <struct vp> in @sp, per prefault_page():
+ * private anonymous memory gets the zero page or zeroed fresh pages depending
+ * on whether @fault_rwx was a write. MADV_RANDOM and MADV_SEQUENTIAL shrink
+ * and grow the window unless mmap(2) set its size. returns the number of map
+ * items stored in @items, which has room for @max.
+ */
+static int fault_around(
+	L4_MapItem_t *items, int max,
+	struct vm_space *sp, const struct lazy_mmap *mm, L4_Word_t faddr_page,
+	int fault_rwx)
+{
+	assert(e_inside());
+
+	int log2 = mm->around > 0 ? mm->around - 1
+		: mm->advice == MADV_RANDOM ? 0
+		: mm->advice == MADV_SEQUENTIAL ? MAX_FAULT_AROUND_LOG2
+		: fault_around_log2;
+	log2 = min_t(int, log2, MAX_FAULT_AROUND_LOG2);
+	if(log2 <= 0) return 0;
+	uintptr_t window = faddr_page & ~((PAGE_SIZE << log2) - 1),
+		first = max_t(uintptr_t, window, mm->addr),
+		last = min_t(uintptr_t, window + (PAGE_SIZE << log2),
+			mm->addr + mm->length);
+	const bool zero = (mm->flags & MAP_ANONYMOUS) && (~mm->flags & MAP_SHARED)
+		&& (~fault_rwx & L4_Writable);
+
+	int n = 0;
+	for(uintptr_t addr = first; addr < last && n < max; addr += PAGE_SIZE) {
+		if(addr == faddr_page || vp_get(sp, addr) != NULL) continue;
+		struct vp *vp;
+		int m = prefault_page(&vp, sp, mm, addr, zero);
+		if(m < 0) break; else if(m == 0) continue;
+
+		TRACE_FAULT("vm:%s: also vaddr=%#lx, phys=%#lx\n", __func__,
+			(unsigned long)addr, (unsigned long)vp->status << PAGE_BITS);
+		L4_Fpage_t fp = L4_FpageLog2((uintptr_t)vp->status << PAGE_BITS,
+			PAGE_BITS);
+		L4_Set_Rights(&fp, VP_RIGHTS(vp));
+		items[n++] = L4_MapItem(fp, addr);
+	}
+
+	return n;
+}
+
+
+/* replies to a fault by @dest with @n_items map items. this is done by hand
+ * when there's more than one, since L4X2::FaultHandler carries just the one,
+ * and for faults replayed after a page cache fill.
+ */
+static void reply_fault(L4_ThreadId_t dest, const L4_MapItem_t *items, int n_items)
 {
-	int n, pid = pidof_NP(muidl_get_sender());
+	assert(n_items > 0 && n_items <= 1 << MAX_FAULT_AROUND_LOG2);
+	L4_LoadMR(0, (L4_MsgTag_t){ .X.t = 2 * n_items }.raw);
+	for(int i=0; i < n_items; i++) L4_LoadMRs(1 + i * 2, 2, items[i].raw);
+	L4_MsgTag_t tag = L4_Reply(dest);
+	if(L4_IpcFailed(tag)) {
+		printf("vm:%s: reply to %lu:%lu failed, ec=%lu\n", __func__,
+			L4_ThreadNo(dest), L4_Version(dest), L4_ErrorCode());
+	}
+}
+
+
+/* pop a signal on the faulting process. */
+static void kill_faulter(const struct pf_wait *w, int sig)
+{
+	int pid = pidof_NP(w->sender);
+	printf("%s: %s in pid=%d at faddr=%#lx fip=%#lx\n", __func__,
+		sig == SIGSEGV ? "segfault" : sig == SIGKILL ? "out of memory"
+			: "bus error", pid, w->faddr, w->fip);
+	int n = __proc_kill(__uapi_tid, pid, sig);
+	if(n != 0) {
+		printf("%s: Proc::kill() failed, n=%d\n", __func__, n);
+	}
+}
+
+
+/* returns the address space that @w came from, or NULL when it should be
+ * ignored. the space isn't locked, but can't go away while it has threads
+ * that fault.
+ */
+static struct vm_space *fault_space(const struct pf_wait *w)
+{
+	int pid = pidof_NP(w->sender);
 	if(unlikely(pid > SNEKS_MAX_PID)) {
 		printf("%s: fault from pid=%d (tid=%lu:%lu)?\n", __func__, pid,
-			L4_ThreadNo(muidl_get_sender()), L4_Version(muidl_get_sender()));
-		muidl_raise_no_reply();
-		return;
+			L4_ThreadNo(w->sender), L4_Version(w->sender));
+		return NULL;
 	}
 	struct vm_space *sp = ra_id2ptr(vm_space_ra, pid);
 	if(unlikely(L4_IsNilFpage(sp->utcb_area))) {
 		printf("%s: faulted into uninitialized space (pid=%d)\n", __func__, pid);
-		muidl_raise_no_reply();
-		return;
+		return NULL;
 	}
+	return sp;
+}
+
+
+/* fault fast path. pages that are resident and already have the access
+ * asked for get their mapping restored without vm_lock, which covers refaults
+ * after fork() and after access was revoked by page replacement. returns 1
+ * with the map item in *@item, or 0 when resolve_fault() should have a go.
+ * caller holds @sp's lock and replies before releasing it.
+ */
+static int remap_fault(L4_MapItem_t *item, struct vm_space *sp, const struct pf_wait *w)
+{
+	struct vp *v = vp_get(sp, w->faddr & ~PAGE_MASK);
+	if(v == NULL || VP_IS_SWAPPED(v)
+		|| (VP_RIGHTS(v) & w->fault_rwx) != w->fault_rwx)
+	{
+		return 0;
+	}
+	L4_Fpage_t fp = vp_fpage(v);
+	L4_Set_Rights(&fp, VP_RIGHTS(v));
+	*item = L4_MapItem(fp, v->vaddr & ~PAGE_MASK);
+	return 1;
+}
+
+
+/* whether the mapping of @sp's copy-on-write page @v permits writing. */
+static inline bool cow_writable(struct vm_space *sp, const struct vp *v)
+{
+	const struct lazy_mmap *mm = find_lazy_mmap(sp, v->vaddr & ~PAGE_MASK);
+	return mm != NULL && (((mm->flags >> 16) & 7) & L4_Writable);
+}
+
 
-	const int fault_rwx = L4_Label(muidl_get_tag()) & 7;
+/* resolves the fault @w in @sp. returns the number of map items stored in
+ * @items, the first of which is for the faulting page; -EFAULT on
+ * segmentation violation; -EAGAIN when @w was parked on a page cache fill;
+ * -ENOMEM when free memory ran out, leaving things as they were; or some
+ * other negative errno when the fault should be ignored. caller holds vm_lock
+ * and @sp's lock.
+ */
+static int resolve_fault(L4_MapItem_t *items, struct vm_space *sp, const struct pf_wait *w)
+{
+	int n;
+	const L4_Word_t faddr = w->faddr;
+	const int fault_rwx = w->fault_rwx;
 	TRACE_FAULT("%s: pid=%d, faddr=%#lx, fip=%#lx, [%c%c%c]",
-		__func__, pid, faddr, fip,
+		__func__, pidof_NP(w->sender), faddr, w->fip,
 		(fault_rwx & L4_Readable) != 0 ? 'r' : '-',
 		(fault_rwx & L4_Writable) != 0 ? 'w' : '-',
 		(fault_rwx & L4_eXecutable) != 0 ? 'x' : '-');
@@ -2256,12 +5337,22 @@ static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
 	assert(invariants());
 
 	L4_Fpage_t map_page;
-	L4_Word_t faddr_page = faddr & ~PAGE_MASK;
-	size_t hash = int_hash(faddr_page);
-	struct vp *old = htable_get(&sp->pages, hash, &cmp_vp_to_vaddr, &faddr_page);
-	if(old != NULL && VP_IS_COW(old) && (fault_rwx & L4_Writable)) {
+	int n_items = 1;
+	L4_Word_t faddr_page = faddr & ~PAGE_MASK, map_base = faddr_page;
+	struct vp *old = vp_get(sp, faddr_page);
+	if(old != NULL && VP_IS_SWAPPED(old)
+		&& (VP_RIGHTS(old) & fault_rwx) == fault_rwx)
+	{
+		TRACE_FAULT("  swap-in\n");
+		if(!swap_in_page(old)) goto nomem;
+		/* and remap, below. */
+	}
+	if(old != NULL && VP_IS_COW(old) && (fault_rwx & L4_Writable)
+		&& cow_writable(sp, old))
+	{
 		TRACE_FAULT("  copy-on-write\n");
 		map_page = pf_cow(old);
+		if(L4_IsNilFpage(map_page)) goto nomem;
 		goto reply;
 	} else if(old != NULL && (VP_RIGHTS(old) & fault_rwx) != fault_rwx) {
 		TRACE_FAULT("  no access!!!\n");
@@ -2271,7 +5362,8 @@ static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
 	} else if(old != NULL) {
 		/* quick remap or expand. */
 		TRACE_FAULT("  remap\n");
-		map_page = L4_FpageLog2(old->status << PAGE_BITS, PAGE_BITS);
+		map_page = vp_fpage(old);
+		map_base = old->vaddr & ~PAGE_MASK;
 		L4_Set_Rights(&map_page, VP_RIGHTS(old));
 		goto reply;
 	} else if(unlikely(ADDR_IN_FPAGE(sp->sysinfo_area, faddr))) {
@@ -2296,19 +5388,33 @@ static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
 		}
 	}
 
-	struct vp *vp = malloc(sizeof *vp);
+	/* writes into private anonymous memory may get a large page. */
+	struct pl *large = NULL;
+	if((mm->flags & MAP_ANONYMOUS) && (~mm->flags & MAP_SHARED)
+		&& (fault_rwx & L4_Writable))
+	{
+		large = try_get_large_pl(sp, mm, faddr);
+		if(large != NULL) map_base = faddr & ~LARGE_MASK;
+	}
+	struct vp *vp = vp_new(sp, map_base);
 	if(unlikely(vp == NULL)) {
-		/* FIXME */
-		abort();
+		if(large != NULL) {
+			push_large_page(&large_free_list, large);
+			e_free(large);
+		}
+		goto nomem;
 	}
-	*vp = (struct vp){ .vaddr = faddr_page | rights, .age = 1 };
+	vp->vaddr |= rights | (large != NULL ? VPF_LARGE : 0);
+	vp->age = 1;
 
 	if((mm->flags & MAP_SHARED)
 		|| ((~fault_rwx & L4_Writable) && (~mm->flags & MAP_ANONYMOUS)))
 	{
 		TRACE_FAULT("  mmap/shared\n");
 		/* look for it in the page cache, or load from a file. */
-		n = pf_mmap_shared(&map_page, vp, mm, faddr, fault_rwx);
+		n = pf_mmap_shared(&map_page, vp, mm, faddr, w);
+		if(n == -EAGAIN) goto parked;
+		if(n == -ENOMEM) goto nomem_vp;
 		if(n != 0) {
 			printf("pf_mmap_shared failed! n=%d\n", n);
 			abort();
@@ -2321,16 +5427,33 @@ static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
 				vp->vaddr &= ~L4_Writable;
 			}
 		}
+	} else if((mm->flags & MAP_ANONYMOUS) && (~fault_rwx & L4_Writable)) {
+		TRACE_FAULT("  mmap/anon/zero\n");
+		/* reads get the zero page until written. */
+		map_page = L4_FpageLog2((uintptr_t)zero_page << PAGE_BITS, PAGE_BITS);
+		vp->vaddr |= VPF_ANON;
+		if(vp->vaddr & L4_Writable) {
+			vp->vaddr |= VPF_COW;
+			vp->vaddr &= ~L4_Writable;
+		}
 	} else if(mm->flags & MAP_ANONYMOUS) {
-		TRACE_FAULT("  mmap/anon\n");
-		struct pl *link;
-		link = get_free_pl();
-		map_page = L4_FpageLog2((uintptr_t)link->page_num << PAGE_BITS,
-			PAGE_BITS);
-		memset((void *)L4_Address(map_page), '\0', PAGE_SIZE);
+		struct pl *link = large;
+		if(link != NULL) {
+			TRACE_FAULT("  mmap/anon/large\n");
+			map_page = L4_FpageLog2((uintptr_t)link->page_num << PAGE_BITS,
+				LARGE_BITS);
+		} else {
+			TRACE_FAULT("  mmap/anon\n");
+			link = get_free_pl();
+			if(link == NULL) goto nomem_vp;
+			map_page = L4_FpageLog2((uintptr_t)link->page_num << PAGE_BITS,
+				PAGE_BITS);
+		}
+		memset((void *)L4_Address(map_page), '\0', L4_Size(map_page));
 		TRACE_FAULT("vm:%s: sets owner to vp=%p\n", __func__, vp);
 		atomic_store_explicit(&pl2pp(link)->owner, vp, memory_order_relaxed);
-		push_page(&page_active_list, link);
+		if(VP_IS_LARGE(vp)) push_large_page(&page_active_list, link);
+		else push_page(&page_active_list, link);
 		e_free(link);
 		vp->vaddr |= VPF_ANON;
 	} else {
@@ -2338,7 +5461,9 @@ static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
 		/* writes into private file maps; insert-or-lookup in page cache and
 		 * make a copy.
 		 */
-		n = pf_mmap_private(&map_page, vp, mm, faddr, fault_rwx);
+		n = pf_mmap_private(&map_page, vp, mm, faddr, w);
+		if(n == -EAGAIN) goto parked;
+		if(n == -ENOMEM) goto nomem_vp;
 		if(n != 0) {
 			printf("pf_mmap_private failed! n=%d\n", n);
 			abort();
@@ -2349,30 +5474,239 @@ static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
 	vp->status = L4_Address(map_page) >> PAGE_BITS;
 	L4_Set_Rights(&map_page, VP_RIGHTS(vp));
 
-	bool ok = htable_add(&sp->pages, hash_vp_by_vaddr(vp, NULL), vp);
-	if(unlikely(!ok)) {
-		/* FIXME: roll back and segfault. */
-		printf("%s: can't handle failing htable_add()!\n", __func__);
-		abort();
+	if(!VP_IS_LARGE(vp)) {
+		n_items += fault_around(&items[1], (1 << MAX_FAULT_AROUND_LOG2) - 1,
+			sp, mm, faddr_page, fault_rwx);
 	}
 
 reply:
+	items[0] = L4_MapItem(map_page, map_base);
+end:
 	assert(invariants());
-	*map_out = L4_MapItem(map_page, faddr_page);
 	e_end(eck);
-	return;
+	return n_items;
+
+parked:
+	/* to be replayed by complete_fill(). */
+	TRACE_FAULT("  parked\n");
+	vp_del(vp);
+	n_items = -EAGAIN;
+	goto end;
+
+nomem_vp:
+	vp_del(vp);
+nomem:
+	TRACE_FAULT("  out of memory\n");
+	n_items = -ENOMEM;
+	goto end;
 
 segv:
-	/* pop segfault and don't reply. */
-	printf("%s: segfault in pid=%d at faddr=%#lx fip=%#lx\n",
-		__func__, pid, faddr, fip);
-	n = __proc_kill(__uapi_tid, pid, SIGSEGV);
-	if(n != 0) {
-		printf("%s: Proc::kill() failed, n=%d\n", __func__, n);
+	n_items = -EFAULT;
+	goto end;
+}
+
+
+/* serves the fault @w in @sp all the way to its reply. caller holds vm_lock.
+ * when memory runs out, page replacement gets a go and the fault is retried
+ * once. returns the signal that the faulter should get once vm_lock has been
+ * released, or 0.
+ */
+static int serve_fault_locked(struct vm_space *sp, const struct pf_wait *w)
+{
+	L4_MapItem_t items[1 << MAX_FAULT_AROUND_LOG2];
+	int n;
+	for(int try = 0; try < 2; try++) {
+		if(try > 0) balance_free_pages();
+		mtx_lock(&sp->lock);
+		n = resolve_fault(items, sp, w);
+		if(n > 0) reply_fault(w->sender, items, n);
+		mtx_unlock(&sp->lock);
+		if(n != -ENOMEM) break;
+	}
+	return n == -EFAULT ? SIGSEGV : n == -ENOMEM ? SIGKILL : 0;
+}
+
+
+/* index of @w's pager in service_tids. */
+static inline int pager_of(const struct pf_wait *w) {
+	return pidof_NP(w->sender) % n_service_threads;
+}
+
+
+/* publishes the page that fill_thread_fn() read for @fill, or drops it when
+ * the read failed. returns the set of service threads, by bit index, that
+ * should complete_fill() the faults parked on it. when that's empty, @fill
+ * is released here. caller holds vm_lock.
+ */
+static unsigned finish_fill(struct pc_fill *fill)
+{
+	int eck = e_begin();
+	struct pl *link = fill->link;
+	bool ok = htable_del(&fill_table, hash_fill_by_page(fill, NULL), fill);
+	assert(ok);
+	if(fill->status < 0) {
+		printf("vm:%s: fill of %x:%lx:%x failed, n=%d\n", __func__,
+			(unsigned)PL_FSID(link), (unsigned long)PL_INO(link),
+			link->offset, fill->status);
+		unlink_cached_page(link);
+	} else {
+		TRACE_FAULT("vm:%s: filled %x:%lx:%x (%d bytes)\n", __func__,
+			(unsigned)PL_FSID(link), (unsigned long)PL_INO(link),
+			link->offset, fill->status);
+		atomic_store_explicit(&link->status, PL_LIVE_AGE(1),
+			memory_order_release);
 	}
-	muidl_raise_no_reply();
-	assert(invariants());
 	e_end(eck);
+
+	unsigned pagers = 0;
+	for(struct pf_wait *w = fill->waiters; w != NULL; w = w->next) {
+		pagers |= 1u << pager_of(w);
+	}
+	fill->n_pagers = __builtin_popcount(pagers);
+	if(pagers == 0) {
+		put_mfile(fill->file);
+		free(fill);
+	}
+	return pagers;
+}
+
+
+/* replays the faults parked on @fill whose pager is service thread @ix,
+ * which should be the caller. those whose fill failed get SIGBUS instead, and
+ * those that can't be served get the signal serve_fault_locked() returned.
+ */
+static void complete_fill(struct pc_fill *fill, int ix)
+{
+	assert(ix >= 0 && ix < n_service_threads);
+	assert(L4_SameThreads(L4_MyGlobalId(), service_tids[ix]));
+	mtx_lock(&vm_lock);
+	/* ours are taken off the list. those to be signaled are kept aside to be
+	 * handled once vm_lock is released, and the rest are freed.
+	 */
+	struct pf_wait *kill = NULL, **tail = &fill->waiters;
+	for(struct pf_wait *w = fill->waiters, *next; w != NULL; w = next) {
+		next = w->next;
+		if(pager_of(w) != ix) {
+			*tail = w;
+			tail = &w->next;
+			continue;
+		}
+		struct vm_space *sp = fill->status < 0 ? NULL : fault_space(w);
+		w->sig = fill->status < 0 ? SIGBUS
+			: sp != NULL ? serve_fault_locked(sp, w) : 0;
+		if(w->sig != 0) {
+			w->next = kill;
+			kill = w;
+		} else {
+			free(w);
+		}
+	}
+	*tail = NULL;
+	assert(fill->n_pagers > 0);
+	if(--fill->n_pagers == 0) {
+		assert(fill->waiters == NULL);
+		put_mfile(fill->file);
+		free(fill);
+	}
+	balance_free_pages();
+	mtx_unlock(&vm_lock);
+
+	for(struct pf_wait *w = kill; w != NULL; w = w->next) {
+		kill_faulter(w, w->sig);
+	}
+	if(kill != NULL) {
+		mtx_lock(&vm_lock);
+		for(struct pf_wait *w = kill, *next; w != NULL; w = next) {
+			next = w->next;
+			free(w);
+		}
+		mtx_unlock(&vm_lock);
+	}
+}
+
+
+static void vm_pf(L4_Word_t faddr, L4_Word_t fip, L4_MapItem_t *map_out)
+{
+	const struct pf_wait w = {
+		.sender = muidl_get_sender(), .faddr = faddr, .fip = fip,
+		.fault_rwx = L4_Label(muidl_get_tag()) & 7,
+	};
+	struct vm_space *sp = fault_space(&w);
+	if(sp != NULL) {
+		/* the fast path, and if that doesn't do it, the slow one. either way
+		 * the reply goes out by hand under the locks; see vm_lock.
+		 */
+		L4_MapItem_t item;
+		mtx_lock(&sp->lock);
+		int n = remap_fault(&item, sp, &w);
+		if(n > 0) reply_fault(w.sender, &item, n);
+		mtx_unlock(&sp->lock);
+		if(n == 0) {
+			mtx_lock(&vm_lock);
+			balance_free_pages();
+			int sig = serve_fault_locked(sp, &w);
+			mtx_unlock(&vm_lock);
+			if(sig != 0) kill_faulter(&w, sig);
+		}
+	}
+	/* replied already, or popped a segfault, or waiting for fill. */
+	muidl_raise_no_reply();
+}
+
+
+/* IPC loop of each service thread. fill completions for faults it's the
+ * pager for come in from fill_thread_fn() as well.
+ */
+static noreturn void serve(void)
+{
+	static const struct vm_impl_vtable vtab = {
+		/* Sneks::VM */
+		.mmap = &vm_mmap,
+		.munmap = &vm_munmap,
+		.fork = &vm_fork,
+		.configure = &vm_configure,
+		.upload_page = &vm_upload_page,
+		.upload_pages = &vm_upload_pages,
+		.breath_of_life = &vm_breath_of_life,
+		.brk = &vm_brk,
+		.erase = &vm_erase,
+		.pager = &vm_pager,
+		.mprotect = &vm_mprotect,
+		.madvise = &vm_madvise,
+		.mremap = &vm_mremap,
+		.mincore = &vm_mincore,
+
+		/* L4X2::FaultHandler */
+		.handle_fault = &vm_pf,
+		/* L4X2::X86IOFaultHandler */
+		.handle_x86_io_fault = &vm_iopf,
+	};
+	for(;;) {
+		close_dead_files();
+		L4_Word_t status = _muidl_vm_impl_dispatch(&vtab);
+		if(status == MUIDL_UNKNOWN_LABEL) {
+			L4_MsgTag_t tag = muidl_get_tag();
+			if(L4_IsLocalId(muidl_get_sender())
+				&& L4_Label(tag) == FILL_DONE_LABEL && tag.X.u == 2)
+			{
+				L4_Word_t fill, ix;
+				L4_StoreMR(1, &fill);
+				L4_StoreMR(2, &ix);
+				complete_fill((struct pc_fill *)fill, ix);
+			} else {
+				printf("vm: unknown message label=%#lx, u=%lu, t=%lu\n",
+					L4_Label(tag), L4_UntypedWords(tag), L4_TypedWords(tag));
+			}
+		} else if(status != 0 && !MUIDL_IS_L4_ERROR(status)) {
+			printf("vm: dispatch status %#lx (last tag %#lx)\n",
+				status, muidl_get_tag().raw);
+		}
+	}
+}
+
+
+static noreturn int service_thread_fn(void *param_ptr) {
+	serve();
 }
 
 
@@ -2396,20 +5730,40 @@ static COLD void find_max_addr(void)
 }
 
 
+static void ignore_opt_error(const char *fmt, ...) {
+	/* foo */
+}
+
+static const struct opt_table opts[] = {
+	OPT_WITH_ARG("--fault-around", &opt_set_intval, &opt_show_intval,
+		&fault_around_log2, "log2 of pages mapped per fault (default 2)"),
+	OPT_WITH_ARG("--threads", &opt_set_intval, &opt_show_intval,
+		&n_service_threads, "number of service threads (default one per CPU)"),
+	OPT_WITH_ARG("--merge-pages", &opt_set_intval, &opt_show_intval,
+		&merge_batch, "frames scanned for same-page merging per 100 ms (default 0, off)"),
+	OPT_ENDTABLE
+};
+
+
 int main(int argc, char *argv[])
 {
 	printf("vm sez hello!\n");
+	opt_register_table(opts, NULL);
+	if(!opt_parse(&argc, argv, &ignore_opt_error)) return EXIT_FAILURE;
+	fault_around_log2 = max(0, min(fault_around_log2, MAX_FAULT_AROUND_LOG2));
 	anon_fsid = pidof_NP(L4_MyGlobalId());
 	L4_ThreadId_t init_tid;
 	int n_phys = 0;
-	L4_Fpage_t *phys = init_protocol(&n_phys, &init_tid);
+	uint32_t salt[4];
+	L4_Fpage_t *phys = init_protocol(&n_phys, &init_tid, salt);
 	printf("vm: init protocol done.\n");
 
 	int eck = e_begin();
 	assert(invariants());
 	init_phys(phys, n_phys);
 	assert(invariants());
-	init_pc(phys, n_phys);
+	init_pc(phys, n_phys, salt);
+	init_zero_page();
 	assert(invariants());
 	free(phys);
 	e_end(eck);
@@ -2427,31 +5781,46 @@ int main(int argc, char *argv[])
 		abort();
 	}
 
-	/* main IPC loop. */
-	static const struct vm_impl_vtable vtab = {
-		/* Sneks::VM */
-		.mmap = &vm_mmap,
-		.munmap = &vm_munmap,
-		.fork = &vm_fork,
-		.configure = &vm_configure,
-		.upload_page = &vm_upload_page,
-		.breath_of_life = &vm_breath_of_life,
-		.brk = &vm_brk,
-		.erase = &vm_erase,
+	/* page cache fill thread. */
+	if(mtx_init(&vm_lock, mtx_plain) != thrd_success
+		|| mtx_init(&fill_lock, mtx_plain) != thrd_success
+		|| cnd_init(&fill_cond) != thrd_success
+		|| thrd_create(&fill_thrd, &fill_thread_fn, NULL) != thrd_success)
+	{
+		printf("vm: can't start fill thread\n");
+		abort();
+	}
 
-		/* L4X2::FaultHandler */
-		.handle_fault = &vm_pf,
-		/* L4X2::X86IOFaultHandler */
-		.handle_x86_io_fault = &vm_iopf,
-	};
-	for(;;) {
-		L4_Word_t status = _muidl_vm_impl_dispatch(&vtab);
-		if(status != 0 && !MUIDL_IS_L4_ERROR(status)) {
-			printf("vm: dispatch status %#lx (last tag %#lx)\n",
-				status, muidl_get_tag().raw);
-			assert(invariants());
+	/* same-page merging, and its thread if enabled. */
+	merge_sums = calloc(pp_total, sizeof *merge_sums);
+	if(merge_sums == NULL
+		|| (merge_batch > 0
+			&& thrd_create(&merge_thrd, &merge_thread_fn, NULL) != thrd_success))
+	{
+		printf("vm: can't start merge thread\n");
+		abort();
+	}
+
+	/* lending of frames to sysmem. */
+	if(thrd_create(&balloon_thrd, &balloon_thread_fn, NULL) != thrd_success) {
+		printf("vm: can't start balloon thread\n");
+		abort();
+	}
+
+	/* service threads. */
+	if(n_service_threads == 0) {
+		n_service_threads = L4_NumProcessors(L4_GetKernelInterface());
+	}
+	n_service_threads = max(1, min(n_service_threads, MAX_SERVICE_THREADS));
+	service_tids[0] = L4_MyGlobalId();
+	for(int i=1; i < n_service_threads; i++) {
+		thrd_t t;
+		if(thrd_create(&t, &service_thread_fn, NULL) != thrd_success) {
+			printf("vm: can't start service thread %d\n", i);
+			abort();
 		}
+		service_tids[i] = L4_GlobalIdOf(tidof_NP(t));
 	}
 
-	return 0;
+	serve();
 }
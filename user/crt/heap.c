@@ -1,10 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <ccan/minmax/minmax.h>
 #ifndef __SNEKS__
 #include <limits.h>
 #else
@@ -70,3 +72,38 @@ int munmap(void *addr, size_t length) {
 	int n = __vm_munmap(L4_Pager(), (L4_Word_t)addr, length);
 	return NTOERR(n);
 }
+
+int mprotect(void *addr, size_t length, int prot) {
+	int n = __vm_mprotect(L4_Pager(), (L4_Word_t)addr, length, prot);
+	return NTOERR(n);
+}
+
+int madvise(void *addr, size_t length, int advice) {
+	int n = __vm_madvise(L4_Pager(), (L4_Word_t)addr, length, advice);
+	return NTOERR(n);
+}
+
+int mincore(void *addr, size_t length, unsigned char *vec)
+{
+	const size_t chunk = SNEKS_VM_COREVEC_MAX * PAGE_SIZE;
+	for(size_t off = 0; off < length; off += chunk) {
+		unsigned n_vec = SNEKS_VM_COREVEC_MAX;
+		int n = __vm_mincore(L4_Pager(), (L4_Word_t)addr + off,
+			min_t(size_t, chunk, length - off), vec + off / PAGE_SIZE, &n_vec);
+		if(n != 0) return NTOERR(n);
+	}
+	return 0;
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+	L4_Word_t addr = (L4_Word_t)old_address, new_addr = 0;
+	if(flags & MREMAP_FIXED) {
+		va_list al;
+		va_start(al, flags);
+		new_addr = (L4_Word_t)va_arg(al, void *);
+		va_end(al);
+	}
+	int n = __vm_mremap(L4_Pager(), &addr, old_size, new_size, flags, new_addr);
+	return n == 0 ? (void *)addr : (NTOERR(n), MAP_FAILED);
+}
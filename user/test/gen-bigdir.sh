@@ -0,0 +1,16 @@
+#!/bin/sh
+set -e
+
+DIR=$1		# where the files go
+COUNT=$2	# how many
+GROUP=$3	# tup dependency group for the image contents
+
+# emits one rule that creates empty files entry-0000, entry-0001, and so on
+# in $DIR. tup won't take a loop's outputs without each being named.
+outs=""
+i=0
+while [ $i -lt $COUNT ]; do
+	outs="$outs $DIR/$(printf 'entry-%04d' $i)"
+	i=$((i + 1))
+done
+echo ": |> ^ BIGDIR $DIR^ touch %o |>$outs $GROUP"
@@ -0,0 +1,163 @@
+/* tests on name lookup and listing in a directory big enough for squashfs to
+ * give it a dir_index, in the subfilesystem image of path/mount.c. specific
+ * to sneks for the same reason as those.
+ */
+#ifdef __sneks__
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <ccan/str/str.h>
+#include <ccan/array_size/array_size.h>
+#include <sneks/test.h>
+
+/* named entry-0000 and onward, as generated by ../gen-bigdir.sh. */
+#define N_ENTRIES 2000
+
+static const char *mountpoint = TESTDIR "/user/test/path/mount/sub",
+	*image = TESTDIR "/user/test/path/mount/subfs.img";
+
+
+static int stat_entry(struct stat *st, const char *name)
+{
+	char path[200];
+	snprintf(path, sizeof path, "%s/bigdir/%s", mountpoint, name);
+	return stat(path, st);
+}
+
+
+/* look up every name in the directory, which covers the ones before the first
+ * index block, each index block's first and last, and those after the last.
+ * then look up names that aren't there but would sort before, after, and in
+ * between each of them.
+ */
+START_TEST(bigdir_lookup)
+{
+	diag("mountpoint=`%s', image=`%s'", mountpoint, image);
+	plan_tests(6);
+
+	int n = mount(image, mountpoint, "squashfs", 0, NULL);
+	skip_start(!ok(n == 0, "mount"), 5, "didn't mount, errno=%d", errno) {
+		struct stat st;
+		/* misses first, so that they don't find names already cached. */
+		ok(stat_entry(&st, "a-before") < 0 && errno == ENOENT,
+			"name before all is missing");
+		ok(stat_entry(&st, "zz-after") < 0 && errno == ENOENT,
+			"name after all is missing");
+		int n_bad = 0;
+		for(int i=-1; i < N_ENTRIES; i++) {
+			char name[32];
+			if(i < 0) strscpy(name, "entry-", sizeof name);
+			else snprintf(name, sizeof name, "entry-%04d+", i);
+			if(stat_entry(&st, name) == 0 || errno != ENOENT) {
+				if(n_bad++ == 0) diag("name=`%s' found, or errno=%d", name, errno);
+			}
+		}
+		if(!ok(n_bad == 0, "names in between are missing")) {
+			diag("n_bad=%d", n_bad);
+		}
+
+		n_bad = 0;
+		for(int i=0; i < N_ENTRIES; i++) {
+			char name[32];
+			snprintf(name, sizeof name, "entry-%04d", i);
+			if(stat_entry(&st, name) < 0 || !S_ISREG(st.st_mode)) {
+				if(n_bad++ == 0) diag("name=`%s' not found, errno=%d", name, errno);
+			}
+		}
+		if(!ok(n_bad == 0, "all names found")) diag("n_bad=%d", n_bad);
+
+		ok1(umount(mountpoint) == 0);
+	} skip_end;
+}
+END_TEST
+
+DECLARE_TEST("path:bigdir", bigdir_lookup);
+
+
+/* look some names up, then list the directory with readdir(). each name
+ * should come up once, in order, and with the same inode number that stat()
+ * gave for it; and the lookups should still work afterward.
+ */
+START_TEST(bigdir_getdents_after_lookup)
+{
+	diag("mountpoint=`%s', image=`%s'", mountpoint, image);
+	plan_tests(8);
+
+	static const int picks[] = {
+		0, 1, 255, 256, 511, 999, 1000, 1500, 1998, N_ENTRIES - 1,
+	};
+	ino_t inos[ARRAY_SIZE(picks)];
+	int n = mount(image, mountpoint, "squashfs", 0, NULL);
+	skip_start(!ok(n == 0, "mount"), 7, "didn't mount, errno=%d", errno) {
+		bool found = true;
+		for(int i=0; i < ARRAY_SIZE(picks); i++) {
+			char name[32];
+			snprintf(name, sizeof name, "entry-%04d", picks[i]);
+			struct stat st;
+			if(stat_entry(&st, name) < 0) {
+				diag("name=`%s' not found, errno=%d", name, errno);
+				found = false;
+				inos[i] = 0;
+			} else {
+				inos[i] = st.st_ino;
+			}
+		}
+		ok(found, "lookups before listing");
+
+		char dirpath[200];
+		snprintf(dirpath, sizeof dirpath, "%s/bigdir", mountpoint);
+		DIR *dirp = opendir(dirpath);
+		skip_start(!ok(dirp != NULL, "opendir"), 3, "no dir, errno=%d", errno) {
+			int count = 0, pick = 0;
+			bool in_order = true, inos_ok = true;
+			struct dirent *ent;
+			while(errno = 0, ent = readdir(dirp), ent != NULL) {
+				if(streq(ent->d_name, ".") || streq(ent->d_name, "..")) continue;
+				char want[32];
+				snprintf(want, sizeof want, "entry-%04d", count);
+				if(in_order && !streq(ent->d_name, want)) {
+					diag("d_name=`%s', want=`%s'", ent->d_name, want);
+					in_order = false;
+				}
+				if(pick < ARRAY_SIZE(picks) && picks[pick] == count) {
+					if(ent->d_ino != inos[pick]) {
+						diag("d_name=`%s', d_ino=%lu, st_ino=%lu", ent->d_name,
+							(unsigned long)ent->d_ino, (unsigned long)inos[pick]);
+						inos_ok = false;
+					}
+					pick++;
+				}
+				count++;
+			}
+			if(!ok(errno == 0 && count == N_ENTRIES, "listed all")) {
+				diag("errno=%d, count=%d", errno, count);
+			}
+			ok(in_order, "listed in order");
+			ok(inos_ok, "inode numbers match");
+			closedir(dirp);
+		} skip_end;
+
+		found = true;
+		for(int i=0; i < ARRAY_SIZE(picks); i++) {
+			char name[32];
+			snprintf(name, sizeof name, "entry-%04d", picks[i]);
+			struct stat st;
+			if(stat_entry(&st, name) < 0 || st.st_ino != inos[i]) {
+				diag("name=`%s' not found, errno=%d", name, errno);
+				found = false;
+			}
+		}
+		ok(found, "lookups after listing");
+
+		ok1(umount(mountpoint) == 0);
+	} skip_end;
+}
+END_TEST
+
+DECLARE_TEST("path:bigdir", bigdir_getdents_after_lookup);
+#endif
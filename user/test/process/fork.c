@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sneks/test.h>
 #ifdef __l4x2__
 #include <l4/types.h>
@@ -100,6 +101,88 @@ END_TEST
 
 DECLARE_TEST("process:fork", fork_deep);
 
+/* benchmark of fork(2) latency over the amount of dirty anonymous memory in
+ * the parent. each child writes into the copy-on-write memory and exits, and
+ * the parent checks that its own copy stayed put.
+ */
+START_LOOP_TEST(fork_latency, iter, 0, 2)
+{
+	const size_t sizes[] = { 0, 1024 * 1024, 8 * 1024 * 1024 };
+	const size_t size = sizes[iter];
+	const int n_forks = 16;
+	diag("size=%zu, n_forks=%d", size, n_forks);
+	plan_tests(4);
+
+	unsigned char *mem = NULL;
+	if(size > 0) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		fail_if(mem == MAP_FAILED, "mmap failed, errno=%d", errno);
+		for(size_t i = 0; i < size; i += 4096) mem[i] = i / 4096 + 1;
+	}
+
+#ifdef __l4x2__
+	L4_Clock_t start = L4_SystemClock();
+#endif
+	int n_ok = 0;
+	for(int i = 0; i < n_forks; i++) {
+		int child = fork();
+		if(child == 0) {
+			for(size_t j = 0; j < size; j += 4096) mem[j] = 0;
+			exit(0);
+		}
+		int st, pid = child > 0 ? waitpid(child, &st, 0) : -1;
+		if(pid == child && WIFEXITED(st) && WEXITSTATUS(st) == 0) n_ok++;
+	}
+#ifdef __l4x2__
+	L4_Clock_t end = L4_SystemClock();
+	diag("mean fork-exit-wait latency %lu us",
+		(unsigned long)(end.raw - start.raw) / n_forks);
+#endif
+	if(!ok(n_ok == n_forks, "all children exited")) {
+		diag("n_ok=%d", n_ok);
+	}
+
+	bool intact = true;
+	for(size_t i = 0; i < size; i += 4096) {
+		if(mem[i] != (unsigned char)(i / 4096 + 1)) intact = false;
+	}
+	ok(intact, "parent memory intact");
+
+	/* the parent writes after a fork while the child looks on. each sees its
+	 * own copy.
+	 */
+	int fds[2], n = pipe(fds);
+	fail_if(n < 0, "pipe failed, errno=%d", errno);
+	int child = fork();
+	if(child == 0) {
+		close(fds[1]);
+		char c;
+		bool same = read(fds[0], &c, 1) == 1;
+		for(size_t i = 0; i < size; i += 4096) {
+			if(mem[i] != (unsigned char)(i / 4096 + 1)) same = false;
+		}
+		exit(same ? 0 : 1);
+	}
+	close(fds[0]);
+	for(size_t i = 0; i < size; i += 4096) mem[i] = 0xff;
+	n = write(fds[1], "x", 1);
+	close(fds[1]);
+	bool written = n == 1;
+	for(size_t i = 0; i < size; i += 4096) {
+		if(mem[i] != 0xff) written = false;
+	}
+	ok(written, "parent memory writable");
+	int st, pid = child > 0 ? waitpid(child, &st, 0) : -1;
+	ok(pid == child && WIFEXITED(st) && WEXITSTATUS(st) == 0,
+		"child's copy unaffected by parent");
+
+	if(mem != NULL) munmap(mem, size);
+}
+END_TEST
+
+DECLARE_TEST("process:fork", fork_latency);
+
 /* access memory that wasn't mapped into the parent. this should pop a failure
  * in vm that only forks pages but not the maps they came from.
  */
@@ -118,6 +118,82 @@ END_TEST
 DECLARE_TEST("process:memory", mmap_basic);
 
 
+/* touching every other page of a map, then reading all of them back. on
+ * sneks this goes through vm's fault-around for the untouched neighbours;
+ * variables are private/shared and default/explicit window size.
+ */
+START_LOOP_TEST(mmap_fault_around, iter, 0, 3)
+{
+	const bool is_shared = !!(iter & 1), explicit = !!(iter & 2);
+	diag("is_shared=%s, explicit=%s", btos(is_shared), btos(explicit));
+	plan_tests(3);
+
+	const int page_size = sysconf(_SC_PAGESIZE), n_pages = 64;
+	int flags = MAP_ANONYMOUS | (is_shared ? MAP_SHARED : MAP_PRIVATE);
+#ifdef MAP_FAULTAROUND
+	if(explicit) flags |= MAP_FAULTAROUND(3);
+#endif
+	uint8_t *ptr = mmap(NULL, n_pages * page_size, PROT_READ | PROT_WRITE,
+		flags, -1, 0);
+	skip_start(!ok1(ptr != MAP_FAILED), 2, "no valid map") {
+		for(int i=0; i < n_pages; i += 2) ptr[i * page_size + 7] = i + 1;
+		bool zero_ok = true, data_ok = true;
+		for(int i=0; i < n_pages; i++) {
+			uint8_t *page = &ptr[i * page_size];
+			for(int j=0; j < page_size; j++) {
+				uint8_t want = (i & 1) == 0 && j == 7 ? i + 1 : 0;
+				if(page[j] == want) continue;
+				if(j == 7 && (i & 1) == 0) data_ok = false;
+				else zero_ok = false;
+				diag("page %d, byte %d: %#x (wanted %#x)", i, j, page[j], want);
+				break;
+			}
+		}
+		ok(zero_ok, "untouched memory is zero");
+		ok(data_ok, "written memory has data");
+		munmap(ptr, n_pages * page_size);
+	} skip_end;
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mmap_fault_around);
+
+
+/* reading a private anonymous map before writing any of it. on sneks the
+ * reads map a shared page of zeroes, which the writes should replace without
+ * affecting the pages that were only read.
+ */
+START_TEST(mmap_read_before_write)
+{
+	plan_tests(4);
+
+	const int page_size = sysconf(_SC_PAGESIZE), n_pages = 32;
+	uint8_t *ptr = mmap(NULL, n_pages * page_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	skip_start(!ok1(ptr != MAP_FAILED), 3, "no valid map") {
+		int sum = 0;
+		for(int i=0; i < n_pages * page_size; i++) sum += ptr[i];
+		ok(sum == 0, "untouched memory reads as zero");
+
+		for(int i=0; i < n_pages; i += 3) ptr[i * page_size + 11] = i + 1;
+		bool zero_ok = true, data_ok = true;
+		for(int i=0; i < n_pages; i++) {
+			uint8_t got = ptr[i * page_size + 11],
+				want = i % 3 == 0 ? i + 1 : 0;
+			if(got == want) continue;
+			diag("page %d: %#x (wanted %#x)", i, got, want);
+			if(i % 3 == 0) data_ok = false; else zero_ok = false;
+		}
+		ok(data_ok, "written pages have data");
+		ok(zero_ok, "pages only read are still zero");
+		munmap(ptr, n_pages * page_size);
+	} skip_end;
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mmap_read_before_write);
+
+
 /* MAP_FIXED to mmap(2). should overlap existing mappings. may fail at overlap
  * with sbrk().
  */
@@ -330,3 +406,361 @@ START_TEST(sbrk_backward)
 END_TEST
 
 DECLARE_TEST("process:memory", sbrk_backward);
+
+
+/* mprotect(2) taking write access away from a private anonymous page and
+ * giving it back. a write to the page while it's read-only should kill the
+ * writer.
+ */
+START_TEST(mprotect_basic)
+{
+	plan_tests(5);
+
+	const int page_size = sysconf(_SC_PAGESIZE);
+	char *ptr = mmap(NULL, page_size * 2, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(ptr == MAP_FAILED, "mmap(2), errno=%d", errno);
+	ptr[0] = 'x';
+	ptr[page_size] = 'y';
+
+	int n = mprotect(ptr, page_size, PROT_READ);
+	if(!ok(n == 0, "mprotect(2) to read-only")) diag("errno=%d", errno);
+	ok1(ptr[0] == 'x');
+
+	int child = fork();
+	if(child == 0) {
+		*(volatile char *)ptr = 'z';
+		exit(0);
+	}
+	int st, dead = waitpid(child, &st, 0);
+	fail_unless(dead == child, "waitpid(2), errno=%d", errno);
+	ok(WIFSIGNALED(st) && WTERMSIG(st) == SIGSEGV,
+		"write to read-only page segfaults");
+
+	n = mprotect(ptr, page_size, PROT_READ | PROT_WRITE);
+	if(!ok(n == 0, "mprotect(2) back to read-write")) diag("errno=%d", errno);
+	ptr[0] = 'w';
+	ok1(ptr[0] == 'w' && ptr[page_size] == 'y');
+
+	munmap(ptr, page_size * 2);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mprotect_basic);
+
+
+/* fork(2) of a private anonymous page made read-only by mprotect(2). after
+ * either side makes it writable again, writes shouldn't be seen by the other.
+ */
+START_TEST(mprotect_fork)
+{
+	plan_tests(4);
+
+	const int page_size = sysconf(_SC_PAGESIZE);
+	char *ptr = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(ptr == MAP_FAILED, "mmap(2), errno=%d", errno);
+	strcpy(ptr, "kahvia ja pullaa");
+	int n = mprotect(ptr, page_size, PROT_READ);
+	if(!ok(n == 0, "mprotect(2) to read-only")) diag("errno=%d", errno);
+
+	int child = fork_subtest_start("child's view") {
+		plan_tests(3);
+		ok1(strcmp(ptr, "kahvia ja pullaa") == 0);
+		n = mprotect(ptr, page_size, PROT_READ | PROT_WRITE);
+		if(!ok(n == 0, "mprotect(2) in child")) diag("errno=%d", errno);
+		strcpy(ptr, "teetä");
+		ok1(strcmp(ptr, "teetä") == 0);
+	} fork_subtest_end;
+	fork_subtest_ok1(child);
+	ok(strcmp(ptr, "kahvia ja pullaa") == 0, "child's write not seen");
+
+	n = mprotect(ptr, page_size, PROT_READ | PROT_WRITE);
+	fail_unless(n == 0, "mprotect(2) in parent, errno=%d", errno);
+	strcpy(ptr, "mehua");
+	ok(strcmp(ptr, "mehua") == 0, "parent's write");
+
+	munmap(ptr, page_size);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mprotect_fork);
+
+
+/* MADV_DONTNEED on private anonymous memory: the pages should read back as
+ * zero afterward, and the ones outside the range should keep their contents.
+ */
+START_TEST(madvise_dontneed)
+{
+	plan_tests(3);
+
+	const int page_size = sysconf(_SC_PAGESIZE), n_pages = 8;
+	uint8_t *ptr = mmap(NULL, n_pages * page_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(ptr == MAP_FAILED, "mmap(2), errno=%d", errno);
+	memset(ptr, 0xa5, n_pages * page_size);
+
+	int n = madvise(ptr + page_size, (n_pages - 2) * page_size, MADV_DONTNEED);
+	if(!ok(n == 0, "madvise(2)")) diag("errno=%d", errno);
+	bool zero_ok = true, data_ok = true;
+	for(int i=0; i < n_pages; i++) {
+		bool outside = i == 0 || i == n_pages - 1;
+		uint8_t want = outside ? 0xa5 : 0;
+		for(int j=0; j < page_size; j += 97) {
+			if(ptr[i * page_size + j] == want) continue;
+			diag("page %d offset %d: %#x (wanted %#x)", i, j,
+				ptr[i * page_size + j], want);
+			if(outside) data_ok = false; else zero_ok = false;
+			break;
+		}
+	}
+	ok(zero_ok, "dropped pages read as zero");
+	ok(data_ok, "pages outside range were kept");
+
+	munmap(ptr, n_pages * page_size);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", madvise_dontneed);
+
+
+/* MADV_MERGEABLE on four private anonymous pages, of which three are
+ * identical and the fourth is written all zeroes. once vm has merged them, a
+ * write to any of them should be seen on that page alone.
+ */
+START_TEST(madvise_mergeable)
+{
+	plan_tests(4);
+
+	const int page_size = sysconf(_SC_PAGESIZE), n_pages = 4;
+	uint8_t *ptr = mmap(NULL, n_pages * page_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(ptr == MAP_FAILED, "mmap(2), errno=%d", errno);
+	memset(ptr, 0x5a, 3 * page_size);
+	memset(ptr + 3 * page_size, 0, page_size);
+
+	int n = madvise(ptr, n_pages * page_size, MADV_MERGEABLE);
+	if(!ok(n == 0, "madvise(2)")) diag("errno=%d", errno);
+
+	ptr[7] = 1;
+	ok(ptr[7] == 1 && ptr[page_size + 7] == 0x5a
+		&& ptr[2 * page_size + 7] == 0x5a, "write to first copy");
+	ptr[2 * page_size + 7] = 2;
+	ok(ptr[7] == 1 && ptr[page_size + 7] == 0x5a
+		&& ptr[2 * page_size + 7] == 2, "write to last copy");
+	ptr[3 * page_size + 7] = 3;
+	bool zero_ok = true;
+	for(int i=0; i < page_size; i++) {
+		if(i != 7 && ptr[3 * page_size + i] != 0) zero_ok = false;
+	}
+	ok(zero_ok && ptr[3 * page_size + 7] == 3
+		&& ptr[page_size + 7] == 0x5a, "write to page of zeroes");
+
+	munmap(ptr, n_pages * page_size);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", madvise_mergeable);
+
+
+/* mremap(2) growing a private anonymous map, moving it if necessary, and
+ * shrinking it back in place. contents should be preserved both ways.
+ */
+START_LOOP_TEST(mremap_basic, iter, 0, 1)
+{
+	const bool maymove = !!(iter & 1);
+	diag("maymove=%s", btos(maymove));
+	plan_tests(4);
+
+	const int page_size = sysconf(_SC_PAGESIZE), n_pages = 4;
+	size_t len = n_pages * page_size;
+	uint8_t *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(ptr == MAP_FAILED, "mmap(2), errno=%d", errno);
+	for(int i=0; i < n_pages; i++) ptr[i * page_size + 7] = i + 1;
+
+	uint8_t *big = mremap(ptr, len, n_pages * 4 * page_size,
+		maymove ? MREMAP_MAYMOVE : 0);
+	imply_ok1(maymove, big != MAP_FAILED);
+	if(big == MAP_FAILED) {
+		diag("errno=%d", errno);
+		big = ptr;
+		skip(1, "not resized");
+	} else {
+		len = n_pages * 4 * page_size;
+		bool same = true;
+		for(int i=0; i < n_pages; i++) same &= big[i * page_size + 7] == i + 1;
+		big[n_pages * 4 * page_size - 1] = 0x55;
+		ok(same, "contents preserved after growing");
+	}
+
+	uint8_t *small = mremap(big, len, page_size, 0);
+	ok(small == big, "shrink happens in place");
+	ok1(small[7] == 1);
+
+	munmap(small, page_size);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mremap_basic);
+
+
+/* munmap(2) should give address space back for later mmap(2) to reuse, both
+ * as a hole between other maps and over many rounds of the same size.
+ */
+START_TEST(munmap_reuse)
+{
+	plan_tests(3);
+
+	const int page_size = sysconf(_SC_PAGESIZE);
+	const size_t len = 16 * page_size;
+	void *ptrs[3];
+	for(int i=0; i < 3; i++) {
+		ptrs[i] = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		fail_if(ptrs[i] == MAP_FAILED, "mmap(2), errno=%d", errno);
+	}
+	int n = munmap(ptrs[1], len);
+	fail_if(n != 0, "munmap(2), errno=%d", errno);
+	void *hole = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if(!ok(hole == ptrs[1], "hole was reused")) {
+		diag("ptrs[1]=%p, hole=%p", ptrs[1], hole);
+	}
+	if(hole != MAP_FAILED) munmap(hole, len);
+
+	/* 4 MiB a pop would run a 32-bit address space dry before the end. */
+	const size_t big = 4 * 1024 * 1024;
+	bool all_ok = true;
+	for(int i=0; i < 1200 && all_ok; i++) {
+		void *p = mmap(NULL, big, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if(p == MAP_FAILED) {
+			diag("i=%d, errno=%d", i, errno);
+			all_ok = false;
+		} else {
+			munmap(p, big);
+		}
+	}
+	ok(all_ok, "repeated map and unmap");
+
+	/* and the hint, when there's room at it. */
+	void *p = mmap(ptrs[1], len, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	ok1(p == ptrs[1]);
+	if(p != MAP_FAILED) munmap(p, len);
+
+	munmap(ptrs[0], len);
+	munmap(ptrs[2], len);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", munmap_reuse);
+
+
+/* mmap(2) after a MAP_FIXED map was put right underneath the previous one
+ * should step over the fixed map rather than land on top of it.
+ */
+START_TEST(mmap_under_fixed)
+{
+	plan_tests(3);
+
+	const int page_size = sysconf(_SC_PAGESIZE);
+	uint8_t *top = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(top == MAP_FAILED, "mmap(2), errno=%d", errno);
+	uint8_t *fixed = mmap(top - page_size, page_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+	if(!ok(fixed == top - page_size, "fixed map")) diag("errno=%d", errno);
+	fail_if(fixed == MAP_FAILED);
+	memset(fixed, 0xaa, page_size);
+
+	const size_t len = 4 * page_size;
+	uint8_t *more = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(more == MAP_FAILED, "mmap(2), errno=%d", errno);
+	if(!ok(more + len <= fixed || more >= top + page_size,
+		"new map clear of the others"))
+	{
+		diag("top=%p, fixed=%p, more=%p", top, fixed, more);
+	}
+	memset(more, 0x55, len);
+	bool intact = true;
+	for(int i=0; i < page_size && intact; i++) intact = fixed[i] == 0xaa;
+	ok(intact, "fixed map's contents");
+
+	munmap(more, len);
+	munmap(fixed, page_size);
+	munmap(top, page_size);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mmap_under_fixed);
+
+
+/* counts pages of [ptr, ptr + n_pages) that mincore(2) says are resident,
+ * or returns -1 on failure.
+ */
+static int count_resident(void *ptr, int n_pages)
+{
+	unsigned char vec[n_pages];
+	if(mincore(ptr, n_pages * sysconf(_SC_PAGESIZE), vec) != 0) {
+		diag("mincore(2) failed, errno=%d", errno);
+		return -1;
+	}
+	int count = 0;
+	for(int i=0; i < n_pages; i++) count += vec[i] & 1;
+	return count;
+}
+
+
+/* MAP_POPULATE on private anonymous memory: the pages should be resident
+ * before they're first touched, unlike those of a map without it, and read
+ * as zero and take writes like any others, in a map that's read-write or
+ * read-only.
+ */
+START_LOOP_TEST(mmap_populate, iter, 0, 1)
+{
+	const bool rdonly = !!(iter & 1);
+	diag("rdonly=%s", btos(rdonly));
+	plan_tests(4);
+
+	const int page_size = sysconf(_SC_PAGESIZE), n_pages = 16;
+	const int prot = PROT_READ | (rdonly ? 0 : PROT_WRITE);
+	uint8_t *ptr = mmap(NULL, n_pages * page_size, prot,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+	if(!ok(ptr != MAP_FAILED, "mmap(2)")) diag("errno=%d", errno);
+	fail_if(ptr == MAP_FAILED);
+
+	int n = count_resident(ptr, n_pages);
+	if(!ok(n == n_pages, "populated before first touch")) diag("n=%d", n);
+	uint8_t *lazy = mmap(NULL, n_pages * page_size, prot,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(lazy == MAP_FAILED, "mmap(2), errno=%d", errno);
+	n = count_resident(lazy, n_pages);
+	if(!ok(n == 0, "not populated without MAP_POPULATE")) diag("n=%d", n);
+	munmap(lazy, n_pages * page_size);
+
+	bool zero_ok = true;
+	for(int i=0; i < n_pages * page_size && zero_ok; i += 61) {
+		if(ptr[i] != 0) {
+			diag("offset %d: %#x", i, ptr[i]);
+			zero_ok = false;
+		}
+	}
+	if(!rdonly) {
+		memset(ptr, 0x3c, n_pages * page_size);
+		for(int i=0; i < n_pages * page_size && zero_ok; i += 61) {
+			if(ptr[i] != 0x3c) {
+				diag("offset %d after write: %#x", i, ptr[i]);
+				zero_ok = false;
+			}
+		}
+	}
+	ok(zero_ok, "contents");
+
+	munmap(ptr, n_pages * page_size);
+}
+END_TEST
+
+DECLARE_TEST("process:memory", mmap_populate);